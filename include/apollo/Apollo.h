@@ -6,13 +6,18 @@
 #ifndef APOLLO_H
 #define APOLLO_H
 
+#include <atomic>
 #include <fstream>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
 #include "apollo/Config.h"
 
+class TraceWriter;
+struct RegionProfile;
+
 class Apollo
 {
 public:
@@ -47,16 +52,46 @@ public:
   // DEPRECATED, use train.
   void flushAllRegionMeasurements(int step);
   void train(int step, bool doCollectPendingContext = true);
+  // Advances the non-blocking exchange of collective training
+  // (APOLLO_COLLECTIVE_STRATEGY=iallgather), if any, and trains the models
+  // once it completes. Blocks until completion if wait is true.
+  void progressCollectiveTraining(bool wait = false);
+  // Writes the APOLLO_PROFILE overhead table of all regions created, as CSV.
+  void writeProfile(std::ostream &os);
 
 private:
   Apollo();
   //
   void gatherCollectiveTrainingData(int step);
+  // Inserts the exchange blocks of other ranks, at disp[rank] of size
+  // size_per_rank[rank] bytes in buf, to the region datasets.
+  void insertCollectiveTrainingData(int step,
+                                    const char *buf,
+                                    const std::vector<int> &size_per_rank,
+                                    const std::vector<int> &disp);
+  void trainModels(int step, bool doCollectPendingContexts);
+  // Non-blocking exchange state, the exchange starts from a copy of the
+  // region datasets so execution keeps inserting measurements meanwhile.
+  struct CollectiveExchange;
+  std::unique_ptr<CollectiveExchange> collective_exchange;
+  // True while an exchange is in progress, checked by Region::begin().
+  bool collective_pending;
+  void startCollectiveTraining(int step);
+  // Reduces region datasets within nodes and across node leaders to rank 0,
+  // which trains and broadcasts the models.
+  void trainHierarchical(int step);
   // Key: region name, value: region raw pointer
   std::map<std::string, Apollo::Region *> regions;
   // Count total number of region invocations
-  unsigned long long region_executions;
+  std::atomic<unsigned long long> region_executions;
   std::ofstream gtrace_file;
+  // Binary execution trace, null unless APOLLO_TRACE_BINARY is enabled.
+  std::unique_ptr<TraceWriter> trace_writer;
+  // Policy trace of APOLLO_TRACE_POLICY.
+  std::ofstream policy_trace_file;
+  // Key: region name, value: overhead counters of APOLLO_PROFILE, kept after
+  // the region is deleted.
+  std::map<std::string, std::shared_ptr<RegionProfile>> profiles;
 };  // end: Apollo
 
 extern "C" {
@@ -69,6 +104,15 @@ void __apollo_region_begin(Apollo::Region *r);
 void __apollo_region_end(Apollo::Region *r);
 void __apollo_region_set_feature(Apollo::Region *r, float feature);
 int __apollo_region_get_policy(Apollo::Region *r);
+void __apollo_region_get_policies(Apollo::Region *r,
+                                  const float *features,
+                                  size_t n,
+                                  int *policies);
+void __apollo_region_record_batch(Apollo::Region *r,
+                                  const float *features,
+                                  const int *policies,
+                                  const double *metrics,
+                                  size_t n);
 void __apollo_region_train(Apollo::Region *r, int step);
 }
 
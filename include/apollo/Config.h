@@ -26,11 +26,21 @@ public:
   static int APOLLO_GLOBAL_TRAIN_PERIOD;
   static int APOLLO_PER_REGION_TRAIN_PERIOD;
   static int APOLLO_TRACE_CSV;
+  static int APOLLO_TRACE_BINARY;
   static int APOLLO_PERSISTENT_DATASETS;
   static int APOLLO_STORE_EXEC_INFO;
+  static int APOLLO_CONTEXT_POOL_SIZE;
+  static int APOLLO_PER_THREAD_CONTEXTS;
+  static int APOLLO_MAX_THREADS;
+  static int APOLLO_ASYNC_TRAINING;
+  static int APOLLO_PROFILE;
+  static int APOLLO_RANKS_PER_NODE;
   static std::string APOLLO_POLICY_MODEL;
+  static std::string APOLLO_COLLECTIVE_STRATEGY;
+  static std::string APOLLO_SYNC_TIMER;
   static std::string APOLLO_OUTPUT_DIR;
   static std::string APOLLO_DATASETS_DIR;
+  static std::string APOLLO_DATASET_FORMAT;
   static std::string APOLLO_TRACES_DIR;
   static std::string APOLLO_MODELS_DIR;
 
@@ -6,9 +6,12 @@
 #ifndef APOLLO_DATASET_H
 #define APOLLO_DATASET_H
 
+#include <cstdint>
 #include <iostream>
 #include <map>
 #include <numeric>
+#include <string>
+#include <tuple>
 #include <utility>
 #include <vector>
 
@@ -17,28 +20,118 @@
 class Apollo::Dataset
 {
 public:
-  size_t size();
+  // Reduces the metrics of a row to the objective value minimized by policy
+  // selection.
+  struct Objective {
+    enum Kind {
+      // Weighted sum of the metrics.
+      WEIGHTED,
+      // Policies of the Pareto front of rows with equal features come first,
+      // ordered by the weighted distance to the ideal point of the front
+      // with metrics normalized to [0, 1] over the rows with those features.
+      PARETO
+    };
+    Kind kind = WEIGHTED;
+    // Missing weights are 0. If empty, the weighted sum is the first metric
+    // and Pareto distances weigh metrics equally.
+    std::vector<double> weights;
+
+    // Parses kind weighted|pareto and weights separated by ':', e.g.,
+    // "1:0.5". Throws std::runtime_error on malformed values.
+    static Objective parse(const std::string &kind, const std::string &weights);
+  };
+
+  Dataset();
+
+  size_t size() const;
   void clear();
 
-  void insert(std::vector<float> &features, int policy, double metric);
-  void insert(Apollo::Dataset &ds);
+  void insert(const std::vector<float> &features, int policy, double metric);
+  void insert(const std::vector<float> &features,
+              int policy,
+              const std::vector<double> &metrics);
+  // Insert a row of getNumFeatures() features.
+  void insert(const float *features, int policy, double metric);
+  void insert(const float *features,
+              int policy,
+              const double *metrics,
+              int num_metrics);
+  void insert(const Apollo::Dataset &ds);
+  // Bulk insert n rows from a row-major n x num_features features matrix,
+  // the policy column and a row-major n x num_metrics metrics matrix.
+  void insertRows(int num_features,
+                  const float *features,
+                  const int *policies,
+                  const double *metrics,
+                  size_t n);
+  void insertRows(int num_features,
+                  int num_metrics,
+                  const float *features,
+                  const int *policies,
+                  const double *metrics,
+                  size_t n);
 
+  // Number of features per row, -1 if the dataset has never been inserted to.
+  int getNumFeatures() const { return num_features; }
+  // Number of metrics per row, 1 unless inserted rows have more.
+  int getNumMetrics() const { return num_metrics; }
+  // Row accessors, rows are stored in insertion order.
+  const float *getFeatures(size_t row) const
+  {
+    return features.data() + row * num_features;
+  }
+  int getPolicy(size_t row) const { return policies[row]; }
+  double getMetric(size_t row, int metric = 0) const
+  {
+    return metrics[row * num_metrics + metric];
+  }
+  // Column of size() policies, row-major size() x getNumMetrics() metrics.
+  const int *getPolicies() const { return policies.data(); }
+  const double *getMetrics() const { return metrics.data(); }
+
+  void setObjective(const Objective &objective) { this->objective = objective; }
+  const Objective &getObjective() const { return objective; }
+  // Objective value of every row, the metric of single-metric datasets with
+  // the default objective.
+  std::vector<double> getObjectiveValues() const;
+
+  // Rows of features, policy, objective value.
   const std::vector<std::tuple<std::vector<float>, int, double>>
   toVectorOfTuples() const;
 
+  // Selects the policy of minimum objective value for every distinct features.
   void findMinMetricPolicyByFeatures(
       std::vector<std::vector<float>> &features,
       std::vector<int> &policies,
       std::map<std::vector<float>, std::pair<int, double>> &min_metric_policies)
       const;
 
+  // YAML text format.
   void load(std::istream &is);
   void store(std::ostream &os);
+  // Versioned binary columnar format, memory-mapped on load. Throws
+  // std::runtime_error on malformed files.
+  void loadBinary(const std::string &path);
+  void storeBinary(const std::string &path);
 
 private:
-  //  Key: features, policy -> value: metric (execution time) exponential moving
-  //  average.
-  std::map<std::pair<std::vector<float>, int>, double> data;
+  //  Key: features, policy -> value: metrics (e.g., execution time)
+  //  exponential moving average. Rows are stored in row-major features and
+  //  metrics arenas and a policy column, indexed by an open-addressing
+  //  (linear probing) hash table of (features, policy).
+  int num_features;
+  int num_metrics;
+  std::vector<float> features;
+  std::vector<int> policies;
+  std::vector<double> metrics;
+  Objective objective;
+  // Slot: upper 32 bits hash tag, lower 32 bits row index + 1, 0 if empty.
+  std::vector<uint64_t> table;
+
+  void setNumFeatures(int num_features);
+  void setNumMetrics(int num_metrics);
+  void rehash(size_t capacity);
+  size_t findSlot(const float *features, int policy, uint64_t hash) const;
 };  // end: Apollo::Dataset
 
-#endif
\ No newline at end of file
+#endif
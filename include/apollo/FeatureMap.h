@@ -0,0 +1,167 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_FEATUREMAP_H
+#define APOLLO_FEATUREMAP_H
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace apollo
+{
+
+// FNV-1a step over the bits of features. Zeros are normalized so that -0.0
+// and 0.0 hash equally, as they compare equal.
+inline uint64_t hashFeatures(const float *features,
+                             int num_features,
+                             uint64_t h = 0xcbf29ce484222325ULL)
+{
+  for (int i = 0; i < num_features; ++i) {
+    float f = (features[i] == 0.0f ? 0.0f : features[i]);
+    uint32_t bits;
+    std::memcpy(&bits, &f, sizeof(bits));
+    h = (h ^ bits) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// Finalize (splitmix64) to spread entropy to the lower bits used for indexing
+// hash tables.
+inline uint64_t finalizeHash(uint64_t h)
+{
+  h ^= h >> 30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h >> 31;
+  return h;
+}
+
+// Features of a lookup with their hash computed once. The key references the
+// features, which must outlive it.
+struct FeatureKey {
+  FeatureKey(const float *features, int num_features)
+      : features(features),
+        num_features(num_features),
+        hash(finalizeHash(hashFeatures(features, num_features)))
+  {
+  }
+  explicit FeatureKey(const std::vector<float> &features)
+      : FeatureKey(features.data(), features.size())
+  {
+  }
+
+  const float *features;
+  int num_features;
+  uint64_t hash;
+};
+
+// Map of fixed-width feature vectors to values. Keys are stored contiguously
+// and indexed by an open-addressing (linear probing) hash table, so a lookup
+// is a single probe sequence over the table.
+template <typename T>
+class FeatureMap
+{
+public:
+  FeatureMap() : num_features(-1) {}
+
+  size_t size() const { return values.size(); }
+
+  void clear()
+  {
+    keys.clear();
+    values.clear();
+    std::fill(table.begin(), table.end(), 0);
+  }
+
+  // Returns the value of key, nullptr if there is none. Pointers are valid
+  // until the next insertion.
+  T *find(const FeatureKey &key)
+  {
+    if (key.num_features != num_features || table.empty()) return nullptr;
+
+    uint64_t entry = table[findSlot(key)];
+    return (entry != 0 ? &values[(entry & 0xffffffffULL) - 1] : nullptr);
+  }
+  const T *find(const FeatureKey &key) const
+  {
+    return const_cast<FeatureMap *>(this)->find(key);
+  }
+
+  // Inserts value for key, or assigns it if key exists.
+  T &insert(const FeatureKey &key, T value)
+  {
+    if (num_features != key.num_features) {
+      if (size() > 0)
+        throw std::runtime_error(
+            "FeatureMap expects " + std::to_string(num_features) +
+            " features per key but got " + std::to_string(key.num_features));
+      num_features = key.num_features;
+    }
+
+    // Keep the load factor at most 1/2.
+    if (2 * (size() + 1) > table.size())
+      rehash(std::max(MIN_TABLE_SIZE, 2 * table.size()));
+
+    size_t slot = findSlot(key);
+    if (table[slot] != 0) {
+      T &existing = values[(table[slot] & 0xffffffffULL) - 1];
+      existing = std::move(value);
+      return existing;
+    }
+
+    keys.insert(keys.end(), key.features, key.features + num_features);
+    values.push_back(std::move(value));
+    table[slot] = ((key.hash >> 32) << 32) | size();
+    return values.back();
+  }
+
+private:
+  static constexpr size_t MIN_TABLE_SIZE = 16;
+
+  int num_features;
+  std::vector<float> keys;
+  std::vector<T> values;
+  // Slot: upper 32 bits hash tag, lower 32 bits value index + 1, 0 if empty.
+  std::vector<uint64_t> table;
+
+  size_t findSlot(const FeatureKey &key) const
+  {
+    const size_t mask = table.size() - 1;
+    const uint64_t tag = key.hash >> 32;
+    for (size_t slot = key.hash & mask;; slot = (slot + 1) & mask) {
+      uint64_t entry = table[slot];
+      if (entry == 0) return slot;
+      if ((entry >> 32) != tag) continue;
+
+      size_t idx = (entry & 0xffffffffULL) - 1;
+      if (std::equal(key.features,
+                     key.features + num_features,
+                     keys.data() + idx * num_features))
+        return slot;
+    }
+  }
+
+  void rehash(size_t capacity)
+  {
+    table.assign(capacity, 0);
+    for (size_t idx = 0, end = size(); idx < end; ++idx) {
+      FeatureKey key(keys.data() + idx * num_features, num_features);
+      table[findSlot(key)] = ((key.hash >> 32) << 32) | (idx + 1);
+    }
+  }
+};
+
+template <typename T>
+constexpr size_t FeatureMap<T>::MIN_TABLE_SIZE;
+
+}  // end namespace apollo.
+
+#endif
@@ -6,6 +6,8 @@
 #ifndef APOLLO_POLICY_MODEL_H
 #define APOLLO_POLICY_MODEL_H
 
+#include <cstddef>
+#include <iostream>
 #include <string>
 #include <vector>
 
@@ -23,6 +25,20 @@ public:
   virtual ~PolicyModel() {}
   //
   virtual int getIndex(std::vector<float> &features) = 0;
+  // Selects policies for n feature vectors of num_features, stored row-major.
+  // Models override it to classify the batch in one pass.
+  virtual void getIndices(const float *features,
+                          int num_features,
+                          size_t n,
+                          int *policies)
+  {
+    std::vector<float> row(num_features);
+    for (size_t i = 0; i < n; ++i) {
+      row.assign(features + i * num_features,
+                 features + (i + 1) * num_features);
+      policies[i] = getIndex(row);
+    }
+  }
 
   virtual void store(const std::string &filename) = 0;
   virtual void load(const std::string &filename) = 0;
@@ -30,6 +46,11 @@ public:
   virtual bool isTrainable() = 0;
   virtual void train(Apollo::Dataset &dataset) = 0;
 
+  // Transfer a trained model across ranks. Models that do not support it
+  // return false, deserialize() makes the model non-trainable.
+  virtual bool serialize(std::ostream &os) { return false; }
+  virtual bool deserialize(std::istream &is) { return false; }
+
 
   int policy_count;
   std::string name = "";
@@ -6,8 +6,11 @@
 #ifndef APOLLO_REGION_H
 #define APOLLO_REGION_H
 
+#include <atomic>
 #include <chrono>
+#include <cstdint>
 #include <fstream>
+#include <future>
 #include <map>
 #include <memory>
 #include <unordered_map>
@@ -27,6 +30,8 @@ struct Apollo::RegionContext {
   std::vector<float> features;
   int policy;
   unsigned long long idx;
+  // Region::TimingKind of the timer, selects the context pool to recycle to.
+  int timing_kind;
   std::unique_ptr<Timer> timer;
 };  // end: Apollo::RegionContext
 
@@ -34,7 +39,15 @@ class Apollo::Region
 {
 
 public:
-  enum TimingKind { TIMING_SYNC, TIMING_CUDA_ASYNC, TIMING_HIP_ASYNC };
+  enum TimingKind {
+    TIMING_SYNC,
+    TIMING_CUDA_ASYNC,
+    TIMING_HIP_ASYNC,
+    // Host-side stand-in for device timers, used for testing the asynchronous
+    // execution path without a GPU.
+    TIMING_MOCK_ASYNC,
+    NUM_TIMING_KINDS
+  };
   Region(const int num_features,
          const char *regionName,
          int numAvailablePolicies,
@@ -44,6 +57,8 @@ public:
   ~Region();
 
   char name[64];
+  // Hash of the region name, identifies the region across ranks.
+  uint64_t region_id;
 
   // DEPRECATED interface assuming synchronous execution, will be removed
   void end();
@@ -57,10 +72,30 @@ public:
   Apollo::RegionContext *begin(const std::vector<float> &features);
   void end(Apollo::RegionContext *context);
   void end(Apollo::RegionContext *context, double metric);
+  // Records multiple metrics of the execution, e.g., time and energy, that
+  // the region objective reduces for policy selection. All executions of a
+  // region must record the same number of metrics.
+  void end(Apollo::RegionContext *context, const std::vector<double> &metrics);
   int getPolicyIndex(Apollo::RegionContext *context);
   void setFeature(Apollo::RegionContext *, float value);
-
-  int idx;
+  // Selects policies for n independent instances of the region, features
+  // are n rows of num_features stored row-major. The instances are not
+  // measured, use begin()/end() for executions that provide training data.
+  void getPolicyIndices(const float *features, size_t n, int *policies);
+  // Records n measured executions, features are n rows of num_features
+  // and metrics n rows of num_metrics stored row-major. Counts as n
+  // executions for training triggers, which are evaluated once for the batch.
+  void recordBatch(const float *features,
+                   const int *policies,
+                   const double *metrics,
+                   size_t n,
+                   int num_metrics = 1);
+
+  // Pre-create count contexts and their timers for the asynchronous timing
+  // kind tk, bounded by APOLLO_CONTEXT_POOL_SIZE.
+  void reserveContexts(TimingKind tk, size_t count);
+
+  std::atomic<int> idx;
   int num_features;
   int num_policies;
 
@@ -68,8 +103,12 @@ public:
   Apollo::Dataset dataset;
 
   std::unique_ptr<TimingModel> time_model;
-  std::unique_ptr<apollo::PolicyModel> model;
+  // Shared by all regions when APOLLO_SINGLE_MODEL is enabled.
+  std::shared_ptr<apollo::PolicyModel> model;
 
+  // Collect pending contexts and merge per-thread measurements of all
+  // threads, must not run concurrently with the region execution. Installs a
+  // model trained in the background, if any.
   void collectPendingContexts();
   void train(int step,
              bool doCollectPendingContexts = true,
@@ -80,21 +119,81 @@ public:
   std::string model_info;
   std::string model_name;
   std::unordered_map<std::string, std::string> model_params;
+  // Metric of synchronous executions, "time" or a perf_event counter metric
+  // given by the model_info param metric=<name>.
+  std::string metric;
 
 private:
   Apollo *apollo;
-  // DEPRECATED wil be removed
-  Apollo::RegionContext *current_context;
-  Apollo::RegionContext sync_context;
   std::ofstream trace_file;
-
-  std::vector<Apollo::RegionContext *> pending_contexts;
-  Apollo::RegionContext *createRegionContext(TimingKind tk);
-  void destroyRegionContext(Apollo::RegionContext *context);
-  void collectContext(Apollo::RegionContext *, double);
-  Apollo::RegionContext *getSyncContext();
-
-  void autoTrain();
+  // Binary trace ids, the model id is updated when the model changes.
+  uint32_t trace_region_id;
+  std::atomic<const apollo::PolicyModel *> trace_model;
+  std::atomic<uint32_t> trace_model_id;
+  // Overhead counters, null unless APOLLO_PROFILE is enabled.
+  std::shared_ptr<RegionProfile> profile;
+  // TimerPerfEvent::Metric of synchronous executions, -1 if they are timed.
+  int perf_metric;
+
+  // Execution state of a thread. Every thread has its own state when
+  // APOLLO_PER_THREAD_CONTEXTS is enabled, otherwise all threads share a
+  // single state.
+  struct ThreadState {
+    // DEPRECATED wil be removed
+    Apollo::RegionContext *current_context;
+    Apollo::RegionContext sync_context;
+    std::vector<Apollo::RegionContext *> pending_contexts;
+    // Free-list of asynchronous contexts per timing kind, recycled with their
+    // timers so that the steady-state begin()/end() path does not allocate.
+    std::vector<Apollo::RegionContext *> context_pool[NUM_TIMING_KINDS];
+    // Per-thread measurements, merged into the region dataset at train time.
+    Apollo::Dataset dataset;
+  };
+  // Thread states indexed by thread id, created on first use by each thread.
+  std::unique_ptr<std::atomic<ThreadState *>[]> thread_states;
+  int num_thread_states;
+  ThreadState *getThreadState();
+  ThreadState *createThreadState();
+
+  Apollo::RegionContext *createRegionContext(ThreadState *ts, TimingKind tk);
+  void destroyRegionContext(ThreadState *ts, Apollo::RegionContext *context);
+  void collectContext(ThreadState *ts,
+                      Apollo::RegionContext *,
+                      const double *metrics,
+                      int num_metrics);
+  // Writes the CSV and binary trace records of an execution.
+  void traceExecution(unsigned long long idx,
+                      const float *features,
+                      int row_size,
+                      int policy,
+                      double metric);
+  void collectPendingContexts(ThreadState *ts);
+
+  // Evaluates the training triggers after count executions.
+  void autoTrain(unsigned long long count = 1);
+  // Writes the APOLLO_TRACE_POLICY entries of n policy selections, features
+  // are n rows of row_size.
+  void tracePolicies(const float *features,
+                     int row_size,
+                     size_t n,
+                     const int *policies);
+
+  // Background training (APOLLO_ASYNC_TRAINING): a fresh model is trained on
+  // a snapshot of the dataset and published to trained_model, the region
+  // keeps using its current model until installTrainedModel() swaps it in.
+  std::atomic<apollo::PolicyModel *> trained_model;
+  std::future<void> training;
+  void trainInBackground(int step);
+  // True while a background training is running or its model is not
+  // installed yet.
+  bool isTrainingInBackground();
+  void installTrainedModel();
+  void storeModel(apollo::PolicyModel &policy_model, int step);
+
+  // Persistent dataset files in APOLLO_DATASET_FORMAT, loading falls back to
+  // the other format. Returns false if no dataset file exists.
+  bool loadDataset();
+  void storeDataset();
 
   int min_training_data;
 };  // end: Apollo::Region
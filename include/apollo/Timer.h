@@ -24,8 +24,10 @@ public:
   static std::unique_ptr<Timer> create();
 
   struct Sync;
+  struct Tsc;
   struct CudaAsync;
   struct HipAsync;
+  struct MockAsync;
 };  // end: Timer (abstract class)
 
 
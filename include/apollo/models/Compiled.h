@@ -0,0 +1,63 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_MODELS_COMPILED_H
+#define APOLLO_MODELS_COMPILED_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "apollo/PolicyModel.h"
+
+namespace apollo
+{
+// Dispatches to a tree model compiled into the application. Headers generated
+// by apollo-export from stored DecisionTree or RandomForest models register
+// their evaluation function by name during static initialization.
+class Compiled : public PolicyModel
+{
+public:
+  // Node of a flattened tree in breadth-first order, the children of an
+  // internal node are adjacent (right = left + 1).
+  struct Node {
+    // Split feature index, -1 for leaves.
+    int32_t feature_idx;
+    float threshold;
+    // Index of the left child for internal nodes, policy for leaves.
+    int32_t child_or_class;
+  };
+
+  typedef int (*EvaluateFunction)(const float *features);
+
+  Compiled(int num_policies, const std::string &model_name);
+  ~Compiled(){};
+
+  int getIndex(std::vector<float> &features);
+  void load(const std::string &filename){};
+  void store(const std::string &filename){};
+  bool isTrainable() { return false; }
+  void train(Apollo::Dataset &dataset) {}
+
+  static bool registerModel(const char *model_name, EvaluateFunction evaluate);
+
+  static inline int evaluateTree(const Node *nodes, const float *features)
+  {
+    int32_t idx = 0;
+    while (nodes[idx].feature_idx >= 0)
+      idx = nodes[idx].child_or_class +
+            !(features[nodes[idx].feature_idx] < nodes[idx].threshold);
+
+    return nodes[idx].child_or_class;
+  }
+
+private:
+  EvaluateFunction evaluate;
+
+};  // end: Compiled (class)
+
+}  // end namespace apollo.
+
+#endif
@@ -6,9 +6,9 @@
 #ifndef APOLLO_MODELS_DATASETMAP_H
 #define APOLLO_MODELS_DATASETMAP_H
 
-#include <map>
 #include <string>
 
+#include "apollo/FeatureMap.h"
 #include "apollo/PolicyModel.h"
 
 namespace apollo
@@ -28,7 +28,7 @@ public:
 
 private:
   // Maps features -> policy.
-  std::map<std::vector<float>, std::pair<int, double>> best_policies;
+  FeatureMap<int> best_policies;
 
 };  // end: DatasetMap (class)
 
@@ -34,10 +34,16 @@ public:
 
   int getIndex(void);
   int getIndex(std::vector<float> &features);
+  void getIndices(const float *features,
+                  int num_features,
+                  size_t n,
+                  int *policies);
   void store(const std::string &filename);
   bool isTrainable();
   void load(const std::string &filename);
   void train(Apollo::Dataset &dataset);
+  bool serialize(std::ostream &os);
+  bool deserialize(std::istream &is);
 
 private:
 #ifdef ENABLE_OPENCV
@@ -8,14 +8,16 @@
 
 #include <memory>
 #include <random>
+#include <string>
 #include <tuple>
-#include <unordered_map>
 
+#include "apollo/FeatureMap.h"
 #include "apollo/PolicyModel.h"
 
 namespace apollo
 {
 
+class FeatureEncoder;
 class Net;
 
 class PolicyNet : public PolicyModel
@@ -27,11 +29,18 @@ public:
             double beta,
             double beta1,
             double beta2,
-            double threshold);
+            double threshold,
+            const std::string &encoding,
+            int bits,
+            int buckets);
 
   ~PolicyNet();
 
   int getIndex(std::vector<float> &features);
+  void getIndices(const float *features,
+                  int num_features,
+                  size_t n,
+                  int *policies);
 
   void trainNet(std::vector<std::vector<float>> &states,
                 std::vector<int> &actions,
@@ -42,14 +51,24 @@ public:
   void store(const std::string &filename);
   void load(const std::string &filename);
 
-  std::unordered_map<std::string, std::vector<double>> actionProbabilityMap;
+  // Network inputs of the encoded features, fitted on the first training.
+  int getInputSize() const;
+
+  // Action probabilities by features, evaluated since the last training.
+  FeatureMap<std::vector<double>> actionProbabilityMap;
 
 private:
+  void createNet();
+
   int numPolicies;
+  std::unique_ptr<FeatureEncoder> encoder;
   std::unique_ptr<Net> net;
   std::mt19937_64 gen;
   double rewardMovingAvg = 0;
+  double lr;
   double beta;
+  double beta1;
+  double beta2;
   double threshold;
   int trainCount = 0;
   bool trainable;
@@ -29,6 +29,8 @@ public:
   RandomForest(int num_policies,
                unsigned num_trees,
                unsigned max_depth,
+               unsigned num_threads,
+               unsigned seed,
                std::unique_ptr<PolicyModel> &explorer);
   RandomForest(int num_policies, std::string path);
 
@@ -36,10 +38,16 @@ public:
 
   int getIndex(void);
   int getIndex(std::vector<float> &features);
+  void getIndices(const float *features,
+                  int num_features,
+                  size_t n,
+                  int *policies);
   void store(const std::string &filename);
   void load(const std::string &filename);
   bool isTrainable();
   void train(Apollo::Dataset &dataset);
+  bool serialize(std::ostream &os);
+  bool deserialize(std::istream &is);
 
 private:
 #ifdef ENABLE_OPENCV
@@ -6,6 +6,7 @@
 #ifndef APOLLO_MODELS_ROUNDROBIN_H
 #define APOLLO_MODELS_ROUNDROBIN_H
 
+#include <atomic>
 #include <map>
 #include <string>
 #include <vector>
@@ -28,7 +29,7 @@ public:
 
 private:
   std::map<std::vector<float>, int> policies;
-  int last_policy;
+  std::atomic<int> last_policy;
 
 };  // end: RoundRobin (class)
 
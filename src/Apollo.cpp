@@ -11,11 +11,13 @@
 
 #include <algorithm>
 #include <cassert>
+#include <climits>
 #include <cstdint>
 #include <cstring>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 #include <string>
 #include <typeinfo>
@@ -25,9 +27,42 @@
 #include "apollo/ModelFactory.h"
 #include "apollo/Region.h"
 #include "helpers/ErrorHandling.h"
+#include "helpers/Profile.h"
+#include "helpers/TscClock.h"
+#include "helpers/TraceWriter.h"
 
 #ifdef ENABLE_MPI
 MPI_Comm apollo_mpi_comm;
+// Communicators of hierarchical collective training, the leader
+// communicator is MPI_COMM_NULL on ranks that do not lead their node.
+static MPI_Comm apollo_node_comm = MPI_COMM_NULL;
+static MPI_Comm apollo_leader_comm = MPI_COMM_NULL;
+#endif
+
+struct Apollo::CollectiveExchange {
+#ifdef ENABLE_MPI
+  // Exchanges the sizes of rank contributions, then the contributions.
+  enum State { EXCHANGING_SIZES, EXCHANGING_DATA };
+  State state;
+  int step;
+  MPI_Request request;
+  int send_size;
+  std::vector<char> sendbuf;
+  std::vector<int> recv_size_per_rank;
+  std::vector<int> disp;
+  std::vector<uint64_t> recvbuf;
+#endif
+};
+
+#ifdef ENABLE_MPI
+static int completeCollectiveTrainingAtFinalize(MPI_Comm comm,
+                                                int keyval,
+                                                void *attr,
+                                                void *extra_state)
+{
+  Apollo::instance()->progressCollectiveTraining(/* wait */ true);
+  return MPI_SUCCESS;
+}
 #endif
 
 namespace apolloUtils
@@ -120,12 +155,17 @@ std::string Apollo::getCallpathOffset(int walk_distance)
 Apollo::Apollo()
 {
   region_executions = 0;
+  collective_pending = false;
 
   // Initialize config with defaults
   Config::APOLLO_POLICY_MODEL =
       apolloUtils::safeGetEnv("APOLLO_POLICY_MODEL", "Static,policy=0");
   Config::APOLLO_COLLECTIVE_TRAINING =
       std::stoi(apolloUtils::safeGetEnv("APOLLO_COLLECTIVE_TRAINING", "0"));
+  Config::APOLLO_COLLECTIVE_STRATEGY =
+      apolloUtils::safeGetEnv("APOLLO_COLLECTIVE_STRATEGY", "allgather");
+  Config::APOLLO_RANKS_PER_NODE =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_RANKS_PER_NODE", "0"));
   Config::APOLLO_LOCAL_TRAINING =
       std::stoi(apolloUtils::safeGetEnv("APOLLO_LOCAL_TRAINING", "1"));
   Config::APOLLO_SINGLE_MODEL =
@@ -154,14 +194,30 @@ Apollo::Apollo()
       apolloUtils::safeGetEnv("APOLLO_RETRAIN_REGION_THRESHOLD", "0.5"));
   Config::APOLLO_TRACE_CSV =
       std::stoi(apolloUtils::safeGetEnv("APOLLO_TRACE_CSV", "0"));
+  Config::APOLLO_TRACE_BINARY =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_TRACE_BINARY", "0"));
   Config::APOLLO_PERSISTENT_DATASETS =
       std::stoi(apolloUtils::safeGetEnv("APOLLO_PERSISTENT_DATASETS", "0"));
   Config::APOLLO_STORE_EXEC_INFO =
       std::stoi(apolloUtils::safeGetEnv("APOLLO_STORE_EXEC_INFO", "0"));
+  Config::APOLLO_CONTEXT_POOL_SIZE =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_CONTEXT_POOL_SIZE", "1024"));
+  Config::APOLLO_PER_THREAD_CONTEXTS =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_PER_THREAD_CONTEXTS", "0"));
+  Config::APOLLO_MAX_THREADS =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_MAX_THREADS", "256"));
+  Config::APOLLO_ASYNC_TRAINING =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_ASYNC_TRAINING", "0"));
+  Config::APOLLO_PROFILE =
+      std::stoi(apolloUtils::safeGetEnv("APOLLO_PROFILE", "0"));
+  Config::APOLLO_SYNC_TIMER =
+      apolloUtils::safeGetEnv("APOLLO_SYNC_TIMER", "monotonic");
   Config::APOLLO_OUTPUT_DIR =
       apolloUtils::safeGetEnv("APOLLO_OUTPUT_DIR", ".apollo");
   Config::APOLLO_DATASETS_DIR =
       apolloUtils::safeGetEnv("APOLLO_DATASETS_DIR", "datasets");
+  Config::APOLLO_DATASET_FORMAT =
+      apolloUtils::safeGetEnv("APOLLO_DATASET_FORMAT", "binary");
   Config::APOLLO_TRACES_DIR =
       apolloUtils::safeGetEnv("APOLLO_TRACES_DIR", "traces");
   Config::APOLLO_MODELS_DIR =
@@ -200,13 +256,56 @@ Apollo::Apollo()
     abort();
   }
 
+  if (Config::APOLLO_COLLECTIVE_STRATEGY != "allgather" &&
+      Config::APOLLO_COLLECTIVE_STRATEGY != "hierarchical" &&
+      Config::APOLLO_COLLECTIVE_STRATEGY != "iallgather") {
+    std::cerr << "Unknown APOLLO_COLLECTIVE_STRATEGY "
+              << Config::APOLLO_COLLECTIVE_STRATEGY
+              << ", expected allgather, hierarchical or iallgather"
+              << std::endl;
+    abort();
+  }
+
+  if (Config::APOLLO_SYNC_TIMER != "monotonic" &&
+      Config::APOLLO_SYNC_TIMER != "tsc") {
+    std::cerr << "Unknown APOLLO_SYNC_TIMER " << Config::APOLLO_SYNC_TIMER
+              << ", expected monotonic or tsc" << std::endl;
+    abort();
+  }
+  // Calibrate the TSC frequency upfront instead of in the first measurement.
+  if (Config::APOLLO_SYNC_TIMER == "tsc") TscClock::nsPerTick();
+
+  if (Config::APOLLO_COLLECTIVE_TRAINING &&
+      Config::APOLLO_COLLECTIVE_STRATEGY == "hierarchical") {
+    if (!Config::APOLLO_REGION_MODEL) {
+      std::cerr << "Hierarchical collective training requires region modeling"
+                << std::endl;
+      abort();
+    }
+    // Rank 0 broadcasts the models it trains within the train call.
+    if (Config::APOLLO_ASYNC_TRAINING) {
+      std::cerr << "Hierarchical collective training cannot train "
+                   "asynchronously"
+                << std::endl;
+      abort();
+    }
+  }
+
+  if (Config::APOLLO_DATASET_FORMAT != "binary" &&
+      Config::APOLLO_DATASET_FORMAT != "yaml") {
+    std::cerr << "Unknown APOLLO_DATASET_FORMAT "
+              << Config::APOLLO_DATASET_FORMAT << ", expected binary or yaml"
+              << std::endl;
+    abort();
+  }
+
   apolloUtils::createDir(Config::APOLLO_OUTPUT_DIR);
 
   if (Config::APOLLO_PERSISTENT_DATASETS)
     apolloUtils::createDir(Config::APOLLO_OUTPUT_DIR + "/" +
                            Config::APOLLO_DATASETS_DIR);
 
-  if (Config::APOLLO_TRACE_CSV)
+  if (Config::APOLLO_TRACE_CSV || Config::APOLLO_TRACE_BINARY)
     apolloUtils::createDir(Config::APOLLO_OUTPUT_DIR + "/" +
                            Config::APOLLO_TRACES_DIR);
 
@@ -218,6 +317,47 @@ Apollo::Apollo()
   MPI_Comm_dup(MPI_COMM_WORLD, &apollo_mpi_comm);
   MPI_Comm_rank(apollo_mpi_comm, &mpiRank);
   MPI_Comm_size(apollo_mpi_comm, &mpiSize);
+
+  if (Config::APOLLO_COLLECTIVE_TRAINING &&
+      Config::APOLLO_COLLECTIVE_STRATEGY == "hierarchical") {
+    // Ranks sharing memory reduce to their node leader, the node rank 0.
+    // Ordering by world rank makes rank 0 the leader of leaders.
+    MPI_Comm_split_type(apollo_mpi_comm,
+                        MPI_COMM_TYPE_SHARED,
+                        mpiRank,
+                        MPI_INFO_NULL,
+                        &apollo_node_comm);
+    int node_rank;
+    MPI_Comm_rank(apollo_node_comm, &node_rank);
+    // Split nodes into groups of APOLLO_RANKS_PER_NODE consecutive ranks,
+    // each with its own leader.
+    if (Config::APOLLO_RANKS_PER_NODE > 0) {
+      MPI_Comm shared_comm = apollo_node_comm;
+      MPI_Comm_split(shared_comm,
+                     node_rank / Config::APOLLO_RANKS_PER_NODE,
+                     node_rank,
+                     &apollo_node_comm);
+      MPI_Comm_free(&shared_comm);
+      MPI_Comm_rank(apollo_node_comm, &node_rank);
+    }
+    MPI_Comm_split(apollo_mpi_comm,
+                   (node_rank == 0 ? 0 : MPI_UNDEFINED),
+                   mpiRank,
+                   &apollo_leader_comm);
+  }
+
+  if (Config::APOLLO_COLLECTIVE_TRAINING &&
+      Config::APOLLO_COLLECTIVE_STRATEGY == "iallgather") {
+    collective_exchange = std::make_unique<CollectiveExchange>();
+    // MPI_Finalize deletes the attributes of MPI_COMM_SELF first, which
+    // completes an exchange still in progress.
+    int keyval;
+    MPI_Comm_create_keyval(MPI_COMM_NULL_COPY_FN,
+                           completeCollectiveTrainingAtFinalize,
+                           &keyval,
+                           nullptr);
+    MPI_Comm_set_attr(MPI_COMM_SELF, keyval, nullptr);
+  }
 #else
   mpiSize = 1;
   mpiRank = 0;
@@ -234,6 +374,19 @@ Apollo::Apollo()
                    "policy\n";
   }
 
+  if (Config::APOLLO_TRACE_BINARY)
+    trace_writer = std::make_unique<TraceWriter>(
+        Config::APOLLO_OUTPUT_DIR + "/" + Config::APOLLO_TRACES_DIR +
+            "/trace-rank-" + std::to_string(mpiRank),
+        mpiRank);
+
+  if (Config::APOLLO_TRACE_POLICY) {
+    std::string fname("rank-" + std::to_string(mpiRank) + "-policies.txt");
+    policy_trace_file.open(fname, std::ofstream::app);
+    if (policy_trace_file.fail())
+      fatal_error("Error opening trace file " + fname);
+  }
+
   return;
 }
 
@@ -255,202 +408,381 @@ Apollo::~Apollo()
     delete r;
   }
 
+  // After deleting regions, which store their datasets.
+  if (Config::APOLLO_PROFILE) {
+    std::string fname(Config::APOLLO_OUTPUT_DIR + "/apollo_profile-rank-" +
+                      std::to_string(mpiRank) + ".csv");
+    std::ofstream file_out(fname);
+    if (!file_out.is_open())
+      std::cerr << "ERROR: Cannot write apollo profile\n";
+    writeProfile(file_out);
+    file_out.close();
+
+    uint64_t executions = 0;
+    uint64_t ns = 0;
+    for (auto &it : profiles) {
+      RegionProfile &p = *it.second;
+      executions += p.collect.calls;
+      ns += p.policy.ns() + p.collect.ns() + p.train.ns() + p.store.ns();
+    }
+    std::cerr << "Apollo: profiled overhead " << ns / 1e6 << " ms, "
+              << (executions ? ns / executions : 0) << " ns per execution, in "
+              << fname << std::endl;
+  }
+
   gtrace_file.close();
+  // Flushes the binary trace after regions have collected their contexts.
+  trace_writer.reset();
+  policy_trace_file.close();
 
-  std::cerr << "Apollo: total region executions: " << region_executions
+  std::cerr << "Apollo: total region executions: " << region_executions.load()
             << std::endl;
 }
 
+void Apollo::writeProfile(std::ostream &os)
+{
+  os << "region,executions,collect_ns,policies,policy_ns,trainings,train_ns,"
+        "stores,store_ns,stored_bytes,model_bytes,ns_per_execution\n";
+  for (auto &it : profiles) {
+    RegionProfile &p = *it.second;
+    uint64_t executions = p.collect.calls;
+    uint64_t ns = p.policy.ns() + p.collect.ns() + p.train.ns() + p.store.ns();
+    os << it.first << "," << executions << "," << p.collect.ns() << ","
+       << p.policy.calls << "," << p.policy.ns() << "," << p.train.calls
+       << "," << p.train.ns() << "," << p.store.calls << "," << p.store.ns()
+       << "," << p.stored_bytes << "," << p.model_bytes << ","
+       << (executions ? ns / executions : 0) << "\n";
+  }
+}
+
 #ifdef ENABLE_MPI
-int get_mpi_pack_measure_size(int num_features, MPI_Comm comm)
-{
-  int size = 0, measure_size = 0;
-  // rank
-  MPI_Pack_size(1, MPI_INT, comm, &size);
-  measure_size += size;
-  // num features
-  MPI_Pack_size(1, MPI_INT, comm, &size);
-  measure_size += size;
-  // feature vector
-  MPI_Pack_size(num_features, MPI_FLOAT, comm, &size);
-  measure_size += size;
-  // policy
-  MPI_Pack_size(1, MPI_INT, comm, &size);
-  measure_size += size;
-  // region name
-  MPI_Pack_size(64, MPI_CHAR, comm, &size);
-  measure_size += size;
-  // metric
-  MPI_Pack_size(1, MPI_DOUBLE, comm, &size);
-  measure_size += size;
-
-  return measure_size;
-}
-
-void packMeasurements(char *buf, int size, int mpiRank, Apollo::Region *reg)
-{
-  int pos = 0;
-
-  auto measures = reg->dataset.toVectorOfTuples();
-  for (auto &measure : measures) {
-    const auto &features = std::get<0>(measure);
-    const int &policy = std::get<1>(measure);
-    const double &metric = std::get<2>(measure);
-
-    // rank
-    MPI_Pack(&mpiRank, 1, MPI_INT, buf, size, &pos, apollo_mpi_comm);
-    // std::cout << "rank," << rank << " pos: " << pos << std::endl;
-
-    // num features
-    MPI_Pack(&reg->num_features, 1, MPI_INT, buf, size, &pos, apollo_mpi_comm);
-    // std::cout << "rank," << rank << " pos: " << pos << std::endl;
-
-    // feature vector
-    for (const float &value : features) {
-      MPI_Pack(&value, 1, MPI_FLOAT, buf, size, &pos, apollo_mpi_comm);
-      // std::cout << "feature," << value << " pos: " << pos << std::endl;
-    }
+// Header of a region block in the collective exchange, followed by the
+// num_rows x num_metrics row-major metrics, num_rows x num_features row-major
+// features and num_rows policies of the region dataset, padded to 8 bytes.
+struct ExchangeBlockHeader {
+  uint64_t region_id;
+  int32_t num_features;
+  int32_t num_rows;
+  int32_t num_metrics;
+  int32_t reserved;
+};
+
+// Returns size as an MPI count, aborts if it exceeds the int range of MPI
+// counts and displacements.
+static int toMpiCount(size_t size)
+{
+  if (size > size_t(INT_MAX))
+    fatal_error("Collective training message of " + std::to_string(size) +
+                " bytes exceeds the MPI count limit");
+  return int(size);
+}
 
-    // policy index
-    MPI_Pack(&policy, 1, MPI_INT, buf, size, &pos, apollo_mpi_comm);
-    // std::cout << "policy_index," << policy_index << " pos: " << pos <<
-    // std::endl;
-    //  XXX: use 64 bytes fixed for region_name
-    //  region name
-    MPI_Pack(reg->name, 64, MPI_CHAR, buf, size, &pos, apollo_mpi_comm);
-    // std::cout << "region_name," << name << " pos: " << pos << std::endl;
-    //  average time
-    MPI_Pack(&metric, 1, MPI_DOUBLE, buf, size, &pos, apollo_mpi_comm);
-    // std::cout << "time_avg," << time_avg << " pos: " << pos << std::endl;
-  }
-  return;
+// Size of the block without padding.
+static size_t getExchangeDataSize(int num_features,
+                                  int num_metrics,
+                                  size_t num_rows)
+{
+  return sizeof(ExchangeBlockHeader) +
+         num_rows * (num_metrics * sizeof(double) +
+                     num_features * sizeof(float) + sizeof(int));
 }
-#endif
 
+static size_t getExchangeBlockSize(int num_features,
+                                   int num_metrics,
+                                   size_t num_rows)
+{
+  return (getExchangeDataSize(num_features, num_metrics, num_rows) + 7) &
+         ~size_t(7);
+}
 
-void Apollo::gatherCollectiveTrainingData(int step)
+// Describes the blocks of non-empty region datasets in place with an MPI
+// struct datatype, so sending copies no measurements. Headers are referenced
+// by the datatype. Returns the size in bytes of the described blocks.
+static int createExchangeType(
+    const std::map<std::string, Apollo::Region *> &regions,
+    std::vector<ExchangeBlockHeader> &headers,
+    MPI_Datatype *send_type)
 {
-#ifdef ENABLE_MPI
-  // MPI is enabled, proceed...
-  int send_size = 0;
-  for (auto &it : regions) {
-    Region *reg = it.second;
-    send_size +=
-        (get_mpi_pack_measure_size(reg->num_features, apollo_mpi_comm) *
-         reg->dataset.size());
-  }
+  static const char padding[8] = {0};
+  headers.clear();
+  headers.reserve(regions.size());
+  std::vector<int> block_lengths;
+  std::vector<MPI_Aint> block_addrs;
+  size_t send_size = 0;
+  auto addBlock = [&](const void *addr, size_t length) {
+    MPI_Aint block_addr;
+    MPI_Get_address(addr, &block_addr);
+    block_addrs.push_back(block_addr);
+    block_lengths.push_back(length);
+    send_size += length;
+  };
 
-  char *sendbuf = (char *)malloc(send_size);
-  // std::cout << "send_size: " << send_size << std::endl;
-  int offset = 0;
-  for (auto it = regions.begin(); it != regions.end(); ++it) {
-    Region *reg = it->second;
-    int reg_dataset_size =
-        (reg->dataset.size() *
-         get_mpi_pack_measure_size(reg->num_features, apollo_mpi_comm));
-    packMeasurements(sendbuf + offset, reg_dataset_size, mpiRank, reg);
-    offset += reg_dataset_size;
+  for (auto &it : regions) {
+    Apollo::Region *reg = it.second;
+    Apollo::Dataset &dataset = reg->dataset;
+    size_t num_rows = dataset.size();
+    if (num_rows == 0) continue;
+
+    int num_features = dataset.getNumFeatures();
+    int num_metrics = dataset.getNumMetrics();
+    headers.push_back(
+        {reg->region_id, num_features, (int32_t)num_rows, num_metrics, 0});
+    addBlock(&headers.back(), sizeof(ExchangeBlockHeader));
+    addBlock(dataset.getMetrics(), num_rows * num_metrics * sizeof(double));
+    if (num_features > 0)
+      addBlock(dataset.getFeatures(0), num_rows * num_features * sizeof(float));
+    addBlock(dataset.getPolicies(), num_rows * sizeof(int));
+    size_t pad = getExchangeBlockSize(num_features, num_metrics, num_rows) -
+                 getExchangeDataSize(num_features, num_metrics, num_rows);
+    if (pad > 0) addBlock(padding, pad);
   }
 
-  int num_ranks = mpiSize;
-  // std::cout << "num_ranks: " << num_ranks << std::endl;
+  std::vector<MPI_Datatype> block_types(block_lengths.size(), MPI_BYTE);
+  MPI_Type_create_struct(block_lengths.size(),
+                         block_lengths.data(),
+                         block_addrs.data(),
+                         block_types.data(),
+                         send_type);
+  MPI_Type_commit(send_type);
 
-  int recv_size_per_rank[num_ranks];
+  return toMpiCount(send_size);
+}
 
-  MPI_Allgather(
-      &send_size, 1, MPI_INT, &recv_size_per_rank, 1, MPI_INT, apollo_mpi_comm);
+// Appends the block of a non-empty dataset to buf.
+static void appendExchangeBlock(std::vector<char> &buf,
+                                uint64_t region_id,
+                                const Apollo::Dataset &dataset)
+{
+  size_t num_rows = dataset.size();
+  if (num_rows == 0) return;
+
+  int num_features = dataset.getNumFeatures();
+  int num_metrics = dataset.getNumMetrics();
+  size_t pos = buf.size();
+  buf.resize(pos + getExchangeBlockSize(num_features, num_metrics, num_rows),
+             0);
+  ExchangeBlockHeader header = {
+      region_id, num_features, (int32_t)num_rows, num_metrics, 0};
+  auto append = [&](const void *data, size_t length) {
+    if (length > 0) std::memcpy(&buf[pos], data, length);
+    pos += length;
+  };
+  append(&header, sizeof(ExchangeBlockHeader));
+  append(dataset.getMetrics(), num_rows * num_metrics * sizeof(double));
+  if (num_features > 0)
+    append(dataset.getFeatures(0), num_rows * num_features * sizeof(float));
+  append(dataset.getPolicies(), num_rows * sizeof(int));
+}
 
-  int recv_size = 0;
-  // std::cout << "RECV SIZES: " ;
-  for (int i = 0; i < num_ranks; i++) {
-    // std::cout << i << ":" << recv_size_per_rank[i] << ", ";
-    recv_size += recv_size_per_rank[i];
+// Calls f(header, features, policies, metrics) for every block in the size
+// bytes at buf, which must be 8-byte aligned.
+template <typename F>
+static void forEachExchangeBlock(const char *buf, size_t size, F f)
+{
+  size_t pos = 0;
+  while (pos < size) {
+    const ExchangeBlockHeader *header =
+        reinterpret_cast<const ExchangeBlockHeader *>(buf + pos);
+    int num_features = header->num_features;
+    int num_metrics = header->num_metrics;
+    size_t num_rows = header->num_rows;
+    const double *metrics = reinterpret_cast<const double *>(
+        buf + pos + sizeof(ExchangeBlockHeader));
+    const float *features =
+        reinterpret_cast<const float *>(metrics + num_rows * num_metrics);
+    const int *policies =
+        reinterpret_cast<const int *>(features + num_rows * num_features);
+    pos += getExchangeBlockSize(num_features, num_metrics, num_rows);
+
+    f(*header, features, policies, metrics);
   }
-  // std::cout << std::endl;
+}
 
-  char *recvbuf = (char *)malloc(recv_size);
+// Reduces the datasets of node leaders to leader rank 0 (world rank 0) along a
+// binomial tree, each leader sends its reduced datasets once.
+static void reduceAcrossLeaders(
+    std::unordered_map<uint64_t, Apollo::Dataset> &reduced)
+{
+  int rank, size;
+  MPI_Comm_rank(apollo_leader_comm, &rank);
+  MPI_Comm_size(apollo_leader_comm, &size);
+
+  for (int mask = 1; mask < size; mask <<= 1) {
+    if (rank & mask) {
+      std::vector<char> sendbuf;
+      for (auto &it : reduced)
+        appendExchangeBlock(sendbuf, it.first, it.second);
+      MPI_Send(sendbuf.data(),
+               toMpiCount(sendbuf.size()),
+               MPI_BYTE,
+               rank - mask,
+               0,
+               apollo_leader_comm);
+      return;
+    }
 
-  int disp[num_ranks];
-  disp[0] = 0;
-  for (int i = 1; i < num_ranks; i++) {
-    disp[i] = disp[i - 1] + recv_size_per_rank[i - 1];
+    if (rank + mask >= size) continue;
+
+    MPI_Status status;
+    int count;
+    MPI_Probe(rank + mask, 0, apollo_leader_comm, &status);
+    MPI_Get_count(&status, MPI_BYTE, &count);
+    std::vector<uint64_t> recvbuf((count + 7) / 8);
+    MPI_Recv(recvbuf.data(),
+             count,
+             MPI_BYTE,
+             rank + mask,
+             0,
+             apollo_leader_comm,
+             MPI_STATUS_IGNORE);
+    forEachExchangeBlock(reinterpret_cast<const char *>(recvbuf.data()),
+                         count,
+                         [&](const ExchangeBlockHeader &header,
+                             const float *features,
+                             const int *policies,
+                             const double *metrics) {
+                           reduced[header.region_id].insertRows(
+                               header.num_features,
+                               header.num_metrics,
+                               features,
+                               policies,
+                               metrics,
+                               header.num_rows);
+                         });
   }
+}
 
-  //std::cout <<"DISP: "; \
-    for(int i = 0; i < num_ranks; i++) { \
-        std::cout << i << ":" << disp[i] << ", "; \
-    } \
-    std::cout << std::endl;
+// Header of a region entry in the broadcast of hierarchical training,
+// followed by size bytes of a serialized model or of the exchange block of
+// the training dataset, padded to 8 bytes.
+struct TrainedRegionHeader {
+  uint64_t region_id;
+  uint64_t size;
+  int32_t kind;
+  int32_t reserved;
+};
+
+enum TrainedRegionKind { TRAINED_MODEL, TRAINING_DATASET };
+
+static void appendTrainedRegion(std::vector<char> &buf,
+                                uint64_t region_id,
+                                TrainedRegionKind kind,
+                                const char *data,
+                                size_t size)
+{
+  size_t pos = buf.size();
+  buf.resize(pos + sizeof(TrainedRegionHeader) + ((size + 7) & ~size_t(7)),
+             0);
+  TrainedRegionHeader header = {region_id, size, kind, 0};
+  std::memcpy(&buf[pos], &header, sizeof(TrainedRegionHeader));
+  if (size > 0)
+    std::memcpy(&buf[pos + sizeof(TrainedRegionHeader)], data, size);
+}
+#endif
+
+
+void Apollo::gatherCollectiveTrainingData(int step)
+{
+#ifdef ENABLE_MPI
+  std::vector<ExchangeBlockHeader> headers;
+  MPI_Datatype send_type;
+  int send_size = createExchangeType(regions, headers, &send_type);
 
-  MPI_Allgatherv(sendbuf,
-                 send_size,
-                 MPI_PACKED,
-                 recvbuf,
-                 recv_size_per_rank,
-                 disp,
-                 MPI_PACKED,
+  int num_ranks = mpiSize;
+  std::vector<int> recv_size_per_rank(num_ranks);
+  MPI_Allgather(&send_size,
+                1,
+                MPI_INT,
+                recv_size_per_rank.data(),
+                1,
+                MPI_INT,
+                apollo_mpi_comm);
+
+  // Rank contributions are multiples of 8 bytes, so columns are aligned in
+  // the receive buffer.
+  std::vector<int> disp(num_ranks);
+  size_t recv_size = 0;
+  for (int i = 0; i < num_ranks; i++) {
+    disp[i] = recv_size;
+    recv_size += recv_size_per_rank[i];
+  }
+  toMpiCount(recv_size);
+  std::vector<uint64_t> recvbuf((recv_size + 7) / 8);
+
+  MPI_Allgatherv(MPI_BOTTOM,
+                 send_size > 0 ? 1 : 0,
+                 send_type,
+                 recvbuf.data(),
+                 recv_size_per_rank.data(),
+                 disp.data(),
+                 MPI_BYTE,
                  apollo_mpi_comm);
+  MPI_Type_free(&send_type);
 
-  // std::cout << "BYTES TRANSFERRED: " << recv_size << std::endl;
+  insertCollectiveTrainingData(step,
+                               reinterpret_cast<const char *>(recvbuf.data()),
+                               recv_size_per_rank,
+                               disp);
+#else
+  throw std::runtime_error("Expected MPI enabled");
+#endif  // ENABLE_MPI
+}
+
+void Apollo::insertCollectiveTrainingData(int step,
+                                          const char *buf,
+                                          const std::vector<int> &size_per_rank,
+                                          const std::vector<int> &disp)
+{
+#ifdef ENABLE_MPI
+  int num_ranks = mpiSize;
+  std::unordered_map<uint64_t, Region *> regions_by_id;
+  for (auto &it : regions)
+    regions_by_id.emplace(it.second->region_id, it.second);
 
   std::stringstream trace_out;
   if (Config::APOLLO_TRACE_ALLGATHER)
     trace_out << "rank, region_name, features, policy, time_avg" << std::endl;
-  // std::cout << "Rank " << rank << " TOTAL_MEASURES: " << total_measures <<
-  // std::endl;
-
-  //int my_rank; \
-    MPI_Comm_rank( comm, &my_rank ); \
-    std::ofstream fout("step-" + std::to_string(step) + \
-                "-rank-" + std::to_string(my_rank) + "-gather.txt");
-  //std::stringstream dbgout; \
-    dbgout << "rank, region_name, features, policy_index, time_avg" << std::endl;
-
-  int pos = 0;
-  while (pos < recv_size) {
-    int rank;
-    int num_features;
-    std::vector<float> features;
-    int policy;
-    char region_name[64];
-    int exec_count;
-    double metric;
-
-    MPI_Unpack(recvbuf, recv_size, &pos, &rank, 1, MPI_INT, apollo_mpi_comm);
-    MPI_Unpack(
-        recvbuf, recv_size, &pos, &num_features, 1, MPI_INT, apollo_mpi_comm);
-    for (int j = 0; j < num_features; j++) {
-      float value;
-      MPI_Unpack(
-          recvbuf, recv_size, &pos, &value, 1, MPI_FLOAT, apollo_mpi_comm);
-      features.push_back(value);
-    }
-    MPI_Unpack(recvbuf, recv_size, &pos, &policy, 1, MPI_INT, apollo_mpi_comm);
-    MPI_Unpack(
-        recvbuf, recv_size, &pos, region_name, 64, MPI_CHAR, apollo_mpi_comm);
-    MPI_Unpack(
-        recvbuf, recv_size, &pos, &metric, 1, MPI_DOUBLE, apollo_mpi_comm);
-
-    if (Config::APOLLO_TRACE_ALLGATHER) {
-      trace_out << rank << ", " << region_name << ", ";
-      trace_out << "[ ";
-      for (auto &f : features) {
-        trace_out << (int)f << ", ";
-      }
-      trace_out << "], ";
-      trace_out << policy << ", " << metric << std::endl;
-    }
-
-    // Do not re-insert this rank's measurements
-    if (rank == mpiRank) continue;
 
-    // Find local region to reduce collective training data
-    // TODO keep unseen regions to boostrap their models on execution?
-    auto reg_iter = regions.find(region_name);
-    if (reg_iter != regions.end()) {
-      Region *reg = reg_iter->second;
-      reg->dataset.insert(features, policy, metric);
-    }
+  for (int rank = 0; rank < num_ranks; ++rank) {
+    forEachExchangeBlock(
+        buf + disp[rank],
+        size_per_rank[rank],
+        [&](const ExchangeBlockHeader &header,
+            const float *features,
+            const int *policies,
+            const double *metrics) {
+          int num_features = header.num_features;
+          size_t num_rows = header.num_rows;
+
+          // Find local region to reduce collective training data
+          // TODO keep unseen regions to boostrap their models on execution?
+          auto reg_iter = regions_by_id.find(header.region_id);
+          Region *reg =
+              (reg_iter != regions_by_id.end() ? reg_iter->second : nullptr);
+
+          if (Config::APOLLO_TRACE_ALLGATHER) {
+            std::string region_name = (reg ? reg->name : "<unknown>");
+            for (size_t i = 0; i < num_rows; ++i) {
+              trace_out << rank << ", " << region_name << ", ";
+              trace_out << "[ ";
+              for (int j = 0; j < num_features; ++j)
+                trace_out << (int)features[i * num_features + j] << ", ";
+              trace_out << "], ";
+              trace_out << policies[i] << ", "
+                        << metrics[i * header.num_metrics] << std::endl;
+            }
+          }
+
+          // Do not re-insert this rank's measurements
+          if (rank == mpiRank || !reg) return;
+
+          reg->dataset.insertRows(num_features,
+                                  header.num_metrics,
+                                  features,
+                                  policies,
+                                  metrics,
+                                  num_rows);
+        });
   }
 
   if (Config::APOLLO_TRACE_ALLGATHER) {
@@ -461,9 +793,252 @@ void Apollo::gatherCollectiveTrainingData(int step)
     fout << trace_out.str();
     fout.close();
   }
+#else
+  throw std::runtime_error("Expected MPI enabled");
+#endif  // ENABLE_MPI
+}
 
-  free(sendbuf);
-  free(recvbuf);
+void Apollo::startCollectiveTraining(int step)
+{
+#ifdef ENABLE_MPI
+  CollectiveExchange &exchange = *collective_exchange;
+  exchange.step = step;
+  exchange.sendbuf.clear();
+  for (auto &it : regions)
+    appendExchangeBlock(exchange.sendbuf,
+                        it.second->region_id,
+                        it.second->dataset);
+  exchange.send_size = toMpiCount(exchange.sendbuf.size());
+  exchange.recv_size_per_rank.resize(mpiSize);
+  MPI_Iallgather(&exchange.send_size,
+                 1,
+                 MPI_INT,
+                 exchange.recv_size_per_rank.data(),
+                 1,
+                 MPI_INT,
+                 apollo_mpi_comm,
+                 &exchange.request);
+  exchange.state = CollectiveExchange::EXCHANGING_SIZES;
+  collective_pending = true;
+#else
+  throw std::runtime_error("Expected MPI enabled");
+#endif  // ENABLE_MPI
+}
+
+void Apollo::progressCollectiveTraining(bool wait)
+{
+#ifdef ENABLE_MPI
+  if (!collective_pending) return;
+
+  CollectiveExchange &exchange = *collective_exchange;
+  while (true) {
+    int completed = 1;
+    if (wait)
+      MPI_Wait(&exchange.request, MPI_STATUS_IGNORE);
+    else
+      MPI_Test(&exchange.request, &completed, MPI_STATUS_IGNORE);
+    if (!completed) return;
+
+    if (exchange.state == CollectiveExchange::EXCHANGING_DATA) break;
+
+    int num_ranks = mpiSize;
+    exchange.disp.resize(num_ranks);
+    size_t recv_size = 0;
+    for (int i = 0; i < num_ranks; i++) {
+      exchange.disp[i] = recv_size;
+      recv_size += exchange.recv_size_per_rank[i];
+    }
+    toMpiCount(recv_size);
+    exchange.recvbuf.resize((recv_size + 7) / 8);
+    MPI_Iallgatherv(exchange.sendbuf.data(),
+                    exchange.send_size,
+                    MPI_BYTE,
+                    exchange.recvbuf.data(),
+                    exchange.recv_size_per_rank.data(),
+                    exchange.disp.data(),
+                    MPI_BYTE,
+                    apollo_mpi_comm,
+                    &exchange.request);
+    exchange.state = CollectiveExchange::EXCHANGING_DATA;
+  }
+
+  collective_pending = false;
+  insertCollectiveTrainingData(
+      exchange.step,
+      reinterpret_cast<const char *>(exchange.recvbuf.data()),
+      exchange.recv_size_per_rank,
+      exchange.disp);
+  exchange.sendbuf.clear();
+  exchange.recvbuf.clear();
+
+  trainModels(exchange.step, /* doCollectPendingContexts */ false);
+#endif  // ENABLE_MPI
+}
+
+void Apollo::trainHierarchical(int step)
+{
+#ifdef ENABLE_MPI
+  // Gather region datasets to the node leader over shared memory.
+  std::vector<ExchangeBlockHeader> headers;
+  MPI_Datatype send_type;
+  int send_size = createExchangeType(regions, headers, &send_type);
+
+  int node_rank, node_size;
+  MPI_Comm_rank(apollo_node_comm, &node_rank);
+  MPI_Comm_size(apollo_node_comm, &node_size);
+  std::vector<int> recv_size_per_rank(node_rank == 0 ? node_size : 0);
+  MPI_Gather(&send_size,
+             1,
+             MPI_INT,
+             recv_size_per_rank.data(),
+             1,
+             MPI_INT,
+             0,
+             apollo_node_comm);
+
+  std::vector<int> disp(recv_size_per_rank.size());
+  size_t recv_size = 0;
+  for (size_t i = 0; i < disp.size(); i++) {
+    disp[i] = recv_size;
+    recv_size += recv_size_per_rank[i];
+  }
+  toMpiCount(recv_size);
+  std::vector<uint64_t> recvbuf((recv_size + 7) / 8);
+
+  MPI_Gatherv(MPI_BOTTOM,
+              send_size > 0 ? 1 : 0,
+              send_type,
+              recvbuf.data(),
+              recv_size_per_rank.data(),
+              disp.data(),
+              MPI_BYTE,
+              0,
+              apollo_node_comm);
+  MPI_Type_free(&send_type);
+
+  std::unordered_map<uint64_t, Region *> regions_by_id;
+  for (auto &it : regions)
+    regions_by_id.emplace(it.second->region_id, it.second);
+
+  // Node leaders reduce measurements per (features, policy) key, then reduce
+  // across nodes to rank 0. Rank 0 measurements are already in its region
+  // datasets.
+  if (node_rank == 0) {
+    std::unordered_map<uint64_t, Apollo::Dataset> reduced;
+    const char *buf = reinterpret_cast<const char *>(recvbuf.data());
+    for (int i = (mpiRank == 0 ? 1 : 0); i < node_size; ++i)
+      forEachExchangeBlock(buf + disp[i],
+                           recv_size_per_rank[i],
+                           [&](const ExchangeBlockHeader &header,
+                               const float *features,
+                               const int *policies,
+                               const double *metrics) {
+                             reduced[header.region_id].insertRows(
+                                 header.num_features,
+                                 header.num_metrics,
+                                 features,
+                                 policies,
+                                 metrics,
+                                 header.num_rows);
+                           });
+    recvbuf.clear();
+
+    reduceAcrossLeaders(reduced);
+
+    if (mpiRank == 0)
+      for (auto &it : reduced) {
+        auto reg_iter = regions_by_id.find(it.first);
+        if (reg_iter != regions_by_id.end())
+          reg_iter->second->dataset.insert(it.second);
+      }
+  }
+
+  // Rank 0 trains once and broadcasts the trained models. Regions of models
+  // that cannot be serialized get the training dataset instead.
+  std::vector<char> payload;
+  if (mpiRank == 0) {
+    for (auto &it : regions) {
+      Region *reg = it.second;
+      if (!reg->model->isTrainable()) continue;
+
+      reg->train(step, /* doCollectPendingContexts */ false);
+
+      std::ostringstream model_out;
+      if (!reg->model->isTrainable() && reg->model->serialize(model_out)) {
+        std::string model_data = model_out.str();
+        appendTrainedRegion(payload,
+                            reg->region_id,
+                            TRAINED_MODEL,
+                            model_data.data(),
+                            model_data.size());
+      } else if (reg->dataset.size() > 0) {
+        std::vector<char> block;
+        appendExchangeBlock(block, reg->region_id, reg->dataset);
+        appendTrainedRegion(payload,
+                            reg->region_id,
+                            TRAINING_DATASET,
+                            block.data(),
+                            block.size());
+      }
+    }
+  }
+
+  uint64_t payload_size = payload.size();
+  MPI_Bcast(&payload_size, 1, MPI_UINT64_T, 0, apollo_mpi_comm);
+  if (payload_size == 0) return;
+  int payload_count = toMpiCount(payload_size);
+
+  if (mpiRank == 0) {
+    MPI_Bcast(payload.data(), payload_count, MPI_BYTE, 0, apollo_mpi_comm);
+    return;
+  }
+
+  std::vector<uint64_t> bcastbuf((payload_size + 7) / 8);
+  MPI_Bcast(bcastbuf.data(), payload_count, MPI_BYTE, 0, apollo_mpi_comm);
+
+  // Install the models of rank 0, regions unknown to rank 0 train locally.
+  std::unordered_map<uint64_t, Region *> untrained(regions_by_id);
+  const char *buf = reinterpret_cast<const char *>(bcastbuf.data());
+  size_t pos = 0;
+  while (pos < payload_size) {
+    const TrainedRegionHeader *header =
+        reinterpret_cast<const TrainedRegionHeader *>(buf + pos);
+    const char *data = buf + pos + sizeof(TrainedRegionHeader);
+    pos += sizeof(TrainedRegionHeader) + ((header->size + 7) & ~size_t(7));
+
+    auto reg_iter = untrained.find(header->region_id);
+    if (reg_iter == untrained.end()) continue;
+    Region *reg = reg_iter->second;
+    untrained.erase(reg_iter);
+    if (!reg->model->isTrainable()) continue;
+
+    if (header->kind == TRAINED_MODEL) {
+      std::istringstream model_in(std::string(data, header->size));
+      if (!reg->model->deserialize(model_in))
+        fatal_error("Error deserializing the model of region " +
+                    std::string(reg->name));
+    } else {
+      Apollo::Dataset dataset;
+      dataset.setObjective(reg->dataset.getObjective());
+      forEachExchangeBlock(data,
+                           header->size,
+                           [&](const ExchangeBlockHeader &block_header,
+                               const float *features,
+                               const int *policies,
+                               const double *metrics) {
+                             dataset.insertRows(block_header.num_features,
+                                                block_header.num_metrics,
+                                                features,
+                                                policies,
+                                                metrics,
+                                                block_header.num_rows);
+                           });
+      reg->model->train(dataset);
+    }
+  }
+
+  for (auto &it : untrained)
+    it.second->train(step, /* doCollectPendingContexts */ false);
 #else
   throw std::runtime_error("Expected MPI enabled");
 #endif  // ENABLE_MPI
@@ -476,13 +1051,35 @@ void Apollo::train(int step, bool doCollectPendingContexts)
 {
   int rank = mpiRank;  // Automatically 0 if not an MPI environment.
 
+  // Collect measurements, including per-thread ones, before exchanging or
+  // merging region datasets.
+  if (doCollectPendingContexts)
+    for (auto &it : regions)
+      it.second->collectPendingContexts();
+
   if (Config::APOLLO_COLLECTIVE_TRAINING) {
     // std::cout << "DO COLLECTIVE TRAINING" << std::endl; //ggout
+    if (Config::APOLLO_COLLECTIVE_STRATEGY == "hierarchical") {
+      trainHierarchical(step);
+      return;
+    }
+    // Complete the exchange of the previous call, if still in progress, and
+    // start exchanging the measurements of this call.
+    if (Config::APOLLO_COLLECTIVE_STRATEGY == "iallgather") {
+      progressCollectiveTraining(/* wait */ true);
+      startCollectiveTraining(step);
+      return;
+    }
     gatherCollectiveTrainingData(step);
   } else {
     // std::cout << "DO LOCAL TRAINING" << std::endl; //ggout
   }
 
+  trainModels(step, doCollectPendingContexts);
+}
+
+void Apollo::trainModels(int step, bool doCollectPendingContexts)
+{
   // Create a single model using all per-region measurements
   if (Config::APOLLO_SINGLE_MODEL) {
     Apollo::Dataset merged_dataset;
@@ -490,16 +1087,20 @@ void Apollo::train(int step, bool doCollectPendingContexts)
       Region *reg = it.second;
       // append per-region dataset to merged.
       merged_dataset.insert(reg->dataset);
+      merged_dataset.setObjective(reg->dataset.getObjective());
     }
 
-    // TODO: Each region trains its own identical, single model. Consider
-    // training the single model once and share to regions using a
-    // shared_ptr.
+    // Train the single model once and share it with all regions.
+    std::shared_ptr<apollo::PolicyModel> single_model;
     for (auto &it : regions) {
       Region *reg = it.second;
       // XXX: assumes all regions have the same model name, number of
       // features, number of policies, model_params
-      reg->model->train(merged_dataset);
+      if (!single_model) {
+        single_model = reg->model;
+        single_model->train(merged_dataset);
+      } else
+        reg->model = single_model;
     }
   } else {
     for (auto &it : regions) {
@@ -552,5 +1153,22 @@ int __apollo_region_get_policy(Apollo::Region *r)
   return policy;
 }
 
+void __apollo_region_get_policies(Apollo::Region *r,
+                                  const float *features,
+                                  size_t n,
+                                  int *policies)
+{
+  r->getPolicyIndices(features, n, policies);
+}
+
+void __apollo_region_record_batch(Apollo::Region *r,
+                                  const float *features,
+                                  const int *policies,
+                                  const double *metrics,
+                                  size_t n)
+{
+  r->recordBatch(features, policies, metrics, n);
+}
+
 void __apollo_region_train(Apollo::Region *r, int step) { r->train(step); }
 }
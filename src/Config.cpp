@@ -22,10 +22,20 @@ int Config::APOLLO_TRACE_BEST_POLICIES;
 int Config::APOLLO_GLOBAL_TRAIN_PERIOD;
 int Config::APOLLO_PER_REGION_TRAIN_PERIOD;
 int Config::APOLLO_TRACE_CSV;
+int Config::APOLLO_TRACE_BINARY;
 int Config::APOLLO_PERSISTENT_DATASETS;
 int Config::APOLLO_STORE_EXEC_INFO;
+int Config::APOLLO_CONTEXT_POOL_SIZE;
+int Config::APOLLO_PER_THREAD_CONTEXTS;
+int Config::APOLLO_MAX_THREADS;
+int Config::APOLLO_ASYNC_TRAINING;
+int Config::APOLLO_PROFILE;
+int Config::APOLLO_RANKS_PER_NODE;
 std::string Config::APOLLO_POLICY_MODEL;
+std::string Config::APOLLO_COLLECTIVE_STRATEGY;
+std::string Config::APOLLO_SYNC_TIMER;
 std::string Config::APOLLO_OUTPUT_DIR;
 std::string Config::APOLLO_DATASETS_DIR;
+std::string Config::APOLLO_DATASET_FORMAT;
 std::string Config::APOLLO_TRACES_DIR;
 std::string Config::APOLLO_MODELS_DIR;
@@ -5,47 +5,330 @@
 
 #include "apollo/Dataset.h"
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+#include "apollo/FeatureMap.h"
 #include "helpers/Parser.h"
 
-size_t Apollo::Dataset::size() { return data.size(); }
+// Hash of the (features, policy) key.
+static inline uint64_t hashKey(const float *features, int n, int policy)
+{
+  uint64_t h = apollo::hashFeatures(features, n);
+  h = (h ^ (uint32_t)policy) * 0x100000001b3ULL;
+  return apollo::finalizeHash(h);
+}
+
+static constexpr size_t MIN_TABLE_SIZE = 16;
+
+Apollo::Dataset::Objective Apollo::Dataset::Objective::parse(
+    const std::string &kind,
+    const std::string &weights)
+{
+  Objective objective;
+  if (kind == "pareto")
+    objective.kind = PARETO;
+  else if (kind != "weighted" && !kind.empty())
+    throw std::runtime_error("Unknown objective " + kind +
+                             ", expected weighted or pareto");
+
+  std::stringstream ss(weights);
+  std::string weight;
+  while (std::getline(ss, weight, ':')) {
+    size_t pos = 0;
+    double value = -1;
+    try {
+      value = std::stod(weight, &pos);
+    } catch (std::logic_error &e) {
+    }
+    if (pos != weight.size() || !(value >= 0))
+      throw std::runtime_error("Invalid objective weights " + weights +
+                               ", expected non-negative numbers separated "
+                               "by :");
+    objective.weights.push_back(value);
+  }
+
+  return objective;
+}
+
+Apollo::Dataset::Dataset() : num_features(-1), num_metrics(1) {}
+
+size_t Apollo::Dataset::size() const { return policies.size(); }
 
-void Apollo::Dataset::clear() { data.clear(); }
+void Apollo::Dataset::clear()
+{
+  features.clear();
+  policies.clear();
+  metrics.clear();
+  std::fill(table.begin(), table.end(), 0);
+}
+
+void Apollo::Dataset::setNumFeatures(int n)
+{
+  if (num_features == n) return;
+
+  if (num_features >= 0 && size() > 0)
+    throw std::runtime_error("Dataset expects " + std::to_string(num_features) +
+                             " features per row but got " + std::to_string(n));
+
+  num_features = n;
+}
+
+void Apollo::Dataset::setNumMetrics(int n)
+{
+  if (num_metrics == n) return;
+
+  if (n < 1 || size() > 0)
+    throw std::runtime_error("Dataset expects " + std::to_string(num_metrics) +
+                             " metrics per row but got " + std::to_string(n));
+
+  num_metrics = n;
+}
+
+size_t Apollo::Dataset::findSlot(const float *row_features,
+                                 int policy,
+                                 uint64_t hash) const
+{
+  const size_t mask = table.size() - 1;
+  const uint64_t tag = hash >> 32;
+  for (size_t slot = hash & mask;; slot = (slot + 1) & mask) {
+    uint64_t entry = table[slot];
+    if (entry == 0) return slot;
+    if ((entry >> 32) != tag) continue;
+
+    size_t row = (entry & 0xffffffffULL) - 1;
+    if (policies[row] != policy) continue;
+    if (std::equal(row_features,
+                   row_features + num_features,
+                   features.data() + row * num_features))
+      return slot;
+  }
+}
+
+void Apollo::Dataset::rehash(size_t capacity)
+{
+  table.assign(capacity, 0);
+  for (size_t row = 0, end = size(); row < end; ++row) {
+    const float *row_features = features.data() + row * num_features;
+    uint64_t hash = hashKey(row_features, num_features, policies[row]);
+    size_t slot = findSlot(row_features, policies[row], hash);
+    table[slot] = ((hash >> 32) << 32) | (row + 1);
+  }
+}
+
+std::vector<double> Apollo::Dataset::getObjectiveValues() const
+{
+  const std::vector<double> &weights = objective.weights;
+  auto weight = [&weights](int metric) {
+    if (weights.empty()) return 1.0;
+    return (metric < (int)weights.size() ? weights[metric] : 0.0);
+  };
+
+  std::vector<double> values(size());
+  if (objective.kind == Objective::WEIGHTED) {
+    if (weights.empty()) {
+      for (size_t row = 0, end = size(); row < end; ++row)
+        values[row] = getMetric(row);
+      return values;
+    }
+    for (size_t row = 0, end = size(); row < end; ++row) {
+      values[row] = 0;
+      for (int i = 0; i < num_metrics; ++i)
+        values[row] += weight(i) * getMetric(row, i);
+    }
+    return values;
+  }
+
+  // Pareto: group the rows by features.
+  apollo::FeatureMap<std::vector<size_t>> groups;
+  for (size_t row = 0, end = size(); row < end; ++row) {
+    apollo::FeatureKey key(getFeatures(row), num_features);
+    std::vector<size_t> *group = groups.find(key);
+    if (group)
+      group->push_back(row);
+    else
+      groups.insert(key, {row});
+  }
+
+  // Distances are at most the norm of the weights, dominated rows are
+  // offset past it to order after the front.
+  double max_distance = 0;
+  for (int i = 0; i < num_metrics; ++i)
+    max_distance += weight(i);
+  max_distance = std::sqrt(max_distance);
+
+  std::vector<double> min(num_metrics), max(num_metrics);
+  for (size_t row = 0, end = size(); row < end; ++row) {
+    apollo::FeatureKey key(getFeatures(row), num_features);
+    const std::vector<size_t> &group = *groups.find(key);
+    // Compute the values of a group once, at its first row.
+    if (group.front() != row) continue;
+
+    for (int i = 0; i < num_metrics; ++i) {
+      min[i] = max[i] = getMetric(row, i);
+      for (size_t r : group) {
+        min[i] = std::min(min[i], getMetric(r, i));
+        max[i] = std::max(max[i], getMetric(r, i));
+      }
+    }
+
+    for (size_t r : group) {
+      double distance = 0;
+      for (int i = 0; i < num_metrics; ++i) {
+        double range = max[i] - min[i];
+        double normalized =
+            (range > 0 ? (getMetric(r, i) - min[i]) / range : 0.0);
+        distance += weight(i) * normalized * normalized;
+      }
+      values[r] = std::sqrt(distance);
+
+      for (size_t other : group) {
+        bool dominates = true, better = false;
+        for (int i = 0; i < num_metrics && dominates; ++i) {
+          dominates = getMetric(other, i) <= getMetric(r, i);
+          better |= getMetric(other, i) < getMetric(r, i);
+        }
+        if (dominates && better) {
+          values[r] += 1 + max_distance;
+          break;
+        }
+      }
+    }
+  }
+
+  return values;
+}
 
 const std::vector<std::tuple<std::vector<float>, int, double>> Apollo::Dataset::
     toVectorOfTuples() const
 {
+  std::vector<double> values = getObjectiveValues();
   std::vector<std::tuple<std::vector<float>, int, double>> vector;
-  for (const auto &d : data) {
-    const auto &features = d.first.first;
-    const auto &policy = d.first.second;
-    const auto &metric = d.second;
-    vector.push_back(std::make_tuple(features, policy, metric));
+  vector.reserve(size());
+  for (size_t row = 0, end = size(); row < end; ++row) {
+    const float *row_features = getFeatures(row);
+    vector.push_back(std::make_tuple(
+        std::vector<float>(row_features, row_features + num_features),
+        policies[row],
+        values[row]));
   }
 
   return vector;
 }
 
-void Apollo::Dataset::insert(std::vector<float> &features,
+void Apollo::Dataset::insert(const std::vector<float> &features,
+                             int policy,
+                             double metric)
+{
+  setNumFeatures(features.size());
+  insert(features.data(), policy, &metric, 1);
+}
+
+void Apollo::Dataset::insert(const std::vector<float> &features,
+                             int policy,
+                             const std::vector<double> &metrics)
+{
+  setNumFeatures(features.size());
+  insert(features.data(), policy, metrics.data(), metrics.size());
+}
+
+void Apollo::Dataset::insert(const float *row_features,
                              int policy,
                              double metric)
 {
-  auto key = std::make_pair(std::move(features), policy);
-  auto it = data.find(key);
-  if (it == data.end())
-    data.emplace(std::move(key), metric);
-  else
-    // Exponential moving average (a=0.5) to update the metric.
-    it->second = .5 * it->second + .5 * metric;
+  insert(row_features, policy, &metric, 1);
 }
 
-void Apollo::Dataset::insert(Apollo::Dataset &ds)
+void Apollo::Dataset::insert(const float *row_features,
+                             int policy,
+                             const double *row_metrics,
+                             int n)
 {
-  for (auto &d : ds.data) {
-    auto features = d.first.first;
-    auto policy = d.first.second;
-    auto metric = d.second;
-    insert(features, policy, metric);
+  if (num_features < 0)
+    throw std::runtime_error("Dataset number of features is not set");
+  setNumMetrics(n);
+
+  // Keep the load factor at most 1/2.
+  if (2 * (size() + 1) > table.size())
+    rehash(std::max(MIN_TABLE_SIZE, 2 * table.size()));
+
+  uint64_t hash = hashKey(row_features, num_features, policy);
+  size_t slot = findSlot(row_features, policy, hash);
+  if (table[slot] != 0) {
+    size_t row = (table[slot] & 0xffffffffULL) - 1;
+    // Exponential moving average (a=0.5) to update the metrics.
+    for (int i = 0; i < num_metrics; ++i)
+      metrics[row * num_metrics + i] =
+          .5 * metrics[row * num_metrics + i] + .5 * row_metrics[i];
+    return;
   }
+
+  if (size() >= 0xffffffffULL)
+    throw std::runtime_error("Dataset exceeds the maximum number of rows");
+
+  features.insert(features.end(), row_features, row_features + num_features);
+  policies.push_back(policy);
+  metrics.insert(metrics.end(), row_metrics, row_metrics + num_metrics);
+  table[slot] = ((hash >> 32) << 32) | size();
+}
+
+void Apollo::Dataset::insert(const Apollo::Dataset &ds)
+{
+  if (&ds == this || ds.size() == 0) return;
+
+  setNumFeatures(ds.num_features);
+  for (size_t row = 0, end = ds.size(); row < end; ++row)
+    insert(ds.getFeatures(row),
+           ds.policies[row],
+           &ds.metrics[row * ds.num_metrics],
+           ds.num_metrics);
+}
+
+void Apollo::Dataset::insertRows(int num_features,
+                                 const float *features,
+                                 const int *policies,
+                                 const double *metrics,
+                                 size_t n)
+{
+  insertRows(num_features, 1, features, policies, metrics, n);
+}
+
+void Apollo::Dataset::insertRows(int num_features,
+                                 int num_metrics,
+                                 const float *features,
+                                 const int *policies,
+                                 const double *metrics,
+                                 size_t n)
+{
+  if (n == 0) return;
+
+  setNumFeatures(num_features);
+  setNumMetrics(num_metrics);
+
+  // Size the arena and the table once for the upper bound of new rows.
+  size_t rows = size() + n;
+  this->features.reserve(rows * num_features);
+  this->policies.reserve(rows);
+  this->metrics.reserve(rows * num_metrics);
+  size_t capacity = std::max(MIN_TABLE_SIZE, table.size());
+  while (capacity < 2 * rows)
+    capacity *= 2;
+  if (capacity > table.size()) rehash(capacity);
+
+  for (size_t i = 0; i < n; ++i)
+    insert(&features[i * num_features],
+           policies[i],
+           &metrics[i * num_metrics],
+           num_metrics);
 }
 
 void Apollo::Dataset::findMinMetricPolicyByFeatures(
@@ -55,20 +338,26 @@ void Apollo::Dataset::findMinMetricPolicyByFeatures(
     const
 {
   std::map<std::vector<float>, std::pair<int, double>> best_policies;
+  std::vector<double> values = getObjectiveValues();
 
-  // Reduce grouped data to best_policies that minimize the metric.
-  for (auto &d : data) {
-    const auto &features = d.first.first;
-    const auto &policy = d.first.second;
-    const auto &avg = d.second;
+  // Reduce grouped data to best_policies that minimize the objective.
+  for (size_t row = 0, end = size(); row < end; ++row) {
+    // Members features and policies are shadowed by the output arguments.
+    const float *row_features = getFeatures(row);
+    std::vector<float> key(row_features, row_features + num_features);
+    int policy = getPolicy(row);
+    double avg = values[row];
 
-    auto iter = best_policies.find(features);
+    auto iter = best_policies.find(key);
     if (iter == best_policies.end()) {
       best_policies.insert(
-          std::make_pair(features, std::make_pair(policy, avg)));
+          std::make_pair(std::move(key), std::make_pair(policy, avg)));
     } else {
-      double prev_avg = best_policies[features].second;
-      if (avg < prev_avg) best_policies[features] = std::make_pair(policy, avg);
+      // Break ties by the lowest policy index, independently of the
+      // insertion order.
+      auto &best = iter->second;
+      if (avg < best.second || (avg == best.second && policy < best.first))
+        best = std::make_pair(policy, avg);
     }
   }
 
@@ -94,19 +383,27 @@ void Apollo::Dataset::findMinMetricPolicyByFeatures(
 void Apollo::Dataset::store(std::ostream &os)
 {
   os << "data: {\n";
-  int idx = 0;
-  for (auto &d : data) {
-    const auto &features = d.first.first;
-    const auto &policy = d.first.second;
-    const auto &metric = d.second;
+  for (size_t idx = 0, end = size(); idx < end; ++idx) {
+    const float *row_features = getFeatures(idx);
+    const auto &policy = policies[idx];
     os << "  " << idx << ": { features: [ ";
-    for (auto &f : features)
-      os << float(f) << ",";
+    // Separate features by whitespace so that the parser reads them as
+    // distinct tokens.
+    for (int i = 0; i < num_features; ++i)
+      os << row_features[i] << ", ";
     os << " ], ";
     os << "policy: " << policy << ", ";
-    os << "xtime: " << metric;
+    // Rows of multiple metrics list them.
+    os << "xtime: ";
+    if (num_metrics == 1)
+      os << getMetric(idx);
+    else {
+      os << "[ ";
+      for (int i = 0; i < num_metrics; ++i)
+        os << getMetric(idx, i) << ", ";
+      os << " ]";
+    }
     os << " },\n";
-    ++idx;
   }
   os << "}\n";
 }
@@ -124,7 +421,7 @@ void Apollo::Dataset::load(std::istream &is)
     int idx;
     int policy;
     std::vector<float> features;
-    double xtime;
+    std::vector<double> xtime;
 
     parser.parse<int>(idx);
     parser.parseExpected(":");
@@ -153,8 +450,18 @@ void Apollo::Dataset::load(std::istream &is)
     parser.parseExpected(",");
     parser.getNextToken();
     parser.parseExpected("xtime:");
-    parser.getNextToken();
-    parser.parse<double>(xtime);
+    if (parser.getNextTokenEquals("[")) {
+      while (!parser.getNextTokenEquals("]")) {
+        double metric;
+        parser.parse<double>(metric);
+        parser.parseExpected(",");
+        xtime.push_back(metric);
+      }
+    } else {
+      double metric;
+      parser.parse<double>(metric);
+      xtime.push_back(metric);
+    }
 
     parser.getNextToken();
     parser.parseExpected("},");
@@ -172,3 +479,128 @@ void Apollo::Dataset::load(std::istream &is)
     insert(features, policy, xtime);
   }
 }
+
+// Binary dataset format, in native byte order:
+//   header:   DatasetFileHeader
+//   features: num_rows x num_features float32, row-major
+//   policies: num_rows int32
+//   padding to 8-byte alignment
+//   metrics:  num_rows x num_metrics float64, row-major
+// Version 1 files have a single metric, their num_metrics field is 0.
+struct DatasetFileHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order;
+  int32_t num_features;
+  uint32_t num_metrics;
+  uint64_t num_rows;
+};
+static_assert(sizeof(DatasetFileHeader) == 32, "Unexpected header size");
+
+static constexpr char DATASET_FILE_MAGIC[8] = {
+    'A', 'P', 'O', 'L', 'L', 'O', 'D', 'S'};
+static constexpr uint32_t DATASET_FILE_VERSION = 2;
+static constexpr uint32_t DATASET_FILE_BYTE_ORDER = 0x01020304;
+
+static inline uint64_t alignUp(uint64_t offset, uint64_t alignment)
+{
+  return (offset + alignment - 1) / alignment * alignment;
+}
+
+void Apollo::Dataset::storeBinary(const std::string &path)
+{
+  DatasetFileHeader header;
+  std::memcpy(header.magic, DATASET_FILE_MAGIC, sizeof(header.magic));
+  // Single-metric datasets keep version 1 for readers that predate version 2.
+  header.version = (num_metrics > 1 ? DATASET_FILE_VERSION : 1);
+  header.byte_order = DATASET_FILE_BYTE_ORDER;
+  header.num_features = std::max(num_features, 0);
+  header.num_metrics = (num_metrics > 1 ? num_metrics : 0);
+  header.num_rows = size();
+
+  std::ofstream ofs(path, std::ios::binary);
+  if (!ofs) throw std::runtime_error("Cannot open dataset file " + path);
+
+  uint64_t policies_end = sizeof(header) + features.size() * sizeof(float) +
+                          policies.size() * sizeof(int32_t);
+  const char padding[8] = {};
+
+  ofs.write(reinterpret_cast<const char *>(&header), sizeof(header));
+  ofs.write(reinterpret_cast<const char *>(features.data()),
+            features.size() * sizeof(float));
+  ofs.write(reinterpret_cast<const char *>(policies.data()),
+            policies.size() * sizeof(int32_t));
+  ofs.write(padding, alignUp(policies_end, sizeof(double)) - policies_end);
+  ofs.write(reinterpret_cast<const char *>(metrics.data()),
+            metrics.size() * sizeof(double));
+
+  if (!ofs) throw std::runtime_error("Cannot write dataset file " + path);
+}
+
+void Apollo::Dataset::loadBinary(const std::string &path)
+{
+  int fd = open(path.c_str(), O_RDONLY);
+  if (fd < 0) throw std::runtime_error("Cannot open dataset file " + path);
+
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(DatasetFileHeader)) {
+    close(fd);
+    throw std::runtime_error("Truncated dataset file " + path);
+  }
+
+  size_t length = st.st_size;
+  void *addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (addr == MAP_FAILED)
+    throw std::runtime_error("Cannot map dataset file " + path);
+
+  const char *base = static_cast<const char *>(addr);
+  const DatasetFileHeader *header =
+      reinterpret_cast<const DatasetFileHeader *>(base);
+
+  std::string error;
+  uint64_t features_offset = sizeof(DatasetFileHeader);
+  uint64_t policies_offset = 0, metrics_offset = 0, end = 0;
+  uint64_t file_num_metrics = (header->version == 1 ? 1 : header->num_metrics);
+  if (std::memcmp(header->magic, DATASET_FILE_MAGIC, sizeof(header->magic)))
+    error = "Invalid dataset file " + path;
+  else if (header->byte_order != DATASET_FILE_BYTE_ORDER)
+    error = "Dataset file " + path + " has a different byte order";
+  else if (header->version < 1 || header->version > DATASET_FILE_VERSION)
+    error = "Dataset file " + path + " has unsupported version " +
+            std::to_string(header->version);
+  else if (header->num_features < 0 || file_num_metrics < 1 ||
+           file_num_metrics > INT32_MAX)
+    error = "Invalid dataset file " + path;
+  else if (header->num_rows > length / sizeof(double) / file_num_metrics ||
+           (header->num_features > 0 &&
+            header->num_rows >
+                length / sizeof(float) / (uint64_t)header->num_features))
+    error = "Truncated dataset file " + path;
+  else {
+    policies_offset = features_offset + header->num_rows *
+                                            header->num_features *
+                                            sizeof(float);
+    metrics_offset = alignUp(
+        policies_offset + header->num_rows * sizeof(int32_t), sizeof(double));
+    end = metrics_offset + header->num_rows * file_num_metrics * sizeof(double);
+    if (end > length) error = "Truncated dataset file " + path;
+  }
+
+  if (error.empty()) {
+    try {
+      insertRows(header->num_features,
+                 file_num_metrics,
+                 reinterpret_cast<const float *>(base + features_offset),
+                 reinterpret_cast<const int *>(base + policies_offset),
+                 reinterpret_cast<const double *>(base + metrics_offset),
+                 header->num_rows);
+    } catch (std::runtime_error &e) {
+      error = e.what();
+    }
+  }
+
+  munmap(addr, length);
+
+  if (!error.empty()) throw std::runtime_error(error);
+}
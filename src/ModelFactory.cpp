@@ -6,9 +6,14 @@
 #include "apollo/ModelFactory.h"
 
 #include <cassert>
+#include <cstdlib>
 #include <iostream>
+#include <random>
+#include <stdexcept>
+#include <string>
 
 #include "apollo/models/DatasetMap.h"
+#include "apollo/models/Compiled.h"
 #include "apollo/models/DecisionTree.h"
 #include "apollo/models/Random.h"
 #include "apollo/models/RandomForest.h"
@@ -23,6 +28,21 @@
 namespace apollo
 {
 
+// Threads training a model, 1 unless OMP_NUM_THREADS sets them, so that ranks
+// sharing a node do not each train with all of its cores.
+static unsigned defaultTrainingThreads()
+{
+  const char *env = getenv("OMP_NUM_THREADS");
+  if (!env) return 1;
+  // OMP_NUM_THREADS may list the threads per nesting level, use the first.
+  try {
+    int threads = std::stoi(env);
+    return (threads > 0 ? threads : 1);
+  } catch (std::logic_error &e) {
+    return 1;
+  }
+}
+
 std::unique_ptr<PolicyModel> ModelFactory::createPolicyModel(
     const std::string &model_name,
     int num_policies,
@@ -95,13 +115,19 @@ std::unique_ptr<PolicyModel> ModelFactory::createPolicyModel(
 
     return std::make_unique<DecisionTree>(num_policies, max_depth, explorer);
   } else if (model_name == "RandomForest") {
-    // Default num_trees, max_depth
+    // Default num_trees, max_depth, num_threads, seed
     unsigned num_trees = 10;
     unsigned max_depth = 2;
+    unsigned num_threads = defaultTrainingThreads();
+    unsigned seed = std::mt19937::default_seed;
     auto it = model_params.find("num_trees");
     if (it != model_params.end()) num_trees = std::stoul(it->second);
     it = model_params.find("max_depth");
     if (it != model_params.end()) max_depth = std::stoul(it->second);
+    it = model_params.find("num_threads");
+    if (it != model_params.end()) num_threads = std::stoul(it->second);
+    it = model_params.find("seed");
+    if (it != model_params.end()) seed = std::stoul(it->second);
     std::unique_ptr<PolicyModel> explorer;
     it = model_params.find("explore");
     // TODO: Should we enable explore_model_params? It is unneeded for now since
@@ -122,6 +148,8 @@ std::unique_ptr<PolicyModel> ModelFactory::createPolicyModel(
     return std::make_unique<RandomForest>(num_policies,
                                           num_trees,
                                           max_depth,
+                                          num_threads,
+                                          seed,
                                           explorer);
   } else if (model_name == "PolicyNet") {
     double lr = 1e-2;
@@ -139,11 +167,34 @@ std::unique_ptr<PolicyModel> ModelFactory::createPolicyModel(
     if (it != model_params.end()) beta2 = std::stod(it->second);
     it = model_params.find("threshold");
     if (it != model_params.end()) threshold = std::stod(it->second);
+    std::string encoding = "binary";
+    int bits = 64;
+    int buckets = 16;
+    it = model_params.find("encoding");
+    if (it != model_params.end()) encoding = it->second;
+    it = model_params.find("bits");
+    if (it != model_params.end())
+      bits = (it->second == "auto" ? 0 : std::stoi(it->second));
+    it = model_params.find("buckets");
+    if (it != model_params.end()) buckets = std::stoi(it->second);
 
-    return std::make_unique<PolicyNet>(
-        num_policies, num_features, lr, beta, beta1, beta2, threshold);
+    return std::make_unique<PolicyNet>(num_policies,
+                                       num_features,
+                                       lr,
+                                       beta,
+                                       beta1,
+                                       beta2,
+                                       threshold,
+                                       encoding,
+                                       bits,
+                                       buckets);
   } else if (model_name == "Optimal") {
     return std::make_unique<Optimal>();
+  } else if (model_name == "Compiled") {
+    auto it = model_params.find("name");
+    if (it == model_params.end() || it->second.empty())
+      throw std::runtime_error("Expected a name param for Compiled");
+    return std::make_unique<Compiled>(num_policies, it->second);
   } else {
     std::cerr << __FILE__ << ":" << __LINE__ << ":: Invalid model "
               << model_name << std::endl;
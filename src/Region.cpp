@@ -16,6 +16,7 @@
 #include <iomanip>
 #include <iostream>
 #include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <utility>
@@ -23,7 +24,12 @@
 #include "apollo/Apollo.h"
 #include "apollo/ModelFactory.h"
 #include "helpers/ErrorHandling.h"
+#include "helpers/Profile.h"
+#include "helpers/TraceWriter.h"
+#include "helpers/WorkQueue.h"
+#include "timers/TimerPerfEvent.h"
 #include "timers/TimerSync.h"
+#include "timers/TimerTsc.h"
 
 #ifdef ENABLE_MPI
 #include <mpi.h>
@@ -35,6 +41,79 @@ static inline bool fileExists(std::string path)
   return (stat(path.c_str(), &stbuf) == 0);
 }
 
+static uint64_t fileSize(const std::string &path)
+{
+  struct stat stbuf;
+  return (stat(path.c_str(), &stbuf) == 0 ? stbuf.st_size : 0);
+}
+
+// Discards the characters written to it, counting them.
+class CountingBuffer : public std::streambuf
+{
+public:
+  uint64_t count = 0;
+
+protected:
+  int_type overflow(int_type c) override
+  {
+    if (!traits_type::eq_int_type(c, traits_type::eof())) ++count;
+    return traits_type::not_eof(c);
+  }
+  std::streamsize xsputn(const char *s, std::streamsize n) override
+  {
+    count += n;
+    return n;
+  }
+};
+
+// Size of the model serialized, 0 if the model does not serialize. The
+// serialization is counted, not buffered.
+static uint64_t modelSize(apollo::PolicyModel &policy_model)
+{
+  CountingBuffer buffer;
+  std::ostream os(&buffer);
+  if (!policy_model.serialize(os)) return 0;
+  return buffer.count;
+}
+
+// Creates the timer of timing kind tk, perf_metric >= 0 selects the
+// TimerPerfEvent metric of synchronous executions.
+static std::unique_ptr<Apollo::Timer> createTimer(
+    Apollo::Region::TimingKind tk,
+    int perf_metric = -1)
+{
+  switch (tk) {
+    case Apollo::Region::TIMING_SYNC:
+      if (perf_metric >= 0)
+        return std::make_unique<TimerPerfEvent>(
+            static_cast<TimerPerfEvent::Metric>(perf_metric));
+      if (Config::APOLLO_SYNC_TIMER == "tsc")
+        return Apollo::Timer::create<Apollo::Timer::Tsc>();
+      return Apollo::Timer::create<Apollo::Timer::Sync>();
+#ifdef ENABLE_CUDA
+    case Apollo::Region::TIMING_CUDA_ASYNC:
+      return Apollo::Timer::create<Apollo::Timer::CudaAsync>();
+#endif
+#ifdef ENABLE_HIP
+    case Apollo::Region::TIMING_HIP_ASYNC:
+      return Apollo::Timer::create<Apollo::Timer::HipAsync>();
+#endif
+    case Apollo::Region::TIMING_MOCK_ASYNC:
+      return Apollo::Timer::create<Apollo::Timer::MockAsync>();
+    default:
+      fatal_error("Cannot resolve timing kind");
+  }
+
+  return nullptr;
+}
+
+// Models built anew from the dataset on every training, which makes them
+// trainable on a snapshot of the dataset off the critical path.
+static bool isRebuiltOnTrain(const std::string &model_name)
+{
+  return (model_name == "DecisionTree" || model_name == "RandomForest");
+}
+
 void Apollo::Region::train(int step, bool doCollectPendingContexts, bool force)
 {
   if (!force)
@@ -50,6 +129,9 @@ void Apollo::Region::train(int step, bool doCollectPendingContexts, bool force)
   if (!Config::APOLLO_REGION_MODEL)
     throw std::runtime_error("Expected per-region model training");
 
+  // Skip while the previous background training has not completed.
+  if (Config::APOLLO_ASYNC_TRAINING && isTrainingInBackground()) return;
+
   if (Config::APOLLO_TRACE_BEST_POLICIES) {
     std::stringstream trace_out;
     trace_out << "=== Rank " << apollo->mpiRank << " BEST POLICIES Region "
@@ -76,7 +158,18 @@ void Apollo::Region::train(int step, bool doCollectPendingContexts, bool force)
     fout.close();
   }
 
-  model->train(dataset);
+  if (Config::APOLLO_ASYNC_TRAINING && isRebuiltOnTrain(model_name)) {
+    trainInBackground(step);
+  } else {
+    {
+      // Sizing the model is part of its training cost.
+      ProfileScope scope(profile ? &profile->train : nullptr);
+      model->train(dataset);
+      if (profile) profile->model_bytes = modelSize(*model);
+    }
+
+    if (Config::APOLLO_STORE_MODELS) storeModel(*model, step);
+  }
 
   if (Config::APOLLO_RETRAIN_ENABLE)
 #ifdef ENABLE_OPENCV
@@ -86,18 +179,6 @@ void Apollo::Region::train(int step, bool doCollectPendingContexts, bool force)
 #endif
 
   if (Config::APOLLO_STORE_MODELS) {
-    std::string filename =
-        Config::APOLLO_OUTPUT_DIR + "/" + Config::APOLLO_MODELS_DIR + "/" +
-        model->name + "-step-" + std::to_string(step) + "-rank-" +
-        std::to_string(apollo->mpiRank) + "-" + name + ".yaml";
-    model->store(filename);
-    filename = Config::APOLLO_OUTPUT_DIR + "/" + Config::APOLLO_MODELS_DIR +
-               "/" + model->name +
-               "-latest"
-               "-rank-" +
-               std::to_string(apollo->mpiRank) + "-" + name + ".yaml";
-    model->store(filename);
-
     if (Config::APOLLO_RETRAIN_ENABLE) {
 #ifdef ENABLE_OPENCV
       time_model->store("regtree-step-" + std::to_string(step) + "-rank-" +
@@ -113,25 +194,104 @@ void Apollo::Region::train(int step, bool doCollectPendingContexts, bool force)
   }
 }
 
+void Apollo::Region::storeModel(apollo::PolicyModel &policy_model, int step)
+{
+  ProfileScope scope(profile ? &profile->store : nullptr);
+  std::string filename =
+      Config::APOLLO_OUTPUT_DIR + "/" + Config::APOLLO_MODELS_DIR + "/" +
+      policy_model.name + "-step-" + std::to_string(step) + "-rank-" +
+      std::to_string(apollo->mpiRank) + "-" + name + ".yaml";
+  policy_model.store(filename);
+  if (profile) profile->stored_bytes += fileSize(filename);
+  filename = Config::APOLLO_OUTPUT_DIR + "/" + Config::APOLLO_MODELS_DIR +
+             "/" + policy_model.name +
+             "-latest"
+             "-rank-" +
+             std::to_string(apollo->mpiRank) + "-" + name + ".yaml";
+  policy_model.store(filename);
+  if (profile) {
+    uint64_t size = fileSize(filename);
+    profile->stored_bytes += size;
+    profile->model_bytes = size;
+  }
+}
+
+// Shared by all regions, trains models in request order.
+static WorkQueue &getTrainingQueue()
+{
+  static WorkQueue queue;
+  return queue;
+}
+
+void Apollo::Region::trainInBackground(int step)
+{
+  // Snapshot the dataset, execution keeps inserting to the region dataset
+  // while the model trains.
+  auto snapshot = std::make_shared<Apollo::Dataset>(dataset);
+  apollo::PolicyModel *new_model =
+      apollo::ModelFactory::createPolicyModel(model_name,
+                                              num_features,
+                                              num_policies,
+                                              model_params)
+          .release();
+
+  training = getTrainingQueue().submit([this, snapshot, new_model, step]() {
+    std::unique_ptr<apollo::PolicyModel> policy_model(new_model);
+    {
+      ProfileScope scope(profile ? &profile->train : nullptr);
+      policy_model->train(*snapshot);
+      if (profile) profile->model_bytes = modelSize(*policy_model);
+    }
+
+    if (Config::APOLLO_STORE_MODELS) storeModel(*policy_model, step);
+
+    delete trained_model.exchange(policy_model.release(),
+                                  std::memory_order_acq_rel);
+  });
+}
+
+bool Apollo::Region::isTrainingInBackground()
+{
+  if (trained_model.load(std::memory_order_acquire)) return true;
+
+  if (!training.valid()) return false;
+
+  if (training.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+    return true;
+
+  // Rethrows any exception of the background training.
+  training.get();
+
+  return trained_model.load(std::memory_order_acquire) != nullptr;
+}
+
+void Apollo::Region::installTrainedModel()
+{
+  apollo::PolicyModel *new_model =
+      trained_model.exchange(nullptr, std::memory_order_acq_rel);
+  if (new_model) model.reset(new_model);
+}
+
+// Serializes trace output of concurrently executing threads.
+static std::mutex trace_mutex;
+
 int Apollo::Region::getPolicyIndex(Apollo::RegionContext *context)
 {
+  ProfileScope scope(profile ? &profile->policy : nullptr);
+
+  // Threads may be evaluating the model concurrently in per-thread execution,
+  // which installs trained models in collectPendingContexts() instead.
+  if (!Config::APOLLO_PER_THREAD_CONTEXTS &&
+      trained_model.load(std::memory_order_relaxed))
+    installTrainedModel();
+
   int choice = model->getIndex(context->features);
 
-  if (Config::APOLLO_TRACE_POLICY) {
-    std::stringstream trace_out;
-    int rank;
-    rank = apollo->mpiRank;
-    trace_out << "Rank " << rank << " region " << name << " model "
-              << model->name << " features [ ";
-    for (auto &f : context->features)
-      trace_out << (int)f << ", ";
-    trace_out << "] policy " << choice << std::endl;
-    std::cout << trace_out.str();
-    std::ofstream fout("rank-" + std::to_string(rank) + "-policies.txt",
-                       std::ofstream::app);
-    fout << trace_out.str();
-    fout.close();
-  }
+  if (Config::APOLLO_TRACE_POLICY)
+    tracePolicies(context->features.data(),
+                  context->features.size(),
+                  1,
+                  &choice);
 
 #if 0
     if (choice != context->policy) {
@@ -150,6 +310,42 @@ int Apollo::Region::getPolicyIndex(Apollo::RegionContext *context)
   return choice;
 }
 
+void Apollo::Region::getPolicyIndices(const float *features,
+                                      size_t n,
+                                      int *policies)
+{
+  ProfileScope scope(profile ? &profile->policy : nullptr, n);
+
+  if (!Config::APOLLO_PER_THREAD_CONTEXTS &&
+      trained_model.load(std::memory_order_relaxed))
+    installTrainedModel();
+
+  model->getIndices(features, num_features, n, policies);
+
+  if (Config::APOLLO_TRACE_POLICY)
+    tracePolicies(features, num_features, n, policies);
+}
+
+void Apollo::Region::tracePolicies(const float *features,
+                                   int row_size,
+                                   size_t n,
+                                   const int *policies)
+{
+  std::stringstream trace_out;
+  int rank;
+  rank = apollo->mpiRank;
+  for (size_t i = 0; i < n; ++i) {
+    trace_out << "Rank " << rank << " region " << name << " model "
+              << model->name << " features [ ";
+    for (int j = 0; j < row_size; ++j)
+      trace_out << (int)features[i * row_size + j] << ", ";
+    trace_out << "] policy " << policies[i] << std::endl;
+  }
+  std::cout << trace_out.str();
+  std::lock_guard<std::mutex> lock(trace_mutex);
+  apollo->policy_trace_file << trace_out.str();
+}
+
 // TODO: expand validation to parameter values.
 static void validate(const std::string &model_name,
                      std::unordered_map<std::string, std::string> &model_params)
@@ -180,13 +376,14 @@ static void validate(const std::string &model_name,
   }
 
   if (model_name == "RandomForest") {
-    // "(num_trees|max_depth)=([0-9]+)"
+    // "(num_trees|max_depth|num_threads|seed)=([0-9]+)"
     // "(explore)=(RoundRobin|Random)"
     // "(load)"
     // "(load-dataset)"
     // "(load)=([a-zA-Z0-9_\\-\\.]+)"
     for (auto &entry : model_params)
       if (entry.first != "num_trees" && entry.first != "max_depth" &&
+          entry.first != "num_threads" && entry.first != "seed" &&
           entry.first != "explore" && entry.first != "load" &&
           entry.first != "load-dataset")
         fatal_error("Unknown param key \"" + entry.first +
@@ -197,18 +394,31 @@ static void validate(const std::string &model_name,
   if (model_name == "PolicyNet") {
     for (auto &entry : model_params)
       //  "(lr|beta|beta1|beta2|threshold)=(([+-]?([[:d:]]*\\.?([[:d:]]*)?))([Ee]"
+      // "(encoding)=(binary|scalar|log|onehot)"
+      // "(bits)=([[:d:]]+|auto)"
+      // "(buckets)=([[:d:]]+)"
       // "(load)"
       // "(load)=([a-zA-Z0-9_\\-\\.]+)"
       //  "(load-dataset)"
       if (entry.first != "lr" && entry.first != "beta" &&
           entry.first != "beta1" && entry.first != "beta2" &&
-          entry.first != "threshold" && entry.first != "load" &&
-          entry.first != "load-dataset")
+          entry.first != "threshold" && entry.first != "encoding" &&
+          entry.first != "bits" && entry.first != "buckets" &&
+          entry.first != "load" && entry.first != "load-dataset")
         fatal_error("Unknown param key \"" + entry.first +
                     "\" for policy PolicyNet");
     return;
   }
 
+  if (model_name == "Compiled") {
+    // "(name)=([a-zA-Z_][a-zA-Z0-9_]*)"
+    for (auto &entry : model_params)
+      if (entry.first != "name")
+        fatal_error("Unknown param key \"" + entry.first +
+                    "\" for policy Compiled");
+    return;
+  }
+
   if (model_name == "StaticRegion") return;
 
   fatal_error("Unknow param for policy " + model_name +
@@ -241,9 +451,66 @@ void Apollo::Region::parsePolicyModel(const std::string &model_info)
 
   } while (std::string::npos != pos);
 
+  // The metric, objective and weights params apply to the region, not the
+  // model.
+  auto it = model_params.find("metric");
+  if (it != model_params.end()) {
+    metric = it->second;
+    model_params.erase(it);
+  }
+  if (model_params.count("objective") || model_params.count("weights")) {
+    try {
+      dataset.setObjective(Apollo::Dataset::Objective::parse(
+          model_params["objective"], model_params["weights"]));
+    } catch (std::runtime_error &e) {
+      fatal_error(e.what());
+    }
+    model_params.erase("objective");
+    model_params.erase("weights");
+  }
+  if (model_params.empty()) return;
+
   validate(model_name, model_params);
 }
 
+// Resolves the metric of synchronous executions, hardware counter metrics
+// fall back to time if the counters are not available.
+static int resolvePerfMetric(const std::string &region_name,
+                             std::string &metric)
+{
+  if (metric.empty() || metric == "time") {
+    metric = "time";
+    return -1;
+  }
+
+  TimerPerfEvent::Metric perf_metric;
+  if (!TimerPerfEvent::parseMetric(metric, perf_metric))
+    fatal_error("Unknown metric " + metric + " of region " + region_name +
+                ", expected time, cycles, instructions, llc_misses, energy, "
+                "task_clock, cpi or llc_mpki");
+
+  std::string error;
+  if (!TimerPerfEvent::isAvailable(perf_metric, error)) {
+    std::cerr << "Apollo: metric " << metric << " of region " << region_name
+              << " is not available (" << error << "), using time\n";
+    metric = "time";
+    return -1;
+  }
+
+  return perf_metric;
+}
+
+// FNV-1a hash of the region name.
+static uint64_t hashRegionName(const char *name)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (const char *c = name; *c; ++c) {
+    hash ^= (unsigned char)*c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
 Apollo::Region::Region(const int num_features,
                        const char *regionName,
                        int num_policies,
@@ -254,22 +521,44 @@ Apollo::Region::Region(const int num_features,
       num_policies(num_policies),
       min_training_data(min_training_data),
       model_info(_model_info),
-      current_context(nullptr),
       idx(0),
-      sync_context()
+      trained_model(nullptr)
 {
   apollo = Apollo::instance();
 
-  // Create timer for the singleton sync context.
-  sync_context.timer = Apollo::Timer::create<Apollo::Timer::Sync>();
+  // Create the thread states slots, per-thread states are created lazily by
+  // each thread, otherwise the single shared state is created here.
+  num_thread_states =
+      (Config::APOLLO_PER_THREAD_CONTEXTS ? Config::APOLLO_MAX_THREADS : 1);
+  if (num_thread_states < 1) fatal_error("Expected APOLLO_MAX_THREADS >= 1");
+  thread_states.reset(new std::atomic<ThreadState *>[num_thread_states]);
+  for (int i = 0; i < num_thread_states; ++i)
+    thread_states[i] = nullptr;
 
   strncpy(name, regionName, sizeof(name) - 1);
   name[sizeof(name) - 1] = '\0';
+  region_id = hashRegionName(name);
 
   // If there is no model_info, parse the policy model from the env
   // variable, else parse it from the model_info argument.
   if (model_info.empty()) model_info = Config::APOLLO_POLICY_MODEL;
   parsePolicyModel(model_info);
+  perf_metric = resolvePerfMetric(name, metric);
+
+  // Threads evaluate the model concurrently in per-thread execution, the
+  // Random and PolicyNet models share their generator and evaluation state.
+  if (Config::APOLLO_PER_THREAD_CONTEXTS) {
+    auto it = model_params.find("explore");
+    std::string explore = (it != model_params.end() ? it->second : "");
+    if (model_name == "Random" || model_name == "PolicyNet" ||
+        explore == "Random")
+      fatal_error("Region " + std::string(name) + " model " + model_info +
+                  " is not safe to evaluate concurrently with "
+                  "APOLLO_PER_THREAD_CONTEXTS, explore with RoundRobin");
+  }
+
+  if (!Config::APOLLO_PER_THREAD_CONTEXTS)
+    thread_states[0] = createThreadState();
 
   // Create a static policy per region. Policies are given by creation order,
   // assumes regions are created in the same order in different runs.
@@ -314,12 +603,7 @@ Apollo::Region::Region(const int num_features,
   }
 
   if (Config::APOLLO_PERSISTENT_DATASETS) {
-    std::string dataset_file = Config::APOLLO_OUTPUT_DIR + "/" +
-                               Config::APOLLO_DATASETS_DIR + "/Dataset-" +
-                               std::string(name) + ".yaml";
-    std::ifstream ifs(dataset_file);
-    if (ifs) dataset.load(ifs);
-    ifs.close();
+    loadDataset();
 
     // Check if auto-training applies: min_training_data is set and dataset
     // size is large enough.
@@ -327,24 +611,15 @@ Apollo::Region::Region(const int num_features,
   }
 
   if (model_params.count("load-dataset")) {
-    std::string dataset_file = Config::APOLLO_OUTPUT_DIR + "/" +
-                               Config::APOLLO_DATASETS_DIR + "/Dataset-" +
-                               std::string(name) + ".yaml";
-    std::ifstream ifs(dataset_file);
-    if (!ifs) {
-      std::cerr << "ERROR: could not load dataset file " << dataset_file
-                << std::endl;
-      abort();
-    }
-
-    dataset.load(ifs);
+    if (!loadDataset())
+      fatal_error("could not load dataset file of region " +
+                  std::string(name));
 
     if (dataset.size() <= 0) fatal_error("dataset size is 0");
 
     // Train with whatever data existing in the dataset, ignore
     // min_training_data (if set).
     train(0);
-    ifs.close();
   }
 
   if (model_name == "Optimal") {
@@ -360,19 +635,9 @@ Apollo::Region::Region(const int num_features,
   }
 
   if (model_name == "DatasetMap") {
-    std::string dataset_file = Config::APOLLO_OUTPUT_DIR + "/" +
-                               Config::APOLLO_DATASETS_DIR + "/Dataset-" +
-                               std::string(name) + ".yaml";
-    std::ifstream ifs(dataset_file);
-    if (!ifs) {
-      std::cerr << "ERROR: could not load dataset file " << dataset_file
-                << std::endl;
-      abort();
-    }
-
-    dataset.load(ifs);
-
-    ifs.close();
+    if (!loadDataset())
+      fatal_error("could not load dataset file of region " +
+                  std::string(name));
 
     if (dataset.size() <= 0) fatal_error("DatasetMap expects loaded datasets");
 
@@ -398,84 +663,281 @@ Apollo::Region::Region(const int num_features,
     trace_file << " policy xtime\n";
   }
 
+  if (apollo->trace_writer) {
+    trace_region_id = apollo->trace_writer->addRegion(name,
+                                                      model_name,
+                                                      model_info,
+                                                      num_features);
+    trace_model = nullptr;
+  }
+
   // std::cout << "Insert region " << name << " ptr " << this << std::endl;
   const auto ret = apollo->regions.insert({name, this});
 
+  if (Config::APOLLO_PROFILE) {
+    profile = std::make_shared<RegionProfile>();
+    apollo->profiles.insert({name, profile});
+  }
+
   return;
 }
 
 Apollo::Region::~Region()
 {
+  // Wait for background training, which references the region.
+  if (training.valid()) training.wait();
+  delete trained_model.exchange(nullptr);
+
   // Disable period based flushing.
   Config::APOLLO_GLOBAL_TRAIN_PERIOD = 0;
-  while (pending_contexts.size() > 0)
-    collectPendingContexts();
+  for (int i = 0; i < num_thread_states; ++i) {
+    ThreadState *ts = thread_states[i];
+    if (!ts) continue;
+
+    while (ts->pending_contexts.size() > 0)
+      collectPendingContexts(ts);
+  }
+  // Merge per-thread measurements to the region dataset.
+  collectPendingContexts();
+
+  for (int i = 0; i < num_thread_states; ++i) {
+    ThreadState *ts = thread_states[i];
+    if (!ts) continue;
+
+    for (auto &pool : ts->context_pool)
+      for (auto *context : pool)
+        delete context;
+    delete ts;
+  }
 
   if (Config::APOLLO_TRACE_CSV) trace_file.close();
 
-  if (Config::APOLLO_PERSISTENT_DATASETS) {
-    std::ofstream file_out(Config::APOLLO_OUTPUT_DIR + "/" +
-                           Config::APOLLO_DATASETS_DIR + "/Dataset-" +
-                           std::string(name) + ".yaml");
-    if (!file_out.is_open())
+  if (Config::APOLLO_PERSISTENT_DATASETS) storeDataset();
+
+  return;
+}
+
+bool Apollo::Region::loadDataset()
+{
+  std::string prefix = Config::APOLLO_OUTPUT_DIR + "/" +
+                       Config::APOLLO_DATASETS_DIR + "/Dataset-" +
+                       std::string(name);
+  std::string binary_file = prefix + ".bin";
+  std::string yaml_file = prefix + ".yaml";
+
+  bool prefer_binary = (Config::APOLLO_DATASET_FORMAT == "binary");
+  for (bool binary : {prefer_binary, !prefer_binary}) {
+    if (binary) {
+      if (!fileExists(binary_file)) continue;
+      try {
+        dataset.loadBinary(binary_file);
+      } catch (std::runtime_error &e) {
+        fatal_error(e.what());
+      }
+      return true;
+    }
+
+    std::ifstream ifs(yaml_file);
+    if (!ifs) continue;
+    dataset.load(ifs);
+    return true;
+  }
+
+  return false;
+}
+
+void Apollo::Region::storeDataset()
+{
+  ProfileScope scope(profile ? &profile->store : nullptr);
+  std::string dataset_file = Config::APOLLO_OUTPUT_DIR + "/" +
+                             Config::APOLLO_DATASETS_DIR + "/Dataset-" +
+                             std::string(name);
+
+  if (Config::APOLLO_DATASET_FORMAT == "binary") {
+    try {
+      dataset.storeBinary(dataset_file + ".bin");
+    } catch (std::runtime_error &e) {
       std::cerr << "ERROR: Cannot write dataset of " + std::string(name) +
-                       " to database\n";
-    dataset.store(file_out);
-    file_out.close();
+                       " to database: "
+                << e.what() << "\n";
+    }
+    if (profile) profile->stored_bytes += fileSize(dataset_file + ".bin");
+    return;
   }
 
-  return;
+  std::ofstream file_out(dataset_file + ".yaml");
+  if (!file_out.is_open())
+    std::cerr << "ERROR: Cannot write dataset of " + std::string(name) +
+                     " to database\n";
+  dataset.store(file_out);
+  file_out.close();
+  if (profile) profile->stored_bytes += fileSize(dataset_file + ".yaml");
+}
+
+// Dense, process-wide ids of live threads. A thread releases its id when it
+// exits for the next new thread to reuse, so ids are bounded by the number of
+// threads alive at once rather than by all threads ever created.
+class ThreadIds
+{
+public:
+  static int acquire()
+  {
+    ThreadIds &ids = instance();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    if (ids.free_ids.empty()) return ids.num_ids++;
+    int id = ids.free_ids.back();
+    ids.free_ids.pop_back();
+    return id;
+  }
+  // The mutex orders the use of the id-indexed thread states by the exiting
+  // thread before their use by the thread reusing the id.
+  static void release(int id)
+  {
+    ThreadIds &ids = instance();
+    std::lock_guard<std::mutex> lock(ids.mutex);
+    ids.free_ids.push_back(id);
+  }
+
+private:
+  std::mutex mutex;
+  std::vector<int> free_ids;
+  int num_ids = 0;
+
+  static ThreadIds &instance()
+  {
+    static ThreadIds ids;
+    return ids;
+  }
+};
+
+// Holds the id of a thread for its lifetime.
+struct ThreadIdGuard {
+  ThreadIdGuard() : id(ThreadIds::acquire()) {}
+  ~ThreadIdGuard() { ThreadIds::release(id); }
+  const int id;
+};
+
+// Returns a dense, process-wide id of the calling thread.
+static int getThreadId()
+{
+  static thread_local ThreadIdGuard guard;
+  return guard.id;
 }
 
-void Apollo::Region::destroyRegionContext(Apollo::RegionContext *context)
+Apollo::Region::ThreadState *Apollo::Region::createThreadState()
 {
-  if (context == &sync_context) return;
+  ThreadState *ts = new ThreadState();
+  ts->current_context = nullptr;
+  // Create timer for the per-thread sync context.
+  ts->sync_context.timing_kind = TIMING_SYNC;
+  ts->sync_context.timer = createTimer(TIMING_SYNC, perf_metric);
+  ts->sync_context.features.reserve(num_features);
+
+  return ts;
+}
+
+Apollo::Region::ThreadState *Apollo::Region::getThreadState()
+{
+  if (!Config::APOLLO_PER_THREAD_CONTEXTS) return thread_states[0];
+
+  int thread_id = getThreadId();
+  if (thread_id >= num_thread_states)
+    fatal_error("Thread id " + std::to_string(thread_id) +
+                " exceeds APOLLO_MAX_THREADS " +
+                std::to_string(num_thread_states));
+
+  // Only the owning thread creates its state, so no further synchronization
+  // is needed than publishing the pointer. A thread reusing the id of an
+  // exited thread reuses its state.
+  ThreadState *ts = thread_states[thread_id].load(std::memory_order_acquire);
+  if (ts) return ts;
+
+  ts = createThreadState();
+  thread_states[thread_id].store(ts, std::memory_order_release);
+
+  return ts;
+}
+
+void Apollo::Region::destroyRegionContext(ThreadState *ts,
+                                          Apollo::RegionContext *context)
+{
+  if (context->timing_kind == TIMING_SYNC) return;
+
+  // Recycle the context and its timer up to the pool high-water mark.
+  auto &pool = ts->context_pool[context->timing_kind];
+  if (pool.size() < (size_t)Config::APOLLO_CONTEXT_POOL_SIZE) {
+    pool.push_back(context);
+    return;
+  }
 
   delete context;
 }
 
-Apollo::RegionContext *Apollo::Region::createRegionContext(TimingKind tk)
+Apollo::RegionContext *Apollo::Region::createRegionContext(ThreadState *ts,
+                                                           TimingKind tk)
 {
   Apollo::RegionContext *context = nullptr;
-  switch (tk) {
-    case TIMING_SYNC:
-      context = &sync_context;
-      // Clear the features vector because the sync_context is persistent.
-      context->features.clear();
-      break;
-#ifdef ENABLE_CUDA
-    case TIMING_CUDA_ASYNC:
-      context = new Apollo::RegionContext();
-      context->timer = Apollo::Timer::create<Apollo::Timer::CudaAsync>();
-      break;
-#endif
-#ifdef ENABLE_HIP
-    case TIMING_HIP_ASYNC:
-      context = new Apollo::RegionContext();
-      context->timer = Apollo::Timer::create<Apollo::Timer::HipAsync>();
-      break;
-#endif
-    default:
-      fatal_error("Cannot resolve timing kind");
+  if (tk == TIMING_SYNC) {
+    context = &ts->sync_context;
+    // Clear the features vector because the sync_context is persistent.
+    context->features.clear();
+    return context;
   }
 
+  if (tk < 0 || tk >= NUM_TIMING_KINDS)
+    fatal_error("Cannot resolve timing kind");
+
+  auto &pool = ts->context_pool[tk];
+  if (!pool.empty()) {
+    context = pool.back();
+    pool.pop_back();
+    // Recycled contexts keep the capacity of their features vector.
+    context->features.clear();
+    return context;
+  }
+
+  context = new Apollo::RegionContext();
+  context->timing_kind = tk;
+  context->timer = createTimer(tk);
+
   // Pre-allocate the features vector of known size.
   context->features.reserve(num_features);
 
   return context;
 }
 
+void Apollo::Region::reserveContexts(TimingKind tk, size_t count)
+{
+  if (tk == TIMING_SYNC) return;
+
+  count = std::min(count, (size_t)Config::APOLLO_CONTEXT_POOL_SIZE);
+  auto &pool = getThreadState()->context_pool[tk];
+  pool.reserve(count);
+  while (pool.size() < count) {
+    Apollo::RegionContext *context = new Apollo::RegionContext();
+    context->timing_kind = tk;
+    context->timer = createTimer(tk);
+    context->features.reserve(num_features);
+    pool.push_back(context);
+  }
+}
+
 Apollo::RegionContext *Apollo::Region::begin() { return begin(TIMING_SYNC); }
 
 Apollo::RegionContext *Apollo::Region::begin(TimingKind tk)
 {
-  Apollo::RegionContext *context = createRegionContext(tk);
+  // Per-thread execution completes a non-blocking collective exchange at the
+  // next train call instead.
+  if (apollo->collective_pending && !Config::APOLLO_PER_THREAD_CONTEXTS)
+    apollo->progressCollectiveTraining();
+
+  ThreadState *ts = getThreadState();
+  Apollo::RegionContext *context = createRegionContext(ts, tk);
 
   if (!context) fatal_error("Expected non-null context pointer");
 
-  current_context = context;
-  context->idx = this->idx;
-  this->idx++;
+  ts->current_context = context;
+  context->idx = this->idx++;
 
   context->timer->start();
 
@@ -489,107 +951,236 @@ Apollo::RegionContext *Apollo::Region::begin(const std::vector<float> &features)
   return context;
 }
 
-void Apollo::Region::autoTrain()
+// True if a multiple of period is in (value - count, value].
+static bool crossesPeriod(unsigned long long value,
+                          unsigned long long count,
+                          unsigned long long period)
 {
+  return value / period != (value - count) / period;
+}
+
+void Apollo::Region::autoTrain(unsigned long long count)
+{
+  // Per-thread execution trains only on explicit train calls, outside of
+  // threaded execution.
+  if (Config::APOLLO_PER_THREAD_CONTEXTS) return;
+
   if (!model->isTrainable()) return;
 
   if (Config::APOLLO_GLOBAL_TRAIN_PERIOD &&
-      (apollo->region_executions % Config::APOLLO_GLOBAL_TRAIN_PERIOD) == 0) {
+      crossesPeriod(apollo->region_executions,
+                    count,
+                    Config::APOLLO_GLOBAL_TRAIN_PERIOD)) {
     apollo->train(apollo->region_executions,
                   /* doCollectPendingContexts */ false);
   } else if (Config::APOLLO_PER_REGION_TRAIN_PERIOD &&
-             (idx % Config::APOLLO_PER_REGION_TRAIN_PERIOD) == 0) {
+             crossesPeriod(idx,
+                           count,
+                           Config::APOLLO_PER_REGION_TRAIN_PERIOD)) {
     train(idx, /* doCollectPendingContexts */ false);
   } else if (0 < min_training_data && min_training_data <= dataset.size())
     train(idx, /* doCollectPendingContexts */ false);
 }
 
-void Apollo::Region::collectContext(Apollo::RegionContext *context,
+void Apollo::Region::traceExecution(unsigned long long idx,
+                                    const float *features,
+                                    int row_size,
+                                    int policy,
                                     double metric)
 {
   if (Config::APOLLO_TRACE_CSV) {
-    auto ts = std::chrono::system_clock::now().time_since_epoch() /
-              std::chrono::microseconds(1);
-    apollo->gtrace_file << ts << " " << this->name << " " << context->idx << " "
+    std::lock_guard<std::mutex> lock(trace_mutex);
+    auto timestamp = std::chrono::system_clock::now().time_since_epoch() /
+                     std::chrono::microseconds(1);
+    apollo->gtrace_file << timestamp << " " << this->name << " " << idx << " "
                         << model_name << " "
-                        << " " << context->policy << "\n";
+                        << " " << policy << "\n";
 
     trace_file << apollo->mpiRank << " ";
     trace_file << model->name << " ";
     trace_file << this->name << " ";
-    trace_file << context->idx << " ";
-    for (auto &f : context->features)
-      trace_file << f << " ";
-    trace_file << context->policy << " ";
+    trace_file << idx << " ";
+    for (int i = 0; i < row_size; ++i)
+      trace_file << features[i] << " ";
+    trace_file << policy << " ";
     trace_file << metric << "\n";
   }
 
-  if (Config::APOLLO_PERSISTENT_DATASETS or model->isTrainable())
-    dataset.insert(context->features, context->policy, metric);
+  if (apollo->trace_writer) {
+    const apollo::PolicyModel *current_model = model.get();
+    if (trace_model.load(std::memory_order_acquire) != current_model) {
+      trace_model_id.store(apollo->trace_writer->getModelId(model->name),
+                           std::memory_order_relaxed);
+      trace_model.store(current_model, std::memory_order_release);
+    }
+    apollo->trace_writer->write(trace_region_id,
+                                trace_model_id.load(std::memory_order_relaxed),
+                                idx,
+                                features,
+                                row_size,
+                                policy,
+                                metric);
+  }
+}
+
+void Apollo::Region::collectContext(ThreadState *ts,
+                                    Apollo::RegionContext *context,
+                                    const double *metrics,
+                                    int num_metrics)
+{
+  {
+    ProfileScope scope(profile ? &profile->collect : nullptr);
+
+    // Traces record the first metric.
+    traceExecution(context->idx,
+                   context->features.data(),
+                   context->features.size(),
+                   context->policy,
+                   metrics[0]);
+
+    if (Config::APOLLO_PERSISTENT_DATASETS or model->isTrainable()) {
+      Apollo::Dataset &ds =
+          (Config::APOLLO_PER_THREAD_CONTEXTS ? ts->dataset : dataset);
+      if (num_metrics == 1)
+        ds.insert(context->features, context->policy, metrics[0]);
+      else
+        ds.insert(context->features,
+                  context->policy,
+                  std::vector<double>(metrics, metrics + num_metrics));
+    }
 
-  apollo->region_executions++;
+    apollo->region_executions++;
+  }
 
   autoTrain();
 
-  destroyRegionContext(context);
-  current_context = nullptr;
+  destroyRegionContext(ts, context);
+  ts->current_context = nullptr;
 }
 
 void Apollo::Region::end(Apollo::RegionContext *context, double metric)
 {
   // std::cout << "END REGION " << name << " metric " << metric << std::endl;
+  ThreadState *ts = getThreadState();
 
-  collectContext(context, metric);
+  collectContext(ts, context, &metric, 1);
 
-  collectPendingContexts();
+  collectPendingContexts(ts);
 
   return;
 }
 
-void Apollo::Region::collectPendingContexts()
+void Apollo::Region::end(Apollo::RegionContext *context,
+                         const std::vector<double> &metrics)
+{
+  if (metrics.empty()) fatal_error("Expected at least one metric");
+
+  ThreadState *ts = getThreadState();
+
+  collectContext(ts, context, metrics.data(), metrics.size());
+
+  collectPendingContexts(ts);
+}
+
+void Apollo::Region::recordBatch(const float *features,
+                                 const int *policies,
+                                 const double *metrics,
+                                 size_t n,
+                                 int num_metrics)
 {
-  auto isDone = [this](Apollo::RegionContext *context) {
+  if (n == 0) return;
+
+  {
+    ProfileScope scope(profile ? &profile->collect : nullptr, n);
+
+    unsigned long long first_idx = idx.fetch_add(n);
+    for (size_t i = 0; i < n; ++i)
+      traceExecution(first_idx + i,
+                     &features[i * num_features],
+                     num_features,
+                     policies[i],
+                     metrics[i * num_metrics]);
+
+    if (Config::APOLLO_PERSISTENT_DATASETS or model->isTrainable()) {
+      if (Config::APOLLO_PER_THREAD_CONTEXTS)
+        getThreadState()->dataset.insertRows(
+            num_features, num_metrics, features, policies, metrics, n);
+      else
+        dataset.insertRows(
+            num_features, num_metrics, features, policies, metrics, n);
+    }
+
+    apollo->region_executions += n;
+  }
+
+  autoTrain(n);
+}
+
+void Apollo::Region::collectPendingContexts(ThreadState *ts)
+{
+  auto isDone = [this, ts](Apollo::RegionContext *context) {
     if (!context->timer)
       throw std::runtime_error("No timer has been set for the context");
     double metric;
     if (context->timer->isDone(metric)) {
-      collectContext(context, metric);
+      collectContext(ts, context, &metric, 1);
       return true;
     }
 
     return false;
   };
 
-  pending_contexts.erase(std::remove_if(pending_contexts.begin(),
-                                        pending_contexts.end(),
-                                        isDone),
-                         pending_contexts.end());
+  ts->pending_contexts.erase(std::remove_if(ts->pending_contexts.begin(),
+                                            ts->pending_contexts.end(),
+                                            isDone),
+                             ts->pending_contexts.end());
+}
+
+void Apollo::Region::collectPendingContexts()
+{
+  for (int i = 0; i < num_thread_states; ++i) {
+    ThreadState *ts = thread_states[i];
+    if (!ts) continue;
+
+    collectPendingContexts(ts);
+
+    if (ts->dataset.size() > 0) {
+      dataset.insert(ts->dataset);
+      ts->dataset.clear();
+    }
+  }
+
+  installTrainedModel();
 }
 
 void Apollo::Region::end(Apollo::RegionContext *context)
 {
+  ThreadState *ts = getThreadState();
   context->timer->stop();
-  if (context == &sync_context) {
+  if (context->timing_kind == TIMING_SYNC) {
     double metric;
     context->timer->isDone(metric);
-    collectContext(context, metric);
+    collectContext(ts, context, &metric, 1);
     return;
   }
-  pending_contexts.push_back(context);
-  collectPendingContexts();
+  ts->pending_contexts.push_back(context);
+  collectPendingContexts(ts);
 }
 
 // DEPRECATED
 int Apollo::Region::getPolicyIndex(void)
 {
-  return getPolicyIndex(current_context);
+  return getPolicyIndex(getThreadState()->current_context);
 }
 
 // DEPRECATED
-void Apollo::Region::end(double metric) { end(current_context, metric); }
+void Apollo::Region::end(double metric)
+{
+  end(getThreadState()->current_context, metric);
+}
 
 // DEPRECATED
-void Apollo::Region::end(void) { end(current_context); }
+void Apollo::Region::end(void) { end(getThreadState()->current_context); }
 
 void Apollo::Region::setFeature(Apollo::RegionContext *context, float value)
 {
@@ -600,5 +1191,5 @@ void Apollo::Region::setFeature(Apollo::RegionContext *context, float value)
 // DEPRECATED
 void Apollo::Region::setFeature(float value)
 {
-  setFeature(current_context, value);
+  setFeature(getThreadState()->current_context, value);
 }
@@ -0,0 +1,68 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_HELPERS_PROFILE_H
+#define APOLLO_HELPERS_PROFILE_H
+
+#include <atomic>
+#include <cstdint>
+
+#include "helpers/TscClock.h"
+
+// Self-profiling of the Apollo runtime overhead (APOLLO_PROFILE). Counters are
+// updated with relaxed atomics, so threads of per-thread execution share them.
+struct ProfileCounter {
+  std::atomic<uint64_t> calls{0};
+  // TscClock ticks.
+  std::atomic<uint64_t> ticks{0};
+
+  void add(uint64_t num_calls, uint64_t elapsed_ticks)
+  {
+    calls.fetch_add(num_calls, std::memory_order_relaxed);
+    ticks.fetch_add(elapsed_ticks, std::memory_order_relaxed);
+  }
+  uint64_t ns() const { return ticks * TscClock::nsPerTick(); }
+};
+
+// Adds calls and the duration of its scope to counter, a no-op if counter is
+// null, i.e., profiling is disabled.
+class ProfileScope
+{
+public:
+  explicit ProfileScope(ProfileCounter *counter, uint64_t calls = 1)
+      : counter(counter), calls(calls)
+  {
+    if (counter) start = TscClock::now();
+  }
+  ~ProfileScope()
+  {
+    if (counter) counter->add(calls, TscClock::now() - start);
+  }
+  ProfileScope(const ProfileScope &) = delete;
+  ProfileScope &operator=(const ProfileScope &) = delete;
+
+private:
+  ProfileCounter *counter;
+  uint64_t calls;
+  uint64_t start;
+};
+
+// Overhead of a region, counters are exclusive of each other.
+struct RegionProfile {
+  // getPolicyIndex() and getPolicyIndices(), calls count selected policies.
+  ProfileCounter policy;
+  // Tracing and recording of measurements by end() and recordBatch(), calls
+  // count executions.
+  ProfileCounter collect;
+  // Model training, in the background too.
+  ProfileCounter train;
+  // Storing models and datasets.
+  ProfileCounter store;
+  std::atomic<uint64_t> stored_bytes{0};
+  // Size of the last trained or stored model, 0 if unknown.
+  std::atomic<uint64_t> model_bytes{0};
+};
+
+#endif
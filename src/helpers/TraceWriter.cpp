@@ -0,0 +1,216 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include "helpers/TraceWriter.h"
+
+#include <algorithm>
+#include <cstring>
+
+#include "helpers/ErrorHandling.h"
+
+constexpr char TraceWriter::MAGIC[8];
+constexpr uint32_t TraceWriter::VERSION;
+
+// Per-thread ring buffer size, the flusher wakes up when a buffer is half
+// full or every FLUSH_PERIOD.
+static constexpr size_t BUFFER_SIZE = 1 << 20;
+static constexpr std::chrono::milliseconds FLUSH_PERIOD(100);
+
+static std::atomic<uint64_t> writer_counter(0);
+
+TraceWriter::TraceWriter(const std::string &prefix, int rank)
+    : writer_id(++writer_counter),
+      start(std::chrono::steady_clock::now()),
+      num_regions(0),
+      stopping(false)
+{
+  bin_file.open(prefix + ".bin", std::ios::binary);
+  if (bin_file.fail()) fatal_error("Error opening trace file " + prefix + ".bin");
+  dict_file.open(prefix + ".dict");
+  if (dict_file.fail())
+    fatal_error("Error opening trace file " + prefix + ".dict");
+
+  FileHeader header;
+  std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+  header.version = VERSION;
+  header.rank = rank;
+  bin_file.write(reinterpret_cast<const char *>(&header), sizeof(header));
+
+  auto start_us = std::chrono::system_clock::now().time_since_epoch() /
+                  std::chrono::microseconds(1);
+  dict_file << "start\t" << start_us << "\n";
+  dict_file << "rank\t" << rank << "\n";
+  dict_file.flush();
+
+  flusher = std::thread(&TraceWriter::run, this);
+}
+
+TraceWriter::~TraceWriter()
+{
+  {
+    std::lock_guard<std::mutex> lock(flush_mutex);
+    stopping = true;
+  }
+  cv.notify_one();
+  flusher.join();
+  // Records written after the last flush of the flusher.
+  flush();
+  bin_file.close();
+  dict_file.close();
+}
+
+uint32_t TraceWriter::addRegion(const std::string &name,
+                                const std::string &model_name,
+                                const std::string &model_info,
+                                int num_features)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  uint32_t region_id = num_regions++;
+  dict_file << "region\t" << region_id << "\t" << num_features << "\t"
+            << model_name << "\t" << model_info << "\t" << name << "\n";
+  dict_file.flush();
+  return region_id;
+}
+
+uint32_t TraceWriter::getModelId(const std::string &name)
+{
+  std::lock_guard<std::mutex> lock(mutex);
+  auto it = model_ids.find(name);
+  if (it != model_ids.end()) return it->second;
+
+  uint32_t model_id = model_ids.size();
+  model_ids.emplace(name, model_id);
+  dict_file << "model\t" << model_id << "\t" << name << "\n";
+  dict_file.flush();
+  return model_id;
+}
+
+// Retires the buffer of the thread when the thread exits or switches to
+// another writer, the flusher frees it once its records are written.
+struct TraceWriter::ThreadBufferGuard {
+  ~ThreadBufferGuard() { retire(); }
+  void retire()
+  {
+    if (buffer) buffer->retired.store(true, std::memory_order_release);
+  }
+  uint64_t writer_id = 0;
+  std::shared_ptr<Buffer> buffer;
+};
+
+TraceWriter::Buffer *TraceWriter::getThreadBuffer()
+{
+  // Buffers are shared with the writer, so records of exited threads are
+  // still flushed.
+  thread_local ThreadBufferGuard guard;
+  if (guard.writer_id == writer_id) return guard.buffer.get();
+
+  guard.retire();
+  guard.buffer = std::make_shared<Buffer>(BUFFER_SIZE);
+  guard.writer_id = writer_id;
+  std::lock_guard<std::mutex> lock(mutex);
+  buffers.push_back(guard.buffer);
+  return guard.buffer.get();
+}
+
+void TraceWriter::write(uint32_t region_id,
+                        uint32_t model_id,
+                        uint64_t idx,
+                        const float *features,
+                        int num_features,
+                        int policy,
+                        double metric)
+{
+  Buffer *buffer = getThreadBuffer();
+
+  Record record;
+  record.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+  record.idx = idx;
+  record.metric = metric;
+  record.region_id = region_id;
+  record.model_id = model_id;
+  record.policy = policy;
+  record.num_features = num_features;
+
+  size_t features_size = num_features * sizeof(float);
+  size_t size = sizeof(Record) + features_size;
+  if (size > buffer->capacity) fatal_error("Trace record exceeds buffer size");
+
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  // Wait for the flusher to make room, records are never dropped.
+  while (head + size - buffer->tail.load(std::memory_order_acquire) >
+         buffer->capacity) {
+    cv.notify_one();
+    std::this_thread::yield();
+  }
+
+  auto copy = [buffer](uint64_t pos, const void *src, size_t length) {
+    size_t offset = pos & (buffer->capacity - 1);
+    size_t first = std::min(length, buffer->capacity - offset);
+    std::memcpy(&buffer->data[offset], src, first);
+    std::memcpy(&buffer->data[0],
+                static_cast<const char *>(src) + first,
+                length - first);
+  };
+  copy(head, &record, sizeof(Record));
+  if (num_features > 0) copy(head + sizeof(Record), features, features_size);
+  buffer->head.store(head + size, std::memory_order_release);
+
+  if (head + size - buffer->tail.load(std::memory_order_relaxed) >
+      buffer->capacity / 2)
+    cv.notify_one();
+}
+
+void TraceWriter::flush()
+{
+  std::vector<Buffer *> to_flush;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &buffer : buffers)
+      to_flush.push_back(buffer.get());
+  }
+
+  // Each buffer contributes whole records, its head is published after the
+  // record is written. A retired buffer has no records after its head.
+  std::vector<Buffer *> drained;
+  for (Buffer *buffer : to_flush) {
+    bool retired = buffer->retired.load(std::memory_order_acquire);
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    uint64_t tail = buffer->tail.load(std::memory_order_relaxed);
+    if (retired) drained.push_back(buffer);
+    if (head == tail) continue;
+
+    size_t offset = tail & (buffer->capacity - 1);
+    size_t length = head - tail;
+    size_t first = std::min(length, buffer->capacity - offset);
+    bin_file.write(&buffer->data[offset], first);
+    bin_file.write(&buffer->data[0], length - first);
+    buffer->tail.store(head, std::memory_order_release);
+  }
+  bin_file.flush();
+
+  // Flushes are serialized, only this one removes buffers.
+  if (!drained.empty()) {
+    std::lock_guard<std::mutex> lock(mutex);
+    buffers.erase(std::remove_if(buffers.begin(),
+                                 buffers.end(),
+                                 [&drained](const std::shared_ptr<Buffer> &b) {
+                                   return std::find(drained.begin(),
+                                                    drained.end(),
+                                                    b.get()) != drained.end();
+                                 }),
+                  buffers.end());
+  }
+}
+
+void TraceWriter::run()
+{
+  std::unique_lock<std::mutex> lock(flush_mutex);
+  while (!stopping) {
+    cv.wait_for(lock, FLUSH_PERIOD);
+    flush();
+  }
+}
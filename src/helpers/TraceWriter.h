@@ -0,0 +1,122 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_HELPERS_TRACEWRITER_H
+#define APOLLO_HELPERS_TRACEWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Binary execution trace (APOLLO_TRACE_BINARY). Threads append records to
+// their own ring buffer, a background thread writes the buffers to
+// <prefix>.bin in large blocks and frees the buffers of exited threads once
+// flushed. Region and model names are written once to
+// the <prefix>.dict text sidecar. apollo-trace2csv converts traces to the
+// APOLLO_TRACE_CSV files.
+class TraceWriter
+{
+public:
+  static constexpr char MAGIC[8] = {'A', 'P', 'O', 'L', 'L', 'O', 'T', 'R'};
+  static constexpr uint32_t VERSION = 1;
+
+  // Header of the .bin file.
+  struct FileHeader {
+    char magic[8];
+    uint32_t version;
+    int32_t rank;
+  };
+
+  // Record of a region execution, followed by num_features floats.
+  struct Record {
+    // Nanoseconds since the start of the trace.
+    uint64_t timestamp;
+    uint64_t idx;
+    double metric;
+    uint32_t region_id;
+    uint32_t model_id;
+    int32_t policy;
+    int32_t num_features;
+  };
+
+  // Dictionary lines are tab-separated:
+  //   start <system clock us at the start of the trace>
+  //   rank <rank>
+  //   region <region_id> <num_features> <model_name> <model_info> <name>
+  //   model <model_id> <name>
+  TraceWriter(const std::string &prefix, int rank);
+  ~TraceWriter();
+  TraceWriter(const TraceWriter &) = delete;
+  TraceWriter &operator=(const TraceWriter &) = delete;
+
+  uint32_t addRegion(const std::string &name,
+                     const std::string &model_name,
+                     const std::string &model_info,
+                     int num_features);
+  // Returns the id of a model name, adding it on first use.
+  uint32_t getModelId(const std::string &name);
+
+  void write(uint32_t region_id,
+             uint32_t model_id,
+             uint64_t idx,
+             const float *features,
+             int num_features,
+             int policy,
+             double metric);
+
+private:
+  // Single-producer, single-consumer byte ring, head and tail count bytes
+  // written and flushed since creation. Retired by its thread on exit, after
+  // its last record.
+  struct Buffer {
+    explicit Buffer(size_t capacity)
+        : data(new char[capacity]),
+          capacity(capacity),
+          head(0),
+          tail(0),
+          retired(false)
+    {
+    }
+    std::unique_ptr<char[]> data;
+    size_t capacity;
+    std::atomic<uint64_t> head;
+    std::atomic<uint64_t> tail;
+    std::atomic<bool> retired;
+  };
+
+  struct ThreadBufferGuard;
+  Buffer *getThreadBuffer();
+  void flush();
+  void run();
+
+  const uint64_t writer_id;
+  const std::chrono::steady_clock::time_point start;
+
+  std::ofstream bin_file;
+  std::ofstream dict_file;
+
+  // Guards buffers, the dictionary and the model ids. Threads share
+  // ownership of their buffer, which outlives the writer until they exit.
+  std::mutex mutex;
+  std::vector<std::shared_ptr<Buffer>> buffers;
+  uint32_t num_regions;
+  std::unordered_map<std::string, uint32_t> model_ids;
+
+  // Flusher thread state, flush_mutex serializes writes to bin_file.
+  std::mutex flush_mutex;
+  std::condition_variable cv;
+  bool stopping;
+  std::thread flusher;
+};
+
+#endif
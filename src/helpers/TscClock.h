@@ -0,0 +1,111 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_HELPERS_TSCCLOCK_H
+#define APOLLO_HELPERS_TSCCLOCK_H
+
+#include <time.h>
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define APOLLO_HAVE_TSC
+#endif
+
+// Low-overhead monotonic tick counter: the time stamp counter of x86
+// processors with an invariant TSC, CLOCK_MONOTONIC_RAW nanoseconds otherwise.
+// Ticks are converted to time with a frequency calibrated on first use.
+class TscClock
+{
+public:
+  static uint64_t now()
+  {
+#ifdef APOLLO_HAVE_TSC
+    if (useTsc()) return __rdtsc();
+#endif
+    return monotonicRaw();
+  }
+  // Reads of now() for timing a code region, fenced so that the region does
+  // not start before begin() and completes before end().
+  static uint64_t begin()
+  {
+#ifdef APOLLO_HAVE_TSC
+    if (useTsc()) {
+      uint64_t ticks = __rdtsc();
+      _mm_lfence();
+      return ticks;
+    }
+#endif
+    return monotonicRaw();
+  }
+  static uint64_t end()
+  {
+#ifdef APOLLO_HAVE_TSC
+    if (useTsc()) {
+      _mm_lfence();
+      return __rdtsc();
+    }
+#endif
+    return monotonicRaw();
+  }
+
+  static double nsPerTick()
+  {
+    static const double ns_per_tick = calibrate();
+    return ns_per_tick;
+  }
+  static double toSeconds(uint64_t ticks) { return ticks * nsPerTick() * 1e-9; }
+
+  // True if ticks are TSC cycles, checked once.
+  static bool useTsc()
+  {
+    static const bool invariant_tsc = hasInvariantTsc();
+    return invariant_tsc;
+  }
+
+private:
+  static uint64_t monotonicRaw()
+  {
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+  }
+
+  // The TSC is invariant, i.e., constant rate and not stopped in deep
+  // C-states, if CPUID.80000007H:EDX[8] is set.
+  static bool hasInvariantTsc()
+  {
+#ifdef APOLLO_HAVE_TSC
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007)
+      return false;
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1 << 8);
+#else
+    return false;
+#endif
+  }
+
+  // Counts ticks over CALIBRATION_PERIOD of the steady clock.
+  static double calibrate()
+  {
+    if (!useTsc()) return 1.0;
+
+    static constexpr std::chrono::milliseconds CALIBRATION_PERIOD(10);
+    auto start = std::chrono::steady_clock::now();
+    uint64_t start_ticks = now();
+    auto end = start;
+    while (end - start < CALIBRATION_PERIOD)
+      end = std::chrono::steady_clock::now();
+    uint64_t end_ticks = now();
+    return std::chrono::duration<double, std::nano>(end - start).count() /
+           (end_ticks - start_ticks);
+  }
+};
+
+#endif
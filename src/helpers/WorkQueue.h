@@ -0,0 +1,75 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_HELPERS_WORKQUEUE_H
+#define APOLLO_HELPERS_WORKQUEUE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+// Executes jobs in submission order on a single background thread. The worker
+// starts on the first submission, destruction runs the remaining jobs before
+// joining the worker.
+class WorkQueue
+{
+public:
+  WorkQueue() : stopping(false) {}
+  WorkQueue(const WorkQueue &) = delete;
+  WorkQueue &operator=(const WorkQueue &) = delete;
+
+  ~WorkQueue()
+  {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (worker.joinable()) worker.join();
+  }
+
+  std::future<void> submit(std::function<void()> job)
+  {
+    std::packaged_task<void()> task(std::move(job));
+    std::future<void> future = task.get_future();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(task));
+      if (!worker.joinable()) worker = std::thread(&WorkQueue::run, this);
+    }
+    cv.notify_one();
+
+    return future;
+  }
+
+private:
+  void run()
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      cv.wait(lock, [this]() { return stopping || !jobs.empty(); });
+      if (jobs.empty()) return;
+
+      std::packaged_task<void()> task = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      // Exceptions are stored in the future of the job.
+      task();
+      lock.lock();
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::deque<std::packaged_task<void()>> jobs;
+  bool stopping;
+  std::thread worker;
+};
+
+#endif
@@ -0,0 +1,50 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include "apollo/models/Compiled.h"
+
+#include <iostream>
+#include <string>
+#include <unordered_map>
+
+namespace apollo
+{
+
+// Constructed on first use, registration happens during static initialization
+// of the application.
+static std::unordered_map<std::string, Compiled::EvaluateFunction> &
+getRegistry()
+{
+  static std::unordered_map<std::string, Compiled::EvaluateFunction> registry;
+  return registry;
+}
+
+bool Compiled::registerModel(const char *model_name, EvaluateFunction evaluate)
+{
+  getRegistry()[model_name] = evaluate;
+  return true;
+}
+
+Compiled::Compiled(int num_policies, const std::string &model_name)
+    : PolicyModel(num_policies, "Compiled," + model_name)
+{
+  auto it = getRegistry().find(model_name);
+  if (it == getRegistry().end()) {
+    std::cerr << "== APOLLO: Compiled model " << model_name
+              << " is not registered, include its generated header in the "
+                 "application.\n"
+              << "== APOLLO: Exiting.\n";
+    abort();
+  }
+
+  evaluate = it->second;
+}
+
+int Compiled::getIndex(std::vector<float> &features)
+{
+  return evaluate(features.data());
+}
+
+}  // end namespace apollo.
@@ -6,6 +6,7 @@
 #include "apollo/models/DatasetMap.h"
 
 #include <cstring>
+#include <map>
 #include <string>
 
 namespace apollo
@@ -13,21 +14,27 @@ namespace apollo
 
 int DatasetMap::getIndex(std::vector<float> &features)
 {
-  if (best_policies.count(features) == 0) {
+  const int *policy = best_policies.find(FeatureKey(features));
+  if (!policy) {
     std::cerr << "DatasetMap does not have an entry for those features\n";
     abort();
   }
 
-  int policy = best_policies[features].first;
-
-  return policy;
+  return *policy;
 }
 
 void DatasetMap::train(Apollo::Dataset &dataset)
 {
   std::vector<std::vector<float>> features;
   std::vector<int> policies;
-  dataset.findMinMetricPolicyByFeatures(features, policies, best_policies);
+  std::map<std::vector<float>, std::pair<int, double>> min_metric_policies;
+  dataset.findMinMetricPolicyByFeatures(features,
+                                        policies,
+                                        min_metric_policies);
+
+  best_policies.clear();
+  for (auto &it : min_metric_policies)
+    best_policies.insert(FeatureKey(it.first), it.second.first);
 }
 
 }  // end namespace apollo.
\ No newline at end of file
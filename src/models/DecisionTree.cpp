@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <numeric>
 #include <sstream>
@@ -119,6 +120,23 @@ int DecisionTree::getIndex(std::vector<float> &features)
   return explorer->getIndex(features);
 }
 
+void DecisionTree::getIndices(const float *features,
+                              int num_features,
+                              size_t n,
+                              int *policies)
+{
+  if (trainable) {
+    explorer->getIndices(features, num_features, n, policies);
+    return;
+  }
+
+#ifdef ENABLE_OPENCV
+  PolicyModel::getIndices(features, num_features, n, policies);
+#else
+  dtree->predict(features, num_features, n, policies);
+#endif
+}
+
 void DecisionTree::load(const std::string &filename)
 {
   trainable = false;
@@ -126,4 +144,28 @@ void DecisionTree::load(const std::string &filename)
 }
 void DecisionTree::store(const std::string &filename) { dtree->save(filename); }
 
+bool DecisionTree::serialize(std::ostream &os)
+{
+#ifdef ENABLE_OPENCV
+  return false;
+#else
+  // Thresholds must round-trip exactly for ranks to predict alike. Ranks
+  // only predict, the training data stays local.
+  os.precision(std::numeric_limits<float>::max_digits10);
+  dtree->save(os, /*include_data=*/false);
+  return bool(os);
+#endif
+}
+
+bool DecisionTree::deserialize(std::istream &is)
+{
+#ifdef ENABLE_OPENCV
+  return false;
+#else
+  dtree = std::make_unique<DecisionTreeImpl>(policy_count, is);
+  trainable = false;
+  return true;
+#endif
+}
+
 }  // end namespace apollo.
@@ -5,23 +5,201 @@
 
 #include "apollo/models/PolicyNet.h"
 
-#include <bitset>
-#include <climits>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <new>
 #include <numeric>
+#include <stdexcept>
+#include <string>
+#include <tuple>
 
 #include "helpers/OutputFormatter.h"
 #include "helpers/TimeTrace.h"
 
+#ifdef ENABLE_BLAS
+// Fortran BLAS single precision GEMM, matrices are column-major.
+extern "C" void sgemm_(const char *transa,
+                       const char *transb,
+                       const int *m,
+                       const int *n,
+                       const int *k,
+                       const float *alpha,
+                       const float *a,
+                       const int *lda,
+                       const float *b,
+                       const int *ldb,
+                       const float *beta,
+                       float *c,
+                       const int *ldc);
+#endif
+
 namespace apollo
 {
 
+// Float array aligned for vector loads, reallocated only to grow.
+class AlignedBuffer
+{
+public:
+  static constexpr size_t ALIGNMENT = 64;
+
+  AlignedBuffer() = default;
+  explicit AlignedBuffer(size_t size) { resize(size); }
+  ~AlignedBuffer() { std::free(ptr); }
+  AlignedBuffer(const AlignedBuffer &) = delete;
+  AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+  // Grows the buffer to at least size elements, zero initialized.
+  void resize(size_t size)
+  {
+    if (size <= capacity) return;
+    std::free(ptr);
+    void *p = nullptr;
+    if (posix_memalign(&p, ALIGNMENT, size * sizeof(float)) != 0)
+      throw std::bad_alloc();
+    ptr = static_cast<float *>(p);
+    capacity = size;
+    std::fill(ptr, ptr + capacity, 0.f);
+  }
+
+  float *data() { return ptr; }
+  const float *data() const { return ptr; }
+
+private:
+  float *ptr = nullptr;
+  size_t capacity = 0;
+};
+
+// Rows of A processed per block of B, so that the block stays in cache.
+static constexpr int GEMM_BLOCK_K = 32;
+
+// c += a * b over n elements, the loop auto-vectorizes.
+static inline void axpy(float *__restrict__ c,
+                        const float *__restrict__ b,
+                        float a,
+                        int n)
+{
+  for (int j = 0; j < n; ++j)
+    c[j] += a * b[j];
+}
+
+static inline float dot(const float *__restrict__ a,
+                        const float *__restrict__ b,
+                        int n)
+{
+  // Independent partial sums to vectorize the reduction.
+  float sum[8] = {};
+  int j = 0;
+  for (; j + 8 <= n; j += 8)
+    for (int l = 0; l < 8; ++l)
+      sum[l] += a[j + l] * b[j + l];
+  for (; j < n; ++j)
+    sum[0] += a[j] * b[j];
+  return ((sum[0] + sum[1]) + (sum[2] + sum[3])) +
+         ((sum[4] + sum[5]) + (sum[6] + sum[7]));
+}
+
+// C[m x n] += A[m x k] * B[k x n], row-major. Zeros of A are skipped, which
+// are most of the bit-encoded features.
+static void gemmNN(
+    int m, int n, int k, const float *A, const float *B, float *C)
+{
+#ifdef ENABLE_BLAS
+  const float one = 1.f;
+  sgemm_("N", "N", &n, &m, &k, &one, B, &n, A, &k, &one, C, &n);
+#else
+  for (int p0 = 0; p0 < k; p0 += GEMM_BLOCK_K) {
+    int p1 = std::min(p0 + GEMM_BLOCK_K, k);
+    for (int i = 0; i < m; ++i)
+      for (int p = p0; p < p1; ++p) {
+        float a = A[i * k + p];
+        if (a != 0.f) axpy(&C[i * n], &B[p * n], a, n);
+      }
+  }
+#endif
+}
+
+// C[m x n] += A^T * B, A is [k x m] and B is [k x n], row-major.
+static void gemmTN(
+    int m, int n, int k, const float *A, const float *B, float *C)
+{
+#ifdef ENABLE_BLAS
+  const float one = 1.f;
+  sgemm_("N", "T", &n, &m, &k, &one, B, &n, A, &m, &one, C, &n);
+#else
+  for (int p = 0; p < k; ++p)
+    for (int i = 0; i < m; ++i) {
+      float a = A[p * m + i];
+      if (a != 0.f) axpy(&C[i * n], &B[p * n], a, n);
+    }
+#endif
+}
+
+// C[m x n] = A * B^T, A is [m x k] and B is [n x k], row-major.
+static void gemmNT(
+    int m, int n, int k, const float *A, const float *B, float *C)
+{
+#ifdef ENABLE_BLAS
+  const float one = 1.f, zero = 0.f;
+  sgemm_("T", "N", &n, &m, &k, &one, B, &k, A, &k, &zero, C, &n);
+#else
+  for (int i = 0; i < m; ++i)
+    for (int j = 0; j < n; ++j)
+      C[i * n + j] = dot(&A[i * k], &B[j * k], k);
+#endif
+}
+
+// Adam update of n parameters, biasCorrection1/2 are 1 - beta1/2^step.
+static void adamStep(int n,
+                     float *__restrict__ params,
+                     const float *__restrict__ grads,
+                     float *__restrict__ m,
+                     float *__restrict__ v,
+                     float learnRate,
+                     float beta1,
+                     float beta2,
+                     float biasCorrection1,
+                     float biasCorrection2,
+                     float epsilon)
+{
+  for (int i = 0; i < n; ++i) {
+    // Update the moving averages of the first and second moments of the
+    // gradient.
+    m[i] = beta1 * m[i] + (1 - beta1) * grads[i];
+    v[i] = beta2 * v[i] + (1 - beta2) * grads[i] * grads[i];
+
+    // Compute the unbiased moving averages.
+    float mHat = m[i] / biasCorrection1;
+    float vHat = v[i] / biasCorrection2;
+
+    // Update the parameters.
+    params[i] += learnRate * mHat / (std::sqrt(vHat) + epsilon);
+  }
+}
+
+enum class Activation { ReLU, Softmax };
+
+// Fully connected layer fused with its activation. Weights are stored
+// transposed, [inputSize x outputSize], so that the forward pass streams
+// contiguous rows.
 class FCLayer
 {
 public:
-  FCLayer(int inputSize, int outputSize)
-      : inputSize(inputSize), outputSize(outputSize)
+  FCLayer(int inputSize, int outputSize, Activation activation)
+      : inputSize(inputSize),
+        outputSize(outputSize),
+        activation(activation),
+        weights(inputSize * outputSize),
+        bias(outputSize),
+        weights_m(inputSize * outputSize),
+        weights_v(inputSize * outputSize),
+        weights_grad(inputSize * outputSize),
+        bias_m(outputSize),
+        bias_v(outputSize),
+        bias_grad(outputSize)
   {
     // Create the random number generator and the distribution for
     // He initialization.
@@ -30,386 +208,435 @@ public:
     double stddev = std::sqrt(2. / inputSize);
     std::normal_distribution<double> normal_dist(0., stddev);
 
-    // Allocate and zero initialize the arrays needed for the parameters.
-    weights = new double[outputSize * inputSize]();
-    weights_m = new double[outputSize * inputSize]();
-    weights_v = new double[outputSize * inputSize]();
-    weights_grad = new double[outputSize * inputSize]();
-
-    bias = new double[outputSize]();
-    bias_m = new double[outputSize]();
-    bias_v = new double[outputSize]();
-    bias_grad = new double[outputSize]();
-
     // Randomly initializer the layer weights.
     for (int i = 0; i < outputSize; ++i) {
       for (int j = 0; j < inputSize; ++j)
-        weights[i * inputSize + j] = normal_dist(generator);
+        weights.data()[j * outputSize + i] = normal_dist(generator);
       // TODO: does the bias help?
       // bias[i] = normal_dist(generator);
     }
   };
 
-  ~FCLayer()
+  // Returns the activated outputs for a batch of inputs.
+  const float *forward(const float *inputs, int batchSize)
   {
-    // Delete all allocated arrays.
-    delete[] weights;
-    delete[] weights_m;
-    delete[] weights_v;
-    delete[] weights_grad;
-
-    delete[] bias;
-    delete[] bias_m;
-    delete[] bias_v;
-    delete[] bias_grad;
-
-    if (outputs != NULL) {
-      delete[] outputs;
-      delete[] inputGrad;
-    }
-  }
-
-  double *forward(double *inputs, int batchSize)
-  {
-    // Check if the current batch size is larger than the maximum so far.
+    // Scratch buffers are sized by the maximum batch size so far.
     if (batchSize > maxBatchSize) {
-      // Delete the old arrays if they exist.
-      if (outputs != NULL) {
-        delete[] outputs;
-        delete[] inputGrad;
-      }
-
-      // Allocate new arrays for the batch size.
-      outputs = new double[batchSize * outputSize]();
-      inputGrad = new double[batchSize * inputSize];
-
+      outputs.resize(batchSize * outputSize);
+      inputGrad.resize(batchSize * inputSize);
       maxBatchSize = batchSize;
-    } else {
-      // Zero the output array.
-      for (int i = 0; i < batchSize * outputSize; ++i) {
-        outputs[i] = 0;
-      }
     }
 
-    // Compute the forward pass of this layer: y = M x + b
+    // Compute the forward pass of this layer: y = x M + b
+    float *out = outputs.data();
+    for (int i = 0; i < batchSize; ++i)
+      std::copy(bias.data(), bias.data() + outputSize, &out[i * outputSize]);
+    gemmNN(batchSize, outputSize, inputSize, inputs, weights.data(), out);
+
     for (int i = 0; i < batchSize; ++i) {
-      for (int j = 0; j < outputSize; ++j) {
-        for (int k = 0; k < inputSize; ++k) {
-          outputs[i * outputSize + j] +=
-              weights[j * inputSize + k] * inputs[i * inputSize + k];
+      float *row = &out[i * outputSize];
+      if (activation == Activation::ReLU) {
+        for (int j = 0; j < outputSize; ++j)
+          row[j] = std::max(row[j], 0.f);
+      } else {
+        // Subtract the maximum for numerical stability.
+        float alpha = *std::max_element(row, row + outputSize);
+        float sum = 0;
+        for (int j = 0; j < outputSize; ++j) {
+          row[j] = std::exp(row[j] - alpha);
+          sum += row[j];
         }
-
-        outputs[i * outputSize + j] += bias[j];
+        for (int j = 0; j < outputSize; ++j)
+          row[j] /= sum;
       }
     }
 
-    return outputs;
+    return out;
   }
 
-  double *backward(double *inputs, double *chainRuleGrad, int batchSize)
+  // Computes the parameter gradients from the gradients of the outputs, which
+  // are of the activated outputs for ReLU and of the pre-activations for
+  // Softmax (see Net::lossGrad). Returns the gradients of the inputs if
+  // needed, else nullptr.
+  float *backward(const float *inputs,
+                  float *chainRuleGrad,
+                  int batchSize,
+                  bool needInputGrad)
   {
-    // Zero all gradient arrays.
-    for (int i = 0; i < batchSize * inputSize; ++i) {
-      inputGrad[i] = 0;
-    }
-
-    for (int i = 0; i < outputSize * inputSize; ++i) {
-      weights_grad[i] = 0;
-    }
-
-    for (int i = 0; i < outputSize; ++i) {
-      bias_grad[i] = 0;
+    // Gradients through ReLU pass only where the output is positive.
+    if (activation == Activation::ReLU) {
+      const float *out = outputs.data();
+      for (int i = 0; i < batchSize * outputSize; ++i)
+        chainRuleGrad[i] = (out[i] > 0.f ? chainRuleGrad[i] : 0.f);
     }
 
     // Compute the gradients using the chain rule with the gradients from the
     // previous layer.
-    for (int i = 0; i < batchSize; ++i) {
-      for (int j = 0; j < outputSize; ++j) {
-        for (int k = 0; k < inputSize; ++k) {
-          weights_grad[j * inputSize + k] +=
-              chainRuleGrad[i * outputSize + j] * inputs[i * inputSize + k];
-          inputGrad[i * inputSize + k] +=
-              chainRuleGrad[i * outputSize + j] * weights[j * inputSize + k];
-        }
-
-        bias_grad[j] += chainRuleGrad[i * outputSize + j];
-      }
-    }
-
-    return inputGrad;
+    std::fill(weights_grad.data(),
+              weights_grad.data() + inputSize * outputSize,
+              0.f);
+    gemmTN(inputSize,
+           outputSize,
+           batchSize,
+           inputs,
+           chainRuleGrad,
+           weights_grad.data());
+
+    float *bgrad = bias_grad.data();
+    std::fill(bgrad, bgrad + outputSize, 0.f);
+    for (int i = 0; i < batchSize; ++i)
+      axpy(bgrad, &chainRuleGrad[i * outputSize], 1.f, outputSize);
+
+    if (!needInputGrad) return nullptr;
+    gemmNT(batchSize,
+           inputSize,
+           outputSize,
+           chainRuleGrad,
+           weights.data(),
+           inputGrad.data());
+    return inputGrad.data();
   }
 
-  void step(double learnRate,
-            double beta1 = 0.5,
-            double beta2 = 0.9,
-            double epsilon = 1e-8)
+  void step(float learnRate,
+            float beta1 = 0.5,
+            float beta2 = 0.9,
+            float epsilon = 1e-8)
   {
     stepNum++;
 
     // Update each parameter in the layer using Adam optimization.
-    for (int i = 0; i < outputSize; ++i) {
-      for (int j = 0; j < inputSize; ++j) {
-        int index = i * inputSize + j;
-
-        // Update the moving averages of the first and second moments of the
-        // gradient.
-        weights_m[index] =
-            beta1 * weights_m[index] + (1 - beta1) * weights_grad[index];
-        weights_v[index] = beta2 * weights_v[index] +
-                           (1 - beta2) * std::pow(weights_grad[index], 2);
-
-        // Compute the unbiased moving averages.
-        double mHat = weights_m[index] / (1 - std::pow(beta1, stepNum));
-        double vHat = weights_v[index] / (1 - std::pow(beta2, stepNum));
-
-        // Update the weights.
-        weights[index] += learnRate * mHat / (std::sqrt(vHat) + epsilon);
-      }
-
-      // Update the moving averages of the first and second moments of the
-      // gradient.
-      bias_m[i] = beta1 * bias_m[i] + (1 - beta1) * bias_grad[i];
-      bias_v[i] = beta2 * bias_v[i] + (1 - beta2) * std::pow(bias_grad[i], 2);
+    float biasCorrection1 = 1 - std::pow(beta1, stepNum);
+    float biasCorrection2 = 1 - std::pow(beta2, stepNum);
+    adamStep(inputSize * outputSize,
+             weights.data(),
+             weights_grad.data(),
+             weights_m.data(),
+             weights_v.data(),
+             learnRate,
+             beta1,
+             beta2,
+             biasCorrection1,
+             biasCorrection2,
+             epsilon);
+    adamStep(outputSize,
+             bias.data(),
+             bias_grad.data(),
+             bias_m.data(),
+             bias_v.data(),
+             learnRate,
+             beta1,
+             beta2,
+             biasCorrection1,
+             biasCorrection2,
+             epsilon);
+  }
 
-      // Compute the unbiased moving averages.
-      double mHat = bias_m[i] / (1 - std::pow(beta1, stepNum));
-      double vHat = bias_v[i] / (1 - std::pow(beta2, stepNum));
+  // Stored models keep double weights in [outputSize x inputSize] order.
+  void save(std::ostream &os) const
+  {
+    std::vector<double> values(inputSize * outputSize);
+    for (int i = 0; i < outputSize; ++i)
+      for (int j = 0; j < inputSize; ++j)
+        values[i * inputSize + j] = weights.data()[j * outputSize + i];
+    os.write((char *)values.data(), sizeof(double) * values.size());
+    values.assign(bias.data(), bias.data() + outputSize);
+    os.write((char *)values.data(), sizeof(double) * outputSize);
+  }
 
-      // Update the weights.
-      bias[i] += learnRate * mHat / (std::sqrt(vHat) + epsilon);
-    }
+  void load(std::istream &is)
+  {
+    std::vector<double> values(inputSize * outputSize);
+    is.read((char *)values.data(), sizeof(double) * values.size());
+    for (int i = 0; i < outputSize; ++i)
+      for (int j = 0; j < inputSize; ++j)
+        weights.data()[j * outputSize + i] = values[i * inputSize + j];
+    is.read((char *)values.data(), sizeof(double) * outputSize);
+    std::copy(values.begin(), values.begin() + outputSize, bias.data());
   }
 
   int inputSize;
   int outputSize;
 
-  double *weights;
-  double *bias;
-
 private:
+  Activation activation;
   long stepNum = 0;
-  double *weights_m;
-  double *weights_v;
-  double *weights_grad;
-  double *bias_m;
-  double *bias_v;
-  double *bias_grad;
-
-  double *outputs = NULL;
-  double *inputGrad;
+  AlignedBuffer weights;
+  AlignedBuffer bias;
+  AlignedBuffer weights_m;
+  AlignedBuffer weights_v;
+  AlignedBuffer weights_grad;
+  AlignedBuffer bias_m;
+  AlignedBuffer bias_v;
+  AlignedBuffer bias_grad;
+
+  AlignedBuffer outputs;
+  AlignedBuffer inputGrad;
   int maxBatchSize = 0;
 };
 
-class ReLU
+class Net
 {
 public:
-  ~ReLU()
+  Net(int inputSize,
+      int hiddenSize,
+      int outputSize,
+      double learnRate = 1e-2,
+      double beta1 = 0.5,
+      double beta2 = 0.9)
+      : layer1(inputSize, hiddenSize, Activation::ReLU),
+        layer2(hiddenSize, hiddenSize, Activation::ReLU),
+        layer3(hiddenSize, outputSize, Activation::Softmax),
+        inputSize(inputSize),
+        hiddenSize(hiddenSize),
+        outputSize(outputSize),
+        learnRate(learnRate),
+        beta1(beta1),
+        beta2(beta2)
   {
-    // Delete allocated arrays.
-    if (outputs != NULL) {
-      delete[] outputs;
-      delete[] inputGrad;
-    }
   }
 
-  double *forward(double *inputs, int batchSize, int outputSize)
+  int getInputSize() const { return inputSize; }
+
+  // Returns the input scratch buffer for a batch, states are written there
+  // before calling forward or trainStep.
+  float *getStates(int batchSize)
   {
-    // Check if the arrays need to be reallocated.
-    if (batchSize * outputSize > maxArraySize) {
-      maxArraySize = batchSize * outputSize;
-
-      // Delete old arrays if they exist.
-      if (outputs != NULL) {
-        delete[] outputs;
-        delete[] inputGrad;
-      }
+    states.resize(batchSize * inputSize);
+    return states.data();
+  }
 
-      outputs = new double[maxArraySize];
-      inputGrad = new double[maxArraySize];
-    }
+  const float *forward(const float *state, int batchSize)
+  {
+    // Compute the forward pass through each layer of the network.
+    auto aout1 = layer1.forward(state, batchSize);
+    auto aout2 = layer2.forward(aout1, batchSize);
+    auto aout3 = layer3.forward(aout2, batchSize);
 
-    // Compute ReLU activation.
-    for (int i = 0; i < batchSize * outputSize; ++i) {
-      outputs[i] = std::max(inputs[i], 0.);
-    }
+    return aout3;
+  }
 
-    return outputs;
+  void trainStep(const float *state,
+                 const int *action,
+                 const float *reward,
+                 int batchSize)
+  {
+    // Compute the forward pass through each layer of the network.
+    auto aout1 = layer1.forward(state, batchSize);
+    auto aout2 = layer2.forward(aout1, batchSize);
+    auto aout3 = layer3.forward(aout2, batchSize);
+
+    // Compute the backward pass through each layer and compute the gradients.
+    auto out3_grad = lossGrad(action, aout3, reward, batchSize);
+    auto aout2_grad = layer3.backward(aout2, out3_grad, batchSize, true);
+    auto aout1_grad = layer2.backward(aout1, aout2_grad, batchSize, true);
+    layer1.backward(state, aout1_grad, batchSize, false);
+
+    // Update the parameters of each layer.
+    layer1.step(learnRate, beta1, beta2);
+    layer2.step(learnRate, beta1, beta2);
+    layer3.step(learnRate, beta1, beta2);
   }
 
-  double *backward(double *inputs,
-                   double *chainRuleGrad,
-                   int batchSize,
-                   int inputSize)
+  FCLayer layer1;
+  FCLayer layer2;
+  FCLayer layer3;
+
+private:
+  // Gradient of the policy gradient loss through the softmax for the given
+  // state, action, and reward.
+  float *lossGrad(const int *action,
+                  const float *actionProbs,
+                  const float *reward,
+                  int batchSize)
   {
-    // Compute the gradients of the ReLU layer using the chain rule with the
-    // gradients from the previous layer.
-    for (int i = 0; i < batchSize * inputSize; ++i) {
-      inputGrad[i] = chainRuleGrad[i] * std::signbit(-inputs[i]);
+    outputGrad.resize(batchSize * outputSize);
+    float *grad = outputGrad.data();
+    for (int i = 0; i < batchSize; ++i) {
+      for (int j = 0; j < outputSize; ++j) {
+        int index = i * outputSize + j;
+        grad[index] = -reward[i] * actionProbs[index] / batchSize;
+      }
+      grad[i * outputSize + action[i]] += reward[i] / batchSize;
     }
 
-    return inputGrad;
+    return grad;
   }
 
-private:
-  double *outputs = NULL;
-  double *inputGrad;
-  int maxArraySize = 0;
+  int inputSize;
+  int hiddenSize;
+  int outputSize;
+  float learnRate;
+  float beta1;
+  float beta2;
+  AlignedBuffer states;
+  AlignedBuffer outputGrad;
 };
 
-class Softmax
+// Encodes features to the network input. Encodings are:
+//   binary: the low bits of the feature cast to an unsigned integer, one input
+//           per bit, bits=0 fits the width to the maximum feature value
+//   scalar: the feature normalized to its range, one input
+//   log:    sign(x) * log(1 + |x|), one input
+//   onehot: one input per bucket of the feature range
+// Ranges are fitted on the first trained dataset and kept afterwards, so that
+// inputs are stable across trainings.
+// Converts a feature to an unsigned integer, saturating values beyond the
+// range of uint64_t. NaN and negative values convert to 0.
+static uint64_t toUnsigned(float f)
+{
+  if (!(f > 0.f)) return 0;
+  if (f >= 18446744073709551616.f) return UINT64_MAX;
+  return (uint64_t)f;
+}
+
+class FeatureEncoder
 {
 public:
-  ~Softmax()
+  enum Kind { BINARY, SCALAR, LOG, ONEHOT };
+
+  FeatureEncoder(const std::string &encoding,
+                 int numFeatures,
+                 int bits,
+                 int buckets)
+      : numFeatures(numFeatures),
+        autoBits(bits == 0),
+        bits(bits == 0 ? 64 : bits),
+        buckets(buckets),
+        fitted(false),
+        minValues(numFeatures, 0.f),
+        maxValues(numFeatures, 0.f)
   {
-    // Delete allocated arrays.
-    if (outputs != NULL) {
-      delete[] outputs;
-      delete[] inputGrad;
-    }
+    if (encoding == "binary")
+      kind = BINARY;
+    else if (encoding == "scalar")
+      kind = SCALAR;
+    else if (encoding == "log")
+      kind = LOG;
+    else if (encoding == "onehot")
+      kind = ONEHOT;
+    else
+      throw std::runtime_error("Unknown PolicyNet encoding " + encoding);
+
+    if (bits < 0 || bits > 64)
+      throw std::runtime_error("PolicyNet bits must be in [0, 64], 0 is auto");
+    if (buckets < 1)
+      throw std::runtime_error("PolicyNet buckets must be positive");
   }
 
-  double *forward(double *inputs, int batchSize, int outputSize)
+  // Returns true if the encoding depends on the range of features.
+  bool needsFit() const
   {
-    // Check if the arrays need to be reallocated.
-    if (batchSize * outputSize > maxArraySize) {
-      maxArraySize = batchSize * outputSize;
-
-      // Delete old arrays if they exist.
-      if (outputs != NULL) {
-        delete[] outputs;
-        delete[] inputGrad;
-      }
+    return kind == SCALAR || kind == ONEHOT || (kind == BINARY && autoBits);
+  }
 
-      outputs = new double[maxArraySize];
-      inputGrad = new double[maxArraySize];
+  int getInputSize() const
+  {
+    switch (kind) {
+      case BINARY:
+        return numFeatures * bits;
+      case ONEHOT:
+        return numFeatures * buckets;
+      default:
+        return numFeatures;
     }
+  }
 
-    // Compute the maximum of each previous layer for each sample. This is used
-    // to improve numerical stability.
-    double alpha[batchSize];
-    for (int i = 0; i < batchSize; ++i) {
-      alpha[i] = inputs[i * outputSize];
-      for (int j = 0; j < outputSize; ++j) {
-        alpha[i] = std::max(alpha[i], inputs[i * outputSize + j]);
+  void fit(const std::vector<std::tuple<std::vector<float>, int, double>>
+               &measures)
+  {
+    if (fitted || !needsFit() || measures.empty()) return;
+
+    minValues = maxValues = std::get<0>(measures[0]);
+    for (auto &measure : measures) {
+      auto &features = std::get<0>(measure);
+      for (int i = 0; i < numFeatures; ++i) {
+        minValues[i] = std::min(minValues[i], features[i]);
+        maxValues[i] = std::max(maxValues[i], features[i]);
       }
     }
 
-    // Calculate the probabilities for each output using softmax.
-    for (int i = 0; i < batchSize; ++i) {
-      double sum = 0;
-      for (int j = 0; j < outputSize; ++j) {
-        int index = i * outputSize + j;
-        outputs[index] = std::exp(
-            inputs[index] -
-            alpha[i]);  // Note: subtract alpha for numerical stability.
-        sum += outputs[index];
-      }
-      for (int j = 0; j < outputSize; ++j) {
-        outputs[i * outputSize + j] /= sum;
+    if (kind == BINARY && autoBits) {
+      uint64_t maxBits = 1;
+      for (int i = 0; i < numFeatures; ++i)
+        maxBits |= toUnsigned(maxValues[i]);
+      bits = 0;
+      while (maxBits) {
+        ++bits;
+        maxBits >>= 1;
       }
     }
 
-    return outputs;
+    fitted = true;
   }
 
-  double *lossGrad(int *action,
-                   double *actionProbs,
-                   double *reward,
-                   int batchSize,
-                   int inputSize)
+  void encode(const float *features, float *state) const
   {
-    // Compute the gradient of the softmax layer for the given state, action,
-    // and reward.
-    for (int i = 0; i < batchSize; ++i) {
-      for (int j = 0; j < inputSize; ++j) {
-        int index = i * inputSize + j;
-        inputGrad[index] = -reward[i] * actionProbs[index] / batchSize;
+    for (int i = 0; i < numFeatures; ++i) {
+      float f = features[i];
+      switch (kind) {
+        case BINARY: {
+          uint64_t value = toUnsigned(f);
+          // Saturate values beyond the encoded width.
+          if (bits < 64 && (value >> bits)) value = (1ULL << bits) - 1;
+          for (int j = 0; j < bits; ++j)
+            state[i * bits + j] = (value >> j) & 1;
+          break;
+        }
+        case SCALAR:
+          state[i] = (maxValues[i] > minValues[i]
+                          ? (f - minValues[i]) / (maxValues[i] - minValues[i])
+                          : 0.f);
+          break;
+        case LOG:
+          state[i] = std::copysign(std::log1p(std::fabs(f)), f);
+          break;
+        case ONEHOT: {
+          // Features outside the fitted range fall in the first or last
+          // bucket, clamped before the conversion, NaN in the first.
+          float position = 0.f;
+          if (maxValues[i] > minValues[i])
+            position = (f - minValues[i]) / (maxValues[i] - minValues[i]) *
+                       buckets;
+          if (!(position > 0.f)) position = 0.f;
+          int bucket = std::min(position, float(buckets - 1));
+          std::fill(&state[i * buckets], &state[(i + 1) * buckets], 0.f);
+          state[i * buckets + bucket] = 1.f;
+          break;
+        }
       }
-      inputGrad[i * inputSize + action[i]] += reward[i] / batchSize;
     }
-
-    return inputGrad;
   }
 
-private:
-  double *outputs = NULL;
-  double *inputGrad;
-  int maxArraySize = 0;
-};
-
-class Net
-{
-public:
-  Net(int inputSize,
-      int hiddenSize,
-      int outputSize,
-      double learnRate = 1e-2,
-      double beta1 = 0.5,
-      double beta2 = 0.9)
-      : inputSize(inputSize),
-        hiddenSize(hiddenSize),
-        outputSize(outputSize),
-        learnRate(learnRate),
-        beta1(beta1),
-        beta2(beta2),
-        layer1(FCLayer(inputSize, hiddenSize)),
-        layer2(FCLayer(hiddenSize, hiddenSize)),
-        layer3(FCLayer(hiddenSize, outputSize))
+  // Fitted state for stored models, it precedes the weights since it
+  // determines the input size.
+  void save(std::ostream &os) const
   {
+    int32_t header[2] = {fitted, bits};
+    os.write((char *)header, sizeof(header));
+    os.write((char *)minValues.data(), sizeof(float) * numFeatures);
+    os.write((char *)maxValues.data(), sizeof(float) * numFeatures);
   }
 
-  double *forward(double *state, int batchSize)
+  void load(std::istream &is)
   {
-    // Compute the forward pass through each layer of the network.
-    auto out1 = layer1.forward(state, batchSize);
-    auto aout1 = relu1.forward(out1, batchSize, hiddenSize);
-    auto out2 = layer2.forward(aout1, batchSize);
-    auto aout2 = relu2.forward(out2, batchSize, hiddenSize);
-    auto out3 = layer3.forward(aout2, batchSize);
-    auto aout3 = softmax.forward(out3, batchSize, outputSize);
-
-    return aout3;
-  }
-
-  void trainStep(double *state, int *action, double *reward, int batchSize)
-  {
-    // Compute the forward pass through each layer of the network.
-    auto out1 = layer1.forward(state, batchSize);
-    auto aout1 = relu1.forward(out1, batchSize, hiddenSize);
-    auto out2 = layer2.forward(aout1, batchSize);
-    auto aout2 = relu2.forward(out2, batchSize, hiddenSize);
-    auto out3 = layer3.forward(aout2, batchSize);
-    auto aout3 = softmax.forward(out3, batchSize, outputSize);
-
-    // Compute the backward pass through each layer and compute the gradients.
-    auto aout3_grad =
-        softmax.lossGrad(action, aout3, reward, batchSize, outputSize);
-    auto out3_grad = layer3.backward(aout2, aout3_grad, batchSize);
-    auto aout2_grad = relu2.backward(out2, out3_grad, batchSize, hiddenSize);
-    auto out2_grad = layer2.backward(aout1, aout2_grad, batchSize);
-    auto aout1_grad = relu1.backward(out1, out2_grad, batchSize, hiddenSize);
-    layer1.backward(state, aout1_grad, batchSize);
-
-    // Update the parameters of each layer.
-    layer1.step(learnRate, beta1, beta2);
-    layer2.step(learnRate, beta1, beta2);
-    layer3.step(learnRate, beta1, beta2);
+    int32_t header[2];
+    is.read((char *)header, sizeof(header));
+    fitted = header[0];
+    bits = header[1];
+    is.read((char *)minValues.data(), sizeof(float) * numFeatures);
+    is.read((char *)maxValues.data(), sizeof(float) * numFeatures);
   }
 
-  FCLayer layer1;
-  FCLayer layer2;
-  FCLayer layer3;
-
 private:
-  int inputSize;
-  int hiddenSize;
-  int outputSize;
-  double learnRate;
-  double beta1;
-  double beta2;
-  ReLU relu1;
-  ReLU relu2;
-  Softmax softmax;
+  Kind kind;
+  int numFeatures;
+  // Fits the bits to the features, before fitting all 64 bits are encoded.
+  bool autoBits;
+  int bits;
+  int buckets;
+  bool fitted;
+  std::vector<float> minValues;
+  std::vector<float> maxValues;
 };
 
 PolicyNet::PolicyNet(int numPolicies,
@@ -418,20 +645,22 @@ PolicyNet::PolicyNet(int numPolicies,
                      double beta = 0.5,
                      double beta1 = 0.5,
                      double beta2 = 0.9,
-                     double threshold = 0.0)
+                     double threshold = 0.0,
+                     const std::string &encoding = "binary",
+                     int bits = 64,
+                     int buckets = 16)
     : PolicyModel(numPolicies, "PolicyNet"),
       numPolicies(numPolicies),
+      encoder(std::make_unique<FeatureEncoder>(
+          encoding, numFeatures, bits, buckets)),
+      lr(lr),
       beta(beta),
+      beta1(beta1),
+      beta2(beta2),
       threshold(threshold),
       trainable(true)
 {
-  // Encode features by bit-representation, assumes 64 bits are enough.
-  net = std::make_unique<Net>(64 * numFeatures,
-                              (64 * numFeatures + numPolicies) / 2,
-                              numPolicies,
-                              lr,
-                              beta1,
-                              beta2);
+  createNet();
   // Seed the random number generator using the current time.
   std::random_device rd;
   gen.seed(rd());
@@ -439,6 +668,17 @@ PolicyNet::PolicyNet(int numPolicies,
 
 PolicyNet::~PolicyNet() {}
 
+void PolicyNet::createNet()
+{
+  // The hidden layer is sized by the inputs and policies, with a floor so that
+  // compact encodings still have capacity to learn.
+  static constexpr int MIN_HIDDEN_SIZE = 16;
+  int inputSize = encoder->getInputSize();
+  int hiddenSize = std::max((inputSize + numPolicies) / 2, MIN_HIDDEN_SIZE);
+  net = std::make_unique<Net>(
+      inputSize, hiddenSize, numPolicies, lr, beta1, beta2);
+}
+
 void PolicyNet::train(Apollo::Dataset &dataset)
 {
   std::vector<std::vector<float>> states;
@@ -447,19 +687,21 @@ void PolicyNet::train(Apollo::Dataset &dataset)
 
   auto measures = dataset.toVectorOfTuples();
 
+  // Fitting the encoder changes the input size before the first training
+  // only, so the untrained net is replaced.
+  if (encoder->needsFit() && trainCount == 0) {
+    encoder->fit(measures);
+    if (encoder->getInputSize() != net->getInputSize()) createNet();
+  }
+
   for (auto &measure : measures) {
     auto &features = std::get<0>(measure);
     auto policy = std::get<1>(measure);
     auto metric = std::get<2>(measure);
 
-    std::vector<float> features_bits;
-    for (auto &f : features) {
-      // XXX: assumes features can be casted to 64-bit unsigned integers.
-      std::bitset<sizeof(uint64_t) * CHAR_BIT> bits((uint64_t)f);
-      for (int i = 0; i < bits.size(); i++)
-        features_bits.push_back(bits[i]);
-    }
-    states.push_back(std::move(features_bits));
+    std::vector<float> state(encoder->getInputSize());
+    encoder->encode(features.data(), state.data());
+    states.push_back(std::move(state));
     actions.push_back(policy);
     // XXX: metric is assumed to be execution time, hence reward should maximize
     // when execution time is minimized. Out of various alternatives, e^-metric
@@ -495,38 +737,23 @@ void PolicyNet::trainNet(std::vector<std::vector<float>> &states,
   // Don't train if the average execution time is less than the threshold.
   if (baseline < threshold) return;
 
-  // Create the arrays used for training.
-  double *trainStates = new double[batchSize * inputSize];
-  int *trainActions = new int[batchSize];
-  double *trainRewards = new double[batchSize];
-
   // Fill the arrays used for training.
+  float *trainStates = net->getStates(batchSize);
+  std::vector<int> trainActions(actions.begin(), actions.begin() + batchSize);
+  std::vector<float> trainRewards(batchSize);
   for (int i = 0; i < batchSize; ++i) {
-    for (int j = 0; j < inputSize; ++j)
-      trainStates[i * inputSize + j] = states[i][j];
-
-    trainActions[i] = actions[i];
-    trainRewards[i] =
-        rewards[i] -
-        baseline;  // Subtract the moving average baseline to reduce variance.
-    // std::cout << "=====\n;";
-    // std::cout << "TRAINING DATA i " << i << "\n";
-    // std::cout << "trainState [ ";
-    // for (int j = 0; j < inputSize; ++j)
-    //   std::cout << trainStates[i * inputSize + j] << ", ";
-    // std::cout << " ]\n";
-    // std::cout << "trainActions " << trainActions[i] << "\n";
-    // std::cout << "trainRewards " << trainRewards[i] << "\n";
-    // std::cout << "=====\n";
+    std::copy(states[i].begin(),
+              states[i].begin() + inputSize,
+              &trainStates[i * inputSize]);
+    // Subtract the moving average baseline to reduce variance.
+    trainRewards[i] = rewards[i] - baseline;
   }
 
   // Train the network.
-  net->trainStep(trainStates, trainActions, trainRewards, batchSize);
-
-  // Delete the arrays used for training.
-  delete[] trainStates;
-  delete[] trainActions;
-  delete[] trainRewards;
+  net->trainStep(trainStates,
+                 trainActions.data(),
+                 trainRewards.data(),
+                 batchSize);
 }
 
 int PolicyNet::getIndex(std::vector<float> &features)
@@ -540,46 +767,25 @@ int PolicyNet::getIndex(std::vector<float> &features)
   // convention return policy 0 as the default.
   if (baseline < threshold) return 0;
 
-  std::vector<double> actionProbs;
-
   // Check if these features have already been evaluated since the previous
   // network update.
-  std::string key = "";
-  int inputSize = features.size() * 64;
-  std::bitset<sizeof(uint64_t) * CHAR_BIT> bits;
-  for (auto &feature : features) {
-    bits = (uint64_t)feature;
-    key.append(bits.to_string());
-  }
-
-  auto it = actionProbabilityMap.find(key);
-  if (it != actionProbabilityMap.end()) {
-    // Use the previously evaluated action probabilities.
-    actionProbs = it->second;
-  } else {
-    // Create the state array to be evaluated by the network.
-    double *evalState = new double[inputSize];
-    for (int i = 0; i < features.size(); i++) {
-      // Each feature is encoded in 64-bits.
-      size_t index = i * 64;
-      std::bitset<sizeof(uint64_t) * CHAR_BIT> bits((uint64_t)features[i]);
-      for (int j = 0; j < 64; ++j) {
-        evalState[index + j] = bits[j];
-      }
-    }
+  FeatureKey key(features);
+  const std::vector<double> *cachedActionProbs = actionProbabilityMap.find(key);
+  if (!cachedActionProbs) {
+    // Create the state to be evaluated by the network.
+    float *evalState = net->getStates(1);
+    encoder->encode(features.data(), evalState);
 
     // Compute the action probabilities using the network and store in a vector.
-    double *evalActionProbs = net->forward(evalState, 1);
-    actionProbs = std::vector<double>(numPolicies);
-    for (int i = 0; i < numPolicies; ++i)
-      actionProbs[i] = evalActionProbs[i];
-
-    // Delete the state array.
-    delete[] evalState;
+    const float *evalActionProbs = net->forward(evalState, 1);
+    std::vector<double> actionProbs(evalActionProbs,
+                                    evalActionProbs + numPolicies);
 
     // Add the action probabilities to the cache to be reused later.
-    actionProbabilityMap.insert(std::make_pair(key, actionProbs));
+    cachedActionProbs =
+        &actionProbabilityMap.insert(key, std::move(actionProbs));
   }
+  const std::vector<double> &actionProbs = *cachedActionProbs;
   // std::cout << " probs: ";
   // for (auto &p : actionProbs) {
   //   std::cout << p << " ";
@@ -593,8 +799,57 @@ int PolicyNet::getIndex(std::vector<float> &features)
   return policyIndex;
 }
 
+void PolicyNet::getIndices(const float *features,
+                           int num_features,
+                           size_t n,
+                           int *policies)
+{
+  // Debias the estimate of the moving average.
+  double baseline =
+      (trainCount > 0 ? rewardMovingAvg / (1 - std::pow(beta, trainCount))
+                      : 0.0);
+
+  // Don't evaluate if the average execution time is less than the threshold, by
+  // convention return policy 0 as the default.
+  if (baseline < threshold) {
+    std::fill(policies, policies + n, 0);
+    return;
+  }
+
+  // Sample policies of cached features, evaluate the rest as one batch.
+  std::vector<size_t> uncached;
+  for (size_t i = 0; i < n; ++i) {
+    const std::vector<double> *actionProbs = actionProbabilityMap.find(
+        FeatureKey(&features[i * num_features], num_features));
+    if (actionProbs) {
+      std::discrete_distribution<> d(actionProbs->begin(), actionProbs->end());
+      policies[i] = d(gen);
+    } else
+      uncached.push_back(i);
+  }
+  if (uncached.empty()) return;
+
+  int inputSize = encoder->getInputSize();
+  float *evalStates = net->getStates(uncached.size());
+  for (size_t j = 0; j < uncached.size(); ++j)
+    encoder->encode(&features[uncached[j] * num_features],
+                    &evalStates[j * inputSize]);
+  const float *evalActionProbs = net->forward(evalStates, uncached.size());
+
+  for (size_t j = 0; j < uncached.size(); ++j) {
+    const float *probs = &evalActionProbs[j * numPolicies];
+    std::vector<double> &actionProbs = actionProbabilityMap.insert(
+        FeatureKey(&features[uncached[j] * num_features], num_features),
+        std::vector<double>(probs, probs + numPolicies));
+    std::discrete_distribution<> d(actionProbs.begin(), actionProbs.end());
+    policies[uncached[j]] = d(gen);
+  }
+}
+
 bool PolicyNet::isTrainable() { return trainable; }
 
+int PolicyNet::getInputSize() const { return encoder->getInputSize(); }
+
 void PolicyNet::store(const std::string &filename)
 {
 #if 0
@@ -635,16 +890,12 @@ void PolicyNet::store(const std::string &filename)
     return;
   }
 
-  // Write the weights and biases of each layer to the output file.
-  f.write((char *)net->layer1.weights,
-          sizeof(double) * net->layer1.inputSize * net->layer1.outputSize);
-  f.write((char *)net->layer1.bias, sizeof(double) * net->layer1.outputSize);
-  f.write((char *)net->layer2.weights,
-          sizeof(double) * net->layer2.inputSize * net->layer2.outputSize);
-  f.write((char *)net->layer2.bias, sizeof(double) * net->layer2.outputSize);
-  f.write((char *)net->layer3.weights,
-          sizeof(double) * net->layer3.inputSize * net->layer3.outputSize);
-  f.write((char *)net->layer3.bias, sizeof(double) * net->layer3.outputSize);
+  // Write the encoder state and the weights and biases of each layer to the
+  // output file.
+  if (encoder->needsFit()) encoder->save(f);
+  net->layer1.save(f);
+  net->layer2.save(f);
+  net->layer3.save(f);
 
   // Store reward moving average so that the threshold still works if the model
   // is loaded without retraining.
@@ -665,16 +916,15 @@ void PolicyNet::load(const std::string &filename)
     return;
   }
 
-  // Load the weights and biases of each layer from the save file.
-  f.read((char *)net->layer1.weights,
-         sizeof(double) * net->layer1.inputSize * net->layer1.outputSize);
-  f.read((char *)net->layer1.bias, sizeof(double) * net->layer1.outputSize);
-  f.read((char *)net->layer2.weights,
-         sizeof(double) * net->layer2.inputSize * net->layer2.outputSize);
-  f.read((char *)net->layer2.bias, sizeof(double) * net->layer2.outputSize);
-  f.read((char *)net->layer3.weights,
-         sizeof(double) * net->layer3.inputSize * net->layer3.outputSize);
-  f.read((char *)net->layer3.bias, sizeof(double) * net->layer3.outputSize);
+  // Load the encoder state and the weights and biases of each layer from the
+  // save file.
+  if (encoder->needsFit()) {
+    encoder->load(f);
+    if (encoder->getInputSize() != net->getInputSize()) createNet();
+  }
+  net->layer1.load(f);
+  net->layer2.load(f);
+  net->layer3.load(f);
 
   // Load reward moving average so that the threshold still works if the model
   // is loaded without retraining.
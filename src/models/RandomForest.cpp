@@ -10,6 +10,7 @@
 #include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <limits>
 #include <map>
 #include <numeric>
 #include <sstream>
@@ -56,6 +57,8 @@ RandomForest::RandomForest(int num_policies, std::string path)
 RandomForest::RandomForest(int num_policies,
                            unsigned num_trees,
                            unsigned max_depth,
+                           unsigned num_threads,
+                           unsigned seed,
                            std::unique_ptr<PolicyModel> &explorer)
     : PolicyModel(num_policies, "RandomForest"),
       trainable(true),
@@ -79,7 +82,8 @@ RandomForest::RandomForest(int num_policies,
   rfc->setPriors(Mat());
 
 #else
-  rfc = std::make_unique<RandomForestImpl>(num_policies, num_trees, max_depth);
+  rfc = std::make_unique<RandomForestImpl>(
+      num_policies, num_trees, max_depth, num_threads, seed);
 #endif
 
   return;
@@ -123,6 +127,23 @@ int RandomForest::getIndex(std::vector<float> &features)
   return explorer->getIndex(features);
 }
 
+void RandomForest::getIndices(const float *features,
+                              int num_features,
+                              size_t n,
+                              int *policies)
+{
+  if (trainable) {
+    explorer->getIndices(features, num_features, n, policies);
+    return;
+  }
+
+#ifdef ENABLE_OPENCV
+  PolicyModel::getIndices(features, num_features, n, policies);
+#else
+  rfc->predict(features, num_features, n, policies);
+#endif
+}
+
 void RandomForest::load(const std::string &filename)
 {
   trainable = false;
@@ -130,4 +151,28 @@ void RandomForest::load(const std::string &filename)
 }
 void RandomForest::store(const std::string &filename) { rfc->save(filename); }
 
+bool RandomForest::serialize(std::ostream &os)
+{
+#ifdef ENABLE_OPENCV
+  return false;
+#else
+  // Thresholds must round-trip exactly for ranks to predict alike. Ranks
+  // only predict, the training data stays local.
+  os.precision(std::numeric_limits<float>::max_digits10);
+  rfc->save(os, /*include_data=*/false);
+  return bool(os);
+#endif
+}
+
+bool RandomForest::deserialize(std::istream &is)
+{
+#ifdef ENABLE_OPENCV
+  return false;
+#else
+  rfc = std::make_unique<RandomForestImpl>(policy_count, is);
+  trainable = false;
+  return true;
+#endif
+}
+
 }  // end namespace apollo.
\ No newline at end of file
@@ -15,8 +15,15 @@ namespace apollo
 
 int RoundRobin::getIndex(std::vector<float> &features)
 {
-  int choice = (last_policy + 1) % policy_count;
-  last_policy = choice;
+  // The compare-and-swap keeps exploration cycling through the policies under
+  // concurrent calls, the policy stays in [0, policy_count) so it never wraps.
+  int last = last_policy.load(std::memory_order_relaxed);
+  int choice;
+  do {
+    choice = (last + 1) % policy_count;
+  } while (!last_policy.compare_exchange_weak(last,
+                                              choice,
+                                              std::memory_order_relaxed));
   return choice;
 
 #if 0
@@ -6,28 +6,36 @@
 #include "DecisionTreeImpl.h"
 
 #include <dlfcn.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <cstdio>
+#include <iomanip>
 #include <iostream>
+#include <numeric>
 #include <set>
 #include <sstream>
 #include <string>
 #include <tuple>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include "apollo/Config.h"
 #include "helpers/Parser.h"
+#include "helpers/WorkQueue.h"
 
-int DecisionTreeImpl::unique_counter = 0;
+std::atomic<int> DecisionTreeImpl::unique_counter(0);
 
 DecisionTreeImpl::DecisionTreeImpl(int num_classes, std::istream &is)
     : num_classes(num_classes)
 {
-  ++unique_counter;
-  unique_id = unique_counter;
+  unique_id = ++unique_counter;
   parse_tree(is);
 #ifdef ENABLE_JIT_DTREE
   compile_and_link_jit_evaluate_function();
@@ -37,8 +45,7 @@ DecisionTreeImpl::DecisionTreeImpl(int num_classes, std::istream &is)
 DecisionTreeImpl::DecisionTreeImpl(int num_classes, std::string filename)
     : num_classes(num_classes)
 {
-  ++unique_counter;
-  unique_id = unique_counter;
+  unique_id = ++unique_counter;
   load(filename);
 #ifdef ENABLE_JIT_DTREE
   compile_and_link_jit_evaluate_function();
@@ -48,8 +55,7 @@ DecisionTreeImpl::DecisionTreeImpl(int num_classes, std::string filename)
 DecisionTreeImpl::DecisionTreeImpl(int num_classes, unsigned max_depth)
     : num_classes(num_classes), max_depth(max_depth)
 {
-  ++unique_counter;
-  unique_id = unique_counter;
+  unique_id = ++unique_counter;
 }
 void DecisionTreeImpl::train(std::vector<std::vector<float>> &features,
                              std::vector<int> &responses)
@@ -57,14 +63,16 @@ void DecisionTreeImpl::train(std::vector<std::vector<float>> &features,
   // Assumes all feature vectors are of equal size.
   num_features = features.begin()->size();
   classes.insert(responses.begin(), responses.end());
-  data.clear();
-  for (size_t i = 0, end = features.size(); i < end; ++i)
-    data.emplace_back(std::move(features[i]), responses[i]);
+  // Release the nodes of a previously trained tree.
+  for (Node *node : tree_nodes)
+    delete node;
+  tree_nodes.clear();
 
-  root = build_tree(data.begin(),
-                    data.end(),
-                    /* max_depth */ max_depth,
-                    /* depth */ 0);
+  Samples samples(features, responses);
+  std::vector<unsigned> rows(samples.num_rows);
+  std::iota(rows.begin(), rows.end(), 0);
+  build_tree(samples, rows);
+  flatten_tree();
 
 #ifdef ENABLE_JIT_DTREE
   compile_and_link_jit_evaluate_function();
@@ -77,90 +85,260 @@ DecisionTreeImpl::DecisionTreeImpl(int num_classes,
                                    unsigned max_depth)
     : num_classes(num_classes), max_depth(max_depth)
 {
-  ++unique_counter;
-  unique_id = unique_counter;
+  unique_id = ++unique_counter;
   // Assumes all feature vectors are equal.
   num_features = features.begin()->size();
   classes.insert(responses.begin(), responses.end());
-  for (size_t i = 0, end = features.size(); i < end; ++i)
-    data.emplace_back(std::move(features[i]), responses[i]);
 
-  root = build_tree(data.begin(),
-                    data.end(),
-                    /* max_depth */ max_depth,
-                    /* depth */ 0);
+  Samples samples(features, responses);
+  std::vector<unsigned> rows(samples.num_rows);
+  std::iota(rows.begin(), rows.end(), 0);
+  build_tree(samples, rows);
+  flatten_tree();
+
+#ifdef ENABLE_JIT_DTREE
+  compile_and_link_jit_evaluate_function();
+#endif
+}
+
+DecisionTreeImpl::DecisionTreeImpl(int num_classes,
+                                   const Samples &samples,
+                                   const std::vector<unsigned> &rows,
+                                   unsigned max_depth)
+    : num_classes(num_classes), max_depth(max_depth)
+{
+  unique_id = ++unique_counter;
+  num_features = samples.num_features;
+  for (unsigned row : rows)
+    classes.insert(samples.responses[row]);
+
+  build_tree(samples, rows);
+  flatten_tree();
 
 #ifdef ENABLE_JIT_DTREE
   compile_and_link_jit_evaluate_function();
 #endif
 }
 
+DecisionTreeImpl::Samples::Samples(
+    const std::vector<std::vector<float>> &features,
+    const std::vector<int> &responses)
+    : num_rows(features.size()),
+      num_features(features.begin()->size()),
+      responses(responses)
+{
+  // Assumes all feature vectors are of equal size.
+  this->features.reserve(num_rows * num_features);
+  for (auto &row : features)
+    this->features.insert(this->features.end(), row.begin(), row.end());
+}
+
 
-void DecisionTreeImpl::generate_source(Node &node, OutputFormatter &source_fmt)
+void DecisionTreeImpl::generate_source(int32_t node_idx,
+                                       OutputFormatter &source_fmt)
 {
-  if (!node.left && !node.right) {
-    source_fmt << "return " & node.predicted_class & ";\n";
+  const FlatNode &node = flat_tree[node_idx];
+  if (node.feature_idx < 0) {
+    source_fmt << "return " & node.child_or_class & ";\n";
     return;
   }
 
-  source_fmt << "if (features[" & node.feature_idx & "] < " & node.threshold &
-      ") {\n";
-  if (node.left) {
-    ++source_fmt;
-    generate_source(*node.left, source_fmt);
-    --source_fmt;
-    source_fmt << "}\n";
+  // Thresholds are output with enough digits to round-trip exactly.
+  std::stringstream threshold;
+  threshold << std::scientific << std::setprecision(8) << node.threshold;
+  source_fmt << "if (features[" & node.feature_idx & "] < " &
+      threshold.str() & "f) {\n";
+  ++source_fmt;
+  generate_source(node.child_or_class, source_fmt);
+  --source_fmt;
+  source_fmt << "} else {\n";
+  ++source_fmt;
+  generate_source(node.child_or_class + 1, source_fmt);
+  --source_fmt;
+  source_fmt << "}\n";
+}
+
+#ifdef ENABLE_JIT_DTREE
+extern char **environ;
+
+// FNV-1a hash of the generated source, identical trees share a compiled
+// shared library.
+static uint64_t hashSource(const std::string &source)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  for (unsigned char c : source) {
+    hash ^= c;
+    hash *= 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Returns the evaluation function of the shared library, compiling it first
+// if it is not in the cache directory. Returns nullptr on failure.
+static DecisionTreeImpl::JitEvaluateFunction compileAndLink(
+    const std::string &source,
+    const std::string &function_name,
+    const std::string &jit_dir,
+    unsigned unique_id)
+{
+  mkdir(jit_dir.c_str(), 0755);
+  std::string shared_library_name = jit_dir + "/" + function_name + ".so";
+
+  struct stat stbuf;
+  if (stat(shared_library_name.c_str(), &stbuf) != 0) {
+    // Compile to a unique temporary, the rename publishes the library
+    // atomically to other regions and processes sharing the cache. The shell
+    // publishes and removes the temporaries itself, so that a process exiting
+    // during the compilation leaves no partial files behind. Paths are passed
+    // as arguments of the script, never parsed by the shell.
+    std::string tmp_name = jit_dir + "/" + function_name + "-" +
+                           std::to_string(getpid()) + "-" +
+                           std::to_string(unique_id);
+    std::ofstream ofs(tmp_name + ".cpp");
+    ofs << source;
+    ofs.close();
+    const char *script =
+        "c++ -x c++ -O2 -shared -fPIC -o \"$1.so\" \"$1.cpp\" && "
+        "mv -f \"$1.so\" \"$2\"; ret=$?; rm -f \"$1.cpp\" \"$1.so\"; exit $ret";
+    std::vector<const char *> argv = {"sh",
+                                      "-c",
+                                      script,
+                                      "sh",
+                                      tmp_name.c_str(),
+                                      shared_library_name.c_str(),
+                                      nullptr};
+    pid_t pid;
+    int status = -1;
+    if (posix_spawnp(&pid,
+                     "sh",
+                     nullptr,
+                     nullptr,
+                     const_cast<char *const *>(argv.data()),
+                     environ) != 0 ||
+        waitpid(pid, &status, 0) != pid || !WIFEXITED(status) ||
+        WEXITSTATUS(status) != 0) {
+      std::cerr << "== APOLLO: DecisionTree JIT compilation failed, using "
+                   "the interpreted tree.\n";
+      return nullptr;
+    }
   }
-  if (node.right) {
-    source_fmt << "else {\n";
-    ++source_fmt;
-    generate_source(*node.right, source_fmt);
-    --source_fmt;
-    source_fmt << "}\n";
+
+  // Libraries stay loaded, their functions are shared by identical trees.
+  void *dynamic_linker = dlopen(shared_library_name.c_str(), RTLD_NOW);
+  if (!dynamic_linker) {
+    std::cerr << "dlopen: " << dlerror() << std::endl;
+    return nullptr;
   }
+  auto jit_function = (DecisionTreeImpl::JitEvaluateFunction)dlsym(
+      dynamic_linker, function_name.c_str());
+  if (!jit_function) std::cerr << "dlsym: " << dlerror() << std::endl;
+
+  return jit_function;
 }
+#endif
 
 void DecisionTreeImpl::compile_and_link_jit_evaluate_function()
 {
 #ifdef ENABLE_JIT_DTREE
-  std::string function_name =
-      std::string("_jit_eval_") + std::to_string(unique_id);
-  std::string shared_library_name =
-      std::string("/tmp/") + function_name + std::string(".so");
+  // Stop using the function of a previous tree and ignore its pending
+  // compilation.
+  unsigned generation;
+  {
+    std::lock_guard<std::mutex> lock(jit->mutex);
+    jit->function.store(nullptr, std::memory_order_relaxed);
+    generation = ++jit->generation;
+  }
+
   std::stringstream sstream;
   OutputFormatter source_fmt(sstream);
-  // source_fmt << "#include <cstdio>\n";
-  source_fmt << "#include <vector>\n";
-  source_fmt << "extern \"C\" {\n";
-  ++source_fmt;
-  source_fmt << "int " & function_name &
-      "(const std::vector<float> &features) {\n";
-  ++source_fmt;
-  generate_source(*root, source_fmt);
-  --source_fmt;
-  source_fmt << "}\n";
-  --source_fmt;
-  source_fmt << "}\n";
-  std::ofstream ofs(std::string("/tmp/" + function_name + std::string(".cpp")));
-  ofs << sstream.str() << std::endl;
-  ofs.close();
-  std::string command = std::string("c++ -x c++ -O0 -shared -fPIC -o ") +
-                        shared_library_name + std::string(" - << EOF\n") +
-                        sstream.str() + std::string("EOF\n");
-  system(command.c_str());
-  // pclose(popen(command.c_str(), "r"));
-  void *dynamic_linker = dlopen(shared_library_name.c_str(), RTLD_NOW);
-  if (!dynamic_linker) {
-    std::cerr << "dlopen: " << dlerror() << std::endl;
-    abort();
-  }
-  jit_evaluate_function =
-      (int (*)(const std::vector<float> &))dlsym(dynamic_linker,
-                                                 function_name.c_str());
-  if (!jit_evaluate_function) {
-    std::cerr << "dlsym: " << dlerror() << std::endl;
-    abort();
+  generate_source(0, source_fmt);
+  std::string body = sstream.str();
+
+  std::stringstream function_name;
+  function_name << "_jit_eval_" << std::hex << hashSource(body);
+
+  std::string source = "extern \"C\" int " + function_name.str() +
+                       "(const float *features) {\n" + body + "}\n";
+
+  // The output directory is unset if used without an Apollo instance. It is
+  // read here, compilations may outlive the configuration at exit.
+  std::string jit_dir = (Config::APOLLO_OUTPUT_DIR.empty()
+                             ? std::string(".")
+                             : Config::APOLLO_OUTPUT_DIR) +
+                        "/jit";
+
+  // Compiled functions and the trees waiting for a pending compilation, by
+  // function name. Failed compilations are dropped, so they are retried.
+  struct CacheEntry {
+    JitEvaluateFunction function = nullptr;
+    std::vector<std::pair<std::weak_ptr<JitInstall>, unsigned>> waiters;
+  };
+  static std::mutex cache_mutex;
+  static std::unordered_map<std::string, CacheEntry> cache;
+
+  // Installs f unless the tree was destroyed or retrained since.
+  auto install = [](const std::weak_ptr<JitInstall> &weak_target,
+                    unsigned generation,
+                    JitEvaluateFunction f) {
+    std::shared_ptr<JitInstall> target = weak_target.lock();
+    if (!target) return;
+    std::lock_guard<std::mutex> lock(target->mutex);
+    if (generation == target->generation)
+      target->function.store(f, std::memory_order_release);
+  };
+
+  std::string name = function_name.str();
+  {
+    std::lock_guard<std::mutex> lock(cache_mutex);
+    auto it = cache.find(name);
+    if (it != cache.end()) {
+      if (it->second.function)
+        install(jit, generation, it->second.function);
+      else
+        it->second.waiters.emplace_back(jit, generation);
+      return;
+    }
+    cache[name].waiters.emplace_back(jit, generation);
   }
+
+  // Compilations run one at a time on a queue that is never destroyed, so
+  // exiting does not wait for pending compilations. The flattened tree serves
+  // predictions until the function is installed.
+  static WorkQueue &compile_queue = *new WorkQueue();
+  compile_queue.submit([install, source, name, jit_dir, this_id = unique_id]() {
+    std::vector<std::pair<std::weak_ptr<JitInstall>, unsigned>> waiters;
+    // Skip compiling if every waiting tree was destroyed or retrained.
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      auto &entry_waiters = cache[name].waiters;
+      bool waited = false;
+      for (auto &waiter : entry_waiters) {
+        std::shared_ptr<JitInstall> target = waiter.first.lock();
+        if (target) {
+          std::lock_guard<std::mutex> target_lock(target->mutex);
+          waited |= (waiter.second == target->generation);
+        }
+      }
+      if (!waited) {
+        cache.erase(name);
+        return;
+      }
+    }
+
+    JitEvaluateFunction f = compileAndLink(source, name, jit_dir, this_id);
+    {
+      std::lock_guard<std::mutex> lock(cache_mutex);
+      CacheEntry &entry = cache[name];
+      waiters.swap(entry.waiters);
+      if (f)
+        entry.function = f;
+      else
+        cache.erase(name);
+    }
+    if (f)
+      for (auto &waiter : waiters)
+        install(waiter.first, waiter.second, f);
+  });
 #else
   throw std::runtime_error(
       "DTree JIT requires compilation with ENABLE_JIT_DTREE on");
@@ -169,12 +347,6 @@ void DecisionTreeImpl::compile_and_link_jit_evaluate_function()
 
 DecisionTreeImpl::~DecisionTreeImpl()
 {
-  std::string function_name =
-      std::string("_jit_eval_") + std::to_string(unique_id);
-  std::string shared_library_name =
-      std::string("/tmp/") + function_name + std::string(".so");
-  std::remove(shared_library_name.c_str());
-
   for (Node *node : tree_nodes)
     delete node;
 }
@@ -182,19 +354,110 @@ DecisionTreeImpl::~DecisionTreeImpl()
 void DecisionTreeImpl::save(const std::string &filename)
 {
   std::ofstream ofs(filename, std::ofstream::out);
-  OutputFormatter outfmt(ofs);
-  outfmt << "# DecisionTreeImpl\n";
-  output_tree(outfmt, "tree");
+  save(ofs);
   ofs.close();
 }
 
+void DecisionTreeImpl::save(std::ostream &os, bool include_data)
+{
+  OutputFormatter outfmt(os);
+  outfmt << "# DecisionTreeImpl\n";
+  output_tree(outfmt, "tree", include_data);
+}
+
 int DecisionTreeImpl::predict(const std::vector<float> &features)
+{
+  return predict(features.data());
+}
+
+int DecisionTreeImpl::predict(const float *features)
 {
 #ifdef ENABLE_JIT_DTREE
-  return jit_evaluate_function(features);
-#else
-  return evaluate_tree(*root, features);
+  JitEvaluateFunction jit_function =
+      jit->function.load(std::memory_order_acquire);
+  if (jit_function) return jit_function(features);
+#endif
+
+  // Select the child without branching, tree paths are data-dependent and
+  // poorly predicted.
+  const FlatNode *nodes = flat_tree.data();
+  int32_t idx = 0;
+  while (nodes[idx].feature_idx >= 0)
+    idx = nodes[idx].child_or_class +
+          !(features[nodes[idx].feature_idx] < nodes[idx].threshold);
+
+  return nodes[idx].child_or_class;
+}
+
+void DecisionTreeImpl::predict(const float *features,
+                               int num_features,
+                               size_t n,
+                               int *classes)
+{
+#ifdef ENABLE_JIT_DTREE
+  JitEvaluateFunction jit_function =
+      jit->function.load(std::memory_order_acquire);
+  if (jit_function) {
+    for (size_t i = 0; i < n; ++i)
+      classes[i] = jit_function(&features[i * num_features]);
+    return;
+  }
 #endif
+
+  // Rows of a block descend the tree together, one level per pass, so that
+  // their node loads overlap instead of serializing on each path.
+  constexpr size_t BLOCK_SIZE = 64;
+  const FlatNode *nodes = flat_tree.data();
+  int32_t idx[BLOCK_SIZE];
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    size_t count = std::min(BLOCK_SIZE, n - start);
+    const float *block = &features[start * num_features];
+    std::fill(idx, idx + count, 0);
+
+    bool descending = true;
+    while (descending) {
+      descending = false;
+      for (size_t i = 0; i < count; ++i) {
+        const FlatNode &node = nodes[idx[i]];
+        // Rows at leaves stay in place.
+        bool internal = node.feature_idx >= 0;
+        int32_t feature_idx = (internal ? node.feature_idx : 0);
+        int32_t child =
+            node.child_or_class +
+            !(block[i * num_features + feature_idx] < node.threshold);
+        idx[i] = (internal ? child : idx[i]);
+        descending |= internal;
+      }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+      classes[start + i] = nodes[idx[i]].child_or_class;
+  }
+}
+
+void DecisionTreeImpl::flatten_tree()
+{
+  flat_tree.clear();
+  flat_tree.reserve(2 * tree_nodes.size() + 1);
+
+  // Breadth-first traversal, queue entries are (node, class of the parent),
+  // the queue index of an entry is its index in the flattened tree.
+  std::vector<std::pair<const Node *, int>> queue;
+  queue.reserve(2 * tree_nodes.size() + 1);
+  queue.emplace_back(root, root->predicted_class);
+  for (size_t i = 0; i < queue.size(); ++i) {
+    const Node *node = queue[i].first;
+    if (!node || node->feature_idx == -1) {
+      int predicted_class = (node ? node->predicted_class : queue[i].second);
+      flat_tree.push_back({-1, 0.0f, predicted_class});
+      continue;
+    }
+
+    flat_tree.push_back(
+        {node->feature_idx, node->threshold, (int32_t)queue.size()});
+    queue.emplace_back(node->left, node->predicted_class);
+    queue.emplace_back(node->right, node->predicted_class);
+  }
 }
 
 void DecisionTreeImpl::print_tree()
@@ -203,6 +466,21 @@ void DecisionTreeImpl::print_tree()
   output_tree(outfmt, "tree", /*include_data=*/false);
 }
 
+void DecisionTreeImpl::output_flat_tree(OutputFormatter &outfmt)
+{
+  outfmt << "{\n";
+  ++outfmt;
+  for (auto &node : flat_tree) {
+    // Thresholds are output with enough digits to round-trip exactly.
+    std::stringstream threshold;
+    threshold << std::scientific << std::setprecision(8) << node.threshold;
+    outfmt << "{ " & node.feature_idx & ", " & threshold.str() & "f, " &
+        node.child_or_class & " },\n";
+  }
+  --outfmt;
+  outfmt << "}";
+}
+
 DecisionTreeImpl::Node::Node(DecisionTreeImpl &DT,
                              float gini,
                              size_t num_samples,
@@ -238,10 +516,10 @@ DecisionTreeImpl::Node::Node(DecisionTreeImpl &DT,
       right(nullptr)
 {
   // Find predicted class as the maximum element in the
-  // count_per_class.
-  int idx = std::distance(count_per_class.begin(),
-                          std::max_element(count_per_class.begin(),
-                                           count_per_class.end()));
+  // count_per_class, the argument has been moved to the member.
+  int idx = std::distance(this->count_per_class.begin(),
+                          std::max_element(this->count_per_class.begin(),
+                                           this->count_per_class.end()));
   predicted_class = *std::next(DT.classes.begin(), idx);
 }
 
@@ -253,99 +531,69 @@ void DecisionTreeImpl::load(const std::string &filename)
   ifs.close();
 }
 
-template <typename Iterator>
-void DecisionTreeImpl::compute_gini(const Iterator &Begin,
-                                    const Iterator &End,
-                                    float &gini_score)
+float DecisionTreeImpl::compute_gini(const std::vector<size_t> &count_per_class,
+                                     size_t num_samples)
 {
   float g = 0.0f;
-  size_t n_total = std::distance(Begin, End);
-
-  for (auto it = classes.begin(), end = classes.end(); it != end; ++it) {
-    int cls = *it;
-    int count = 0;
-    for (auto It = Begin; It != End; ++It) {
-      int data_cls = It->second;
-      if (data_cls == cls) count++;
-    }
-
-    float p = (float)count / n_total;
+  for (size_t count : count_per_class) {
+    float p = (float)count / num_samples;
     g += (p * p);
   }
 
-  gini_score = 1.0f - g;
+  return 1.0f - g;
 }
 
-template <typename Iterator>
-std::vector<size_t> DecisionTreeImpl::get_count_per_class(const Iterator &Begin,
-                                                          const Iterator &End)
+std::vector<size_t> DecisionTreeImpl::get_count_per_class(
+    const TrainingData &td,
+    size_t begin,
+    size_t end)
 {
-  std::vector<size_t> count_per_class;
-
-  for (auto it = classes.begin(), end = classes.end(); it != end; ++it) {
-    int cls = *it;
-    int count = 0;
-    for (auto It = Begin; It != End; ++It) {
-      int data_cls = It->second;
-      if (data_cls == cls) count++;
-    }
-
-    count_per_class.push_back(count);
-  }
-
+  std::vector<size_t> count_per_class(classes.size(), 0);
+  const unsigned *rows = td.sorted_rows[0].data();
+  for (size_t i = begin; i < end; ++i)
+    count_per_class[td.class_indices[rows[i]]]++;
 
   return count_per_class;
 }
 
-int DecisionTreeImpl::evaluate_tree(const Node &tree,
-                                    const std::vector<float> &features)
+// Returns tuple(min gini, position of split, feature index of split,
+// threshold)
+std::tuple<float, size_t, size_t, float> DecisionTreeImpl::split(
+    TrainingData &td,
+    const std::vector<size_t> &count_per_class,
+    size_t begin,
+    size_t end)
 {
-  // leaf node, return predicted class.
-  if (tree.feature_idx == -1) return tree.predicted_class;
-
-  if (features[tree.feature_idx] < tree.threshold) {
-    if (tree.left) return evaluate_tree(*tree.left, features);
-  } else if (tree.right)
-    return evaluate_tree(*tree.right, features);
-  return tree.predicted_class;
-}
-
-// Returns tuple(min gini, iterator to split, feature index of split)
-template <typename Iterator>
-std::tuple<float, Iterator, size_t, float> DecisionTreeImpl::split(
-    const Iterator &Begin,
-    const Iterator &End)
-{
-  size_t size = std::distance(Begin, End);
+  size_t size = end - begin;
   assert(size > 1);
 
   float min_gini = 1.0f;
-  Iterator split_it = End;
+  size_t split_pos = end;
   int split_feature_idx = 0;
   float split_threshold = 0.0f;
 
-  size_t num_features = Begin->first.size();
+  std::vector<size_t> &left_counts = td.left_counts;
+  std::vector<size_t> &right_counts = td.right_counts;
   for (int feature_idx = 0; feature_idx < num_features; ++feature_idx) {
-    // Sort based on this specific feature index (sorting does not
-    // invalidate iterators).
-    std::sort(Begin,
-              End,
-              [&feature_idx](const std::pair<std::vector<float>, int> &x,
-                             const std::pair<std::vector<float>, int> &y) {
-                return x.first[feature_idx] < y.first[feature_idx];
-              });
-    for (Iterator It = std::next(Begin); It != End; ++It) {
-      float feature_val_left = std::prev(It)->first[feature_idx];
-      float feature_val_right = It->first[feature_idx];
+    // Sweep rows in order of this feature value, moving one row at a time
+    // from the right to the left side.
+    const unsigned *rows = td.sorted_rows[feature_idx].data();
+    std::fill(left_counts.begin(), left_counts.end(), 0);
+    right_counts = count_per_class;
+    for (size_t i = begin + 1; i < end; ++i) {
+      unsigned prev_row = rows[i - 1];
+      left_counts[td.class_indices[prev_row]]++;
+      right_counts[td.class_indices[prev_row]]--;
+
+      float feature_val_left = td.value(prev_row, feature_idx);
+      float feature_val_right = td.value(rows[i], feature_idx);
       // Feature values are the same, continue.
       if (feature_val_left == feature_val_right) continue;
 
+      size_t idx = i - begin;
+      float left_gini_score = compute_gini(left_counts, idx);
+      float right_gini_score = compute_gini(right_counts, size - idx);
 
-      float left_gini_score, right_gini_score;
-      compute_gini(Begin, It, left_gini_score);
-      compute_gini(It, End, right_gini_score);
-
-      size_t idx = std::distance(Begin, It);
       // weighted gini
       float g =
           (idx * left_gini_score + (size - idx) * right_gini_score) / size;
@@ -353,62 +601,141 @@ std::tuple<float, Iterator, size_t, float> DecisionTreeImpl::split(
       // This split does not reduce gini, continue
       if (g >= min_gini) continue;
       min_gini = g;
-      split_it = It;
+      split_pos = i;
       split_feature_idx = feature_idx;
       split_threshold = (feature_val_left + feature_val_right) / 2.0;
     }
   }
 
-  // Sort to selected feature idx to validate the returned split iterator.
-  std::sort(Begin,
-            End,
-            [&split_feature_idx](const std::pair<std::vector<float>, int> &x,
-                                 const std::pair<std::vector<float>, int> &y) {
-              return x.first[split_feature_idx] < y.first[split_feature_idx];
-            });
   return std::make_tuple(min_gini,
-                         split_it,
+                         split_pos,
                          split_feature_idx,
                          split_threshold);
 }
 
-template <typename Iterator>
-DecisionTreeImpl::Node *DecisionTreeImpl::build_tree(const Iterator &Begin,
-                                                     const Iterator &End,
+void DecisionTreeImpl::build_tree(const Samples &samples,
+                                  const std::vector<unsigned> &rows)
+{
+  TrainingData td;
+  td.samples = &samples;
+  td.rows = &rows;
+  td.class_indices.resize(samples.num_rows);
+  for (unsigned row : rows)
+    td.class_indices[row] = std::distance(
+        classes.begin(), classes.find(samples.responses[row]));
+
+  // Sort once, splits preserve the order of each feature.
+  td.sorted_rows.resize(num_features);
+  for (unsigned feature_idx = 0; feature_idx < num_features; ++feature_idx) {
+    auto &sorted_rows = td.sorted_rows[feature_idx];
+    sorted_rows = rows;
+    std::stable_sort(sorted_rows.begin(),
+                     sorted_rows.end(),
+                     [&td, feature_idx](unsigned x, unsigned y) {
+                       return td.value(x, feature_idx) <
+                              td.value(y, feature_idx);
+                     });
+  }
+
+  td.buffer.resize(rows.size());
+  td.goes_left.resize(samples.num_rows);
+  td.left_counts.resize(classes.size());
+  td.right_counts.resize(classes.size());
+
+  data_features.clear();
+  data_features.reserve(rows.size() * num_features);
+  data_classes.clear();
+  data_classes.reserve(rows.size());
+  root = build_tree(td,
+                    0,
+                    rows.size(),
+                    /* max_depth */ max_depth,
+                    /* depth */ 0,
+                    /* parent_feature_idx */ -1);
+}
+
+DecisionTreeImpl::Node *DecisionTreeImpl::build_tree(TrainingData &td,
+                                                     size_t begin,
+                                                     size_t end,
                                                      const size_t max_depth,
-                                                     size_t depth)
-{
-  // std::string s = std::string("build_tree@") + std::to_string(depth);
-  // TimeTrace t(s);
-  float gini_score;
-  compute_gini(Begin, End, gini_score);
-  std::vector<size_t> count_per_class = get_count_per_class(Begin, End);
-  size_t size = std::distance(Begin, End);
+                                                     size_t depth,
+                                                     int parent_feature_idx)
+{
+  std::vector<size_t> count_per_class = get_count_per_class(td, begin, end);
+  size_t size = end - begin;
+  float gini_score = compute_gini(count_per_class, size);
   Node *node = new Node(*this, count_per_class, gini_score, size);
   tree_nodes.push_back(node);
 
-  // Return if max_depth reached.
-  if (depth >= max_depth) return node;
-
-  // Return if there is only one sample.
-  if (Begin == End) return node;
+  // Return if max_depth reached, there are no samples, or the gini is 0
+  // (samples of the same class).
+  if (depth >= max_depth || begin == end || gini_score <= 0.0f) {
+    // Output data of leaves ordered by the split feature of the parent, then
+    // by the features in descending index, which is the order successive
+    // sorts by feature leave rows in.
+    std::vector<unsigned> rows;
+    if (parent_feature_idx >= 0) {
+      rows.assign(td.sorted_rows[parent_feature_idx].begin() + begin,
+                  td.sorted_rows[parent_feature_idx].begin() + end);
+      std::stable_sort(
+          rows.begin(),
+          rows.end(),
+          [this, &td, parent_feature_idx](unsigned x, unsigned y) {
+            if (td.value(x, parent_feature_idx) !=
+                td.value(y, parent_feature_idx))
+              return td.value(x, parent_feature_idx) <
+                     td.value(y, parent_feature_idx);
+            for (int feature_idx = num_features - 1; feature_idx >= 0;
+                 --feature_idx)
+              if (td.value(x, feature_idx) != td.value(y, feature_idx))
+                return td.value(x, feature_idx) < td.value(y, feature_idx);
+            return false;
+          });
+    } else {
+      rows = *td.rows;
+    }
 
-  // Return if the gini is 0 (samples of the same class).
-  if (gini_score <= 0.0f) return node;
+    for (unsigned row : rows) {
+      const float *row_features = &td.samples->features[row * num_features];
+      data_features.insert(
+          data_features.end(), row_features, row_features + num_features);
+      data_classes.push_back(td.samples->responses[row]);
+    }
+    return node;
+  }
 
   // Split to minimize Gini impurity.
   float min_gini;
-  Iterator split_it;
-  int split_feature_idx;
+  size_t split_pos;
+  size_t split_feature_idx;
   float threshold;
-  std::tie(min_gini, split_it, split_feature_idx, threshold) =
-      split(Begin, End);
-  assert(split_it != End);
+  std::tie(min_gini, split_pos, split_feature_idx, threshold) =
+      split(td, node->count_per_class, begin, end);
+  assert(split_pos != end);
+
+  // Stably partition the rows of every feature between the children.
+  const unsigned *split_rows = td.sorted_rows[split_feature_idx].data();
+  for (size_t i = begin; i < end; ++i)
+    td.goes_left[split_rows[i]] = (i < split_pos);
+  for (unsigned feature_idx = 0; feature_idx < num_features; ++feature_idx) {
+    if (feature_idx == split_feature_idx) continue;
+    unsigned *rows = td.sorted_rows[feature_idx].data();
+    size_t left = begin, right = 0;
+    for (size_t i = begin; i < end; ++i) {
+      if (td.goes_left[rows[i]])
+        rows[left++] = rows[i];
+      else
+        td.buffer[right++] = rows[i];
+    }
+    std::copy(td.buffer.begin(), td.buffer.begin() + right, rows + left);
+  }
 
   node->feature_idx = split_feature_idx;
   node->threshold = threshold;
-  node->left = build_tree(Begin, split_it, max_depth, depth + 1);
-  node->right = build_tree(split_it, End, max_depth, depth + 1);
+  node->left = build_tree(
+      td, begin, split_pos, max_depth, depth + 1, split_feature_idx);
+  node->right =
+      build_tree(td, split_pos, end, max_depth, depth + 1, split_feature_idx);
 
   return node;
 }
@@ -429,20 +756,18 @@ void DecisionTreeImpl::output_tree(OutputFormatter &outfmt,
   if (include_data) {
     outfmt << "data: {\n";
     ++outfmt;
-    unsigned idx = 0;
-    for (auto it : data) {
+    for (unsigned idx = 0; idx < data_classes.size(); ++idx) {
       outfmt << idx & ": { ";
       outfmt & "features: [ ";
-      for (auto features_it : it.first)
-        outfmt &features_it & ", ";
+      for (unsigned i = 0; i < num_features; ++i)
+        outfmt &data_features[idx * num_features + i] & ", ";
       outfmt & "], ";
-      outfmt & "class: " & it.second;
+      outfmt & "class: " & data_classes[idx];
       outfmt & " },\n";
-      ++idx;
     }
     --outfmt;
+    outfmt << "},\n";
   }
-  outfmt << "},\n";
   --outfmt;
   outfmt << "}\n";
 }
@@ -494,7 +819,6 @@ std::vector<size_t> DecisionTreeImpl::parse_count_per_class(Parser &parser)
 
 void DecisionTreeImpl::parse_data(Parser &parser)
 {
-  parser.getNextToken();
   parser.parseExpected("data:");
   parser.getNextToken();
   parser.parseExpected("{");
@@ -509,14 +833,12 @@ void DecisionTreeImpl::parse_data(Parser &parser)
     parser.getNextToken();
     parser.parseExpected("[");
 
-    std::vector<float> features;
-    features.reserve(num_features);
     int response;
     while (!parser.getNextTokenEquals("],")) {
       float feature;
       parser.parse(feature);
       parser.parseExpected(",");
-      features.push_back(feature);
+      data_features.push_back(feature);
     }
 
     parser.getNextToken();
@@ -525,7 +847,7 @@ void DecisionTreeImpl::parse_data(Parser &parser)
     parser.getNextToken();
     parser.parse(response);
 
-    data.emplace_back(std::move(features), response);
+    data_classes.push_back(response);
 
     parser.getNextToken();
     parser.parseExpected("},");
@@ -623,8 +945,14 @@ void DecisionTreeImpl::parse_tree(std::istream &is)
   parser.getNextToken();
   parser.parseExpected("root:");
   root = parse_node(parser);
-  parse_data(parser);
 
+  // Trees saved without their training data end after the root.
   parser.getNextToken();
+  if (parser.getTokenEquals("data:")) {
+    parse_data(parser);
+    parser.getNextToken();
+  }
   parser.parseExpected("}");
+
+  flatten_tree();
 }
@@ -7,10 +7,14 @@
 #define APOLLO_MODELS_DECISIONTREEIMPL_H
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <cstdint>
 #include <fstream>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <set>
 #include <string>
 #include <tuple>
@@ -23,6 +27,16 @@
 class DecisionTreeImpl
 {
 public:
+  // Row-major training samples, shared by the trees of a random forest.
+  struct Samples {
+    Samples(const std::vector<std::vector<float>> &features,
+            const std::vector<int> &responses);
+    size_t num_rows;
+    unsigned num_features;
+    std::vector<float> features;
+    std::vector<int> responses;
+  };
+
   DecisionTreeImpl(int num_classes, std::istream &is);
   DecisionTreeImpl(int num_classes, std::string filename);
   DecisionTreeImpl(int num_classes, unsigned max_depth);
@@ -30,17 +44,37 @@ public:
                    std::vector<std::vector<float>> &features,
                    std::vector<int> &responses,
                    unsigned max_depth);
+  // Trains on the given rows of samples, rows may repeat.
+  DecisionTreeImpl(int num_classes,
+                   const Samples &samples,
+                   const std::vector<unsigned> &rows,
+                   unsigned max_depth);
   ~DecisionTreeImpl();
 
+  typedef int (*JitEvaluateFunction)(const float *features);
+
   void train(std::vector<std::vector<float>> &features,
              std::vector<int> &responses);
   void load(const std::string &filename);
   void save(const std::string &filename);
+  // Outputs the training data of the tree unless include_data is false, the
+  // tree parses either.
+  void save(std::ostream &os, bool include_data = true);
   int predict(const std::vector<float> &features);
+  int predict(const float *features);
+  // Predicts n rows of num_features, stored row-major.
+  void predict(const float *features,
+               int num_features,
+               size_t n,
+               int *classes);
   void output_tree(OutputFormatter &outfmt,
                    std::string key,
                    bool include_data = true);
   void print_tree();
+  // Outputs the flattened tree as a brace-enclosed list of
+  // { feature_idx, threshold, child_or_class } initializers.
+  void output_flat_tree(OutputFormatter &outfmt);
+  unsigned get_num_features() const { return num_features; }
 
 private:
   struct Node {
@@ -71,32 +105,79 @@ private:
          size_t num_samples);
   };
 
-  // Returns pair(counts per class, gini value)
-  template <typename Iterator>
-  void compute_gini(const Iterator &Begin,
-                    const Iterator &End,
-                    float &gini_score);
-
-  template <typename Iterator>
-  std::vector<size_t> get_count_per_class(const Iterator &Begin,
-                                          const Iterator &End);
+  // Training state of a tree over the rows of shared samples. Every feature
+  // has the rows presorted by its value, the rows of a node are the same range
+  // [begin, end) of each sorted array, which is stably partitioned between the
+  // children on a split.
+  struct TrainingData {
+    const Samples *samples;
+    const std::vector<unsigned> *rows;
+    // Class index (in the order of classes) of each sample row.
+    std::vector<unsigned> class_indices;
+    std::vector<std::vector<unsigned>> sorted_rows;
+    // Scratch space for partitioning rows and sweeping class counts.
+    std::vector<unsigned> buffer;
+    std::vector<char> goes_left;
+    std::vector<size_t> left_counts;
+    std::vector<size_t> right_counts;
+
+    float value(unsigned row, int feature_idx) const
+    {
+      return samples->features[row * samples->num_features + feature_idx];
+    }
+  };
 
-  int evaluate_tree(const Node &tree, const std::vector<float> &features);
-  void compile_and_link_jit_evaluate_function();
-  void generate_source(Node &node, OutputFormatter &source_code);
-  int (*jit_evaluate_function)(const std::vector<float> &features);
+  float compute_gini(const std::vector<size_t> &count_per_class,
+                     size_t num_samples);
 
-  // Returns tuple(min gini, iterator to split, feature index of split)
-  template <typename Iterator>
-  std::tuple<float, Iterator, size_t, float> split(const Iterator &Begin,
-                                                   const Iterator &End);
+  std::vector<size_t> get_count_per_class(const TrainingData &td,
+                                          size_t begin,
+                                          size_t end);
 
+  // Flattened tree for inference, nodes are stored in breadth-first order and
+  // the children of an internal node are adjacent (right = left + 1).
+  // Children missing from the tree are stored as leaves predicting the class
+  // of their parent.
+  struct FlatNode {
+    // Split feature index, -1 for leaves.
+    int32_t feature_idx;
+    float threshold;
+    // Index of the left child for internal nodes, predicted class for leaves.
+    int32_t child_or_class;
+  };
+  std::vector<FlatNode> flat_tree;
+  void flatten_tree();
 
-  template <typename Iterator>
-  Node *build_tree(const Iterator &Begin,
-                   const Iterator &End,
+  // Compiles the flattened tree asynchronously (ENABLE_JIT_DTREE), shared
+  // libraries are cached by a hash of their source under APOLLO_OUTPUT_DIR.
+  void compile_and_link_jit_evaluate_function();
+  void generate_source(int32_t node_idx, OutputFormatter &source_fmt);
+  // Install target of the compiled function, shared with the pending
+  // compilation so that neither retraining nor destruction waits for it.
+  struct JitInstall {
+    // Installed when its compilation completes, predictions use the
+    // flattened tree until then.
+    std::atomic<JitEvaluateFunction> function{nullptr};
+    // Guards installing the function of the current tree generation.
+    std::mutex mutex;
+    unsigned generation = 0;
+  };
+  std::shared_ptr<JitInstall> jit = std::make_shared<JitInstall>();
+
+  // Returns tuple(min gini, position of split, feature index of split,
+  // threshold), the position is end if there is no split.
+  std::tuple<float, size_t, size_t, float> split(TrainingData &td,
+                                                 const std::vector<size_t> &counts,
+                                                 size_t begin,
+                                                 size_t end);
+
+  void build_tree(const Samples &samples, const std::vector<unsigned> &rows);
+  Node *build_tree(TrainingData &td,
+                   size_t begin,
+                   size_t end,
                    const size_t max_depth,
-                   size_t depth);
+                   size_t depth,
+                   int parent_feature_idx);
 
   void output_node(OutputFormatter &outfmt, Node &tree, std::string key);
   std::vector<size_t> parse_count_per_class(Parser &parser);
@@ -105,14 +186,17 @@ private:
   Node *parse_node(Parser &parser);
   void parse_data(Parser &parser);
 
-  std::vector<std::pair<std::vector<float>, int>> data;
+  // Training data in output order, row-major features and the class of each
+  // row.
+  std::vector<float> data_features;
+  std::vector<int> data_classes;
   std::set<int> classes;
   Node *root;
   unsigned num_features;
   unsigned max_depth;
   unsigned num_classes;
   unsigned unique_id;
-  static int unique_counter;
+  static std::atomic<int> unique_counter;
   std::vector<Node *> tree_nodes;
 };
 
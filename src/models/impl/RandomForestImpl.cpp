@@ -5,77 +5,119 @@
 
 #include "RandomForestImpl.h"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <chrono>
+#include <exception>
 #include <iostream>
+#include <mutex>
 #include <random>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include "DecisionTreeImpl.h"
 
 RandomForestImpl::RandomForestImpl(int num_classes, std::string filename)
-    : num_classes(num_classes)
+    : num_classes(num_classes),
+      num_threads(1),
+      seed(std::mt19937::default_seed)
 {
   load(filename);
 }
 
+RandomForestImpl::RandomForestImpl(int num_classes, std::istream &is)
+    : num_classes(num_classes),
+      num_threads(1),
+      seed(std::mt19937::default_seed)
+{
+  parse_rfc(is);
+}
+
 RandomForestImpl::RandomForestImpl(int num_classes,
                                    unsigned num_trees,
-                                   unsigned max_depth)
-    : num_classes(num_classes), num_trees(num_trees), max_depth(max_depth)
+                                   unsigned max_depth,
+                                   unsigned num_threads,
+                                   unsigned seed)
+    : num_classes(num_classes),
+      num_trees(num_trees),
+      max_depth(max_depth),
+      num_threads(num_threads),
+      seed(seed)
 {
 }
 
 void RandomForestImpl::train(std::vector<std::vector<float>> &features,
                              std::vector<int> &responses)
 {
-  // Uniform random generator using Mersenne-Twister for randomness.
-  std::mt19937 generator;
-  std::uniform_int_distribution<size_t> uniform_dist(0, features.size() - 1);
-
-  for (unsigned i = 0; i < num_trees; i++) {
-    std::vector<std::vector<float>> sample_features;
-    std::vector<int> sample_responses;
-    // Random pick with replacement of features, responses
-    for (size_t i = 0, end = features.size(); i < end; ++i) {
-      int sample_idx = uniform_dist(generator);
-      sample_features.push_back(features[sample_idx]);
-      sample_responses.push_back(responses[sample_idx]);
+  // Trees sample rows of the shared training matrix.
+  DecisionTreeImpl::Samples samples(features, responses);
+
+  rfc.clear();
+  rfc.resize(num_trees);
+
+  std::atomic<unsigned> next_tree(0);
+  std::exception_ptr error;
+  std::mutex error_mutex;
+  auto train_trees = [&]() {
+    try {
+      for (unsigned tree_idx = next_tree++; tree_idx < num_trees;
+           tree_idx = next_tree++) {
+        // Uniform random generator using Mersenne-Twister for randomness,
+        // seeded per tree for reproducibility with any number of threads.
+        std::seed_seq seed_sequence{seed, tree_idx};
+        std::mt19937 generator(seed_sequence);
+        std::uniform_int_distribution<unsigned> uniform_dist(
+            0, samples.num_rows - 1);
+
+        // Random pick with replacement of features, responses
+        std::vector<unsigned> rows(samples.num_rows);
+        for (auto &row : rows)
+          row = uniform_dist(generator);
+
+        rfc[tree_idx] = std::make_unique<DecisionTreeImpl>(num_classes,
+                                                           samples,
+                                                           rows,
+                                                           max_depth);
+      }
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(error_mutex);
+      if (!error) error = std::current_exception();
     }
+  };
 
-    rfc.push_back(std::make_unique<DecisionTreeImpl>(
-        num_classes, sample_features, sample_responses, max_depth));
-  }
+  unsigned threads = num_threads;
+  if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+  threads = std::min(threads, num_trees);
+
+  std::vector<std::thread> workers;
+  for (unsigned i = 1; i < threads; ++i)
+    workers.emplace_back(train_trees);
+  train_trees();
+  for (auto &worker : workers)
+    worker.join();
+
+  if (error) std::rethrow_exception(error);
 }
 
 RandomForestImpl::RandomForestImpl(int num_classes,
                                    std::vector<std::vector<float>> &features,
                                    std::vector<int> &responses,
                                    unsigned num_trees,
-                                   unsigned max_depth)
-    : num_classes(num_classes), num_trees(num_trees), max_depth(max_depth)
+                                   unsigned max_depth,
+                                   unsigned num_threads,
+                                   unsigned seed)
+    : num_classes(num_classes),
+      num_trees(num_trees),
+      max_depth(max_depth),
+      num_threads(num_threads),
+      seed(seed)
 {
-  // Uniform random generator using Mersenne-Twister for randomness.
-  std::mt19937 generator;
-  std::uniform_int_distribution<size_t> uniform_dist(0, features.size() - 1);
-
-  for (unsigned i = 0; i < num_trees; i++) {
-    std::vector<std::vector<float>> sample_features;
-    std::vector<int> sample_responses;
-    // Random pick with replacement of features, responses
-    for (size_t i = 0, end = features.size(); i < end; ++i) {
-      int sample_idx = uniform_dist(generator);
-      sample_features.push_back(features[sample_idx]);
-      sample_responses.push_back(responses[sample_idx]);
-    }
-
-    rfc.push_back(std::make_unique<DecisionTreeImpl>(
-        num_classes, sample_features, sample_responses, max_depth));
-  }
+  train(features, responses);
 }
 
-void RandomForestImpl::output_rfc(OutputFormatter &outfmt)
+void RandomForestImpl::output_rfc(OutputFormatter &outfmt, bool include_data)
 {
   outfmt << "rfc: {\n";
   ++outfmt;
@@ -90,7 +132,7 @@ void RandomForestImpl::output_rfc(OutputFormatter &outfmt)
   unsigned tree_idx = 0;
   for (auto &dtree : rfc) {
     ++outfmt;
-    dtree->output_tree(outfmt, "tree");
+    dtree->output_tree(outfmt, "tree", include_data);
     outfmt << ",\n";
     --outfmt;
     tree_idx++;
@@ -103,11 +145,16 @@ void RandomForestImpl::output_rfc(OutputFormatter &outfmt)
 void RandomForestImpl::save(const std::string &filename)
 {
   std::ofstream ofs(filename, std::ofstream::out);
-  OutputFormatter outfmt(ofs);
-  outfmt << "# RandomForestImpl\n";
-  output_rfc(outfmt);
+  save(ofs);
   ofs.close();
 }
+
+void RandomForestImpl::save(std::ostream &os, bool include_data)
+{
+  OutputFormatter outfmt(os);
+  outfmt << "# RandomForestImpl\n";
+  output_rfc(outfmt, include_data);
+}
 template <typename T>
 static void parseKeyVal(Parser &parser, const char *key, T &val)
 {
@@ -119,9 +166,9 @@ static void parseKeyVal(Parser &parser, const char *key, T &val)
   parser.parseExpected(",");
 };
 
-void RandomForestImpl::parse_rfc(std::ifstream &ifs)
+void RandomForestImpl::parse_rfc(std::istream &is)
 {
-  Parser parser(ifs);
+  Parser parser(is);
 
   parser.getNextToken();
   parser.parseExpected("rfc:");
@@ -153,7 +200,7 @@ void RandomForestImpl::parse_rfc(std::ifstream &ifs)
   parser.parseExpected("[");
 
   for (int i = 0; i < num_trees; ++i) {
-    rfc.push_back(std::make_unique<DecisionTreeImpl>(num_classes, ifs));
+    rfc.push_back(std::make_unique<DecisionTreeImpl>(num_classes, is));
     parser.getNextToken();
     parser.parseExpected(",");
   }
@@ -168,6 +215,7 @@ void RandomForestImpl::load(const std::string &filename)
 {
   std::ifstream ifs(filename);
   if (!ifs) throw std::runtime_error("Error loading file: " + filename);
+  rfc.clear();
   parse_rfc(ifs);
   ifs.close();
 }
@@ -192,6 +240,40 @@ int RandomForestImpl::predict(const std::vector<float> &features)
   return class_idx;
 }
 
+void RandomForestImpl::predict(const float *features,
+                               int num_features,
+                               size_t n,
+                               int *classes)
+{
+  // Votes of a block of rows are accumulated tree by tree, each tree
+  // classifies the whole block in one pass.
+  constexpr size_t BLOCK_SIZE = 64;
+  int dtree_predictions[BLOCK_SIZE];
+  std::vector<int> count_per_class(BLOCK_SIZE * num_classes);
+  for (size_t start = 0; start < n; start += BLOCK_SIZE) {
+    size_t count = std::min(BLOCK_SIZE, n - start);
+    std::fill(count_per_class.begin(), count_per_class.end(), 0);
+
+    for (auto &dtree : rfc) {
+      dtree->predict(&features[start * num_features],
+                     num_features,
+                     count,
+                     dtree_predictions);
+      for (size_t i = 0; i < count; ++i)
+        count_per_class[i * num_classes + dtree_predictions[i]]++;
+    }
+
+    // Majority vote, ties resolve to the lowest class as in predict().
+    for (size_t i = 0; i < count; ++i) {
+      const int *counts = &count_per_class[i * num_classes];
+      int class_idx = 0;
+      for (int c = 1; c < num_classes; ++c)
+        if (counts[c] > counts[class_idx]) class_idx = c;
+      classes[start + i] = class_idx;
+    }
+  }
+}
+
 void RandomForestImpl::print_forest()
 {
   OutputFormatter outfmt(std::cout);
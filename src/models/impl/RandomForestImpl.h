@@ -7,6 +7,7 @@
 #define APOLLO_MODELS_RANDOMFORESTIMPL_H
 
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -16,27 +17,47 @@ class RandomForestImpl
 {
 public:
   RandomForestImpl(int num_classes, std::string filename);
-  RandomForestImpl(int num_classes, unsigned num_trees, unsigned max_depth);
+  RandomForestImpl(int num_classes, std::istream &is);
+  // Trees are trained concurrently by num_threads threads, 0 uses the hardware
+  // concurrency. Bootstrap samples depend only on the seed and the tree index.
+  RandomForestImpl(int num_classes,
+                   unsigned num_trees,
+                   unsigned max_depth,
+                   unsigned num_threads = 1,
+                   unsigned seed = std::mt19937::default_seed);
   RandomForestImpl(int num_classes,
                    std::vector<std::vector<float>> &features,
                    std::vector<int> &responses,
                    unsigned num_trees,
-                   unsigned max_depth);
+                   unsigned max_depth,
+                   unsigned num_threads = 1,
+                   unsigned seed = std::mt19937::default_seed);
 
   void train(std::vector<std::vector<float>> &features,
              std::vector<int> &responses);
   void load(const std::string &filename);
   void save(const std::string &filename);
+  // Outputs the training data of the trees unless include_data is false.
+  void save(std::ostream &os, bool include_data = true);
   int predict(const std::vector<float> &features);
+  // Predicts n rows of num_features, stored row-major.
+  void predict(const float *features,
+               int num_features,
+               size_t n,
+               int *classes);
   void print_forest();
+  unsigned get_num_trees() const { return rfc.size(); }
+  DecisionTreeImpl &get_tree(unsigned tree_idx) { return *rfc[tree_idx]; }
 
 private:
-  void parse_rfc(std::ifstream &ifs);
-  void output_rfc(OutputFormatter &outfmt);
+  void parse_rfc(std::istream &is);
+  void output_rfc(OutputFormatter &outfmt, bool include_data = true);
   std::vector<std::unique_ptr<DecisionTreeImpl>> rfc;
   int num_classes;
   unsigned num_trees;
   unsigned max_depth;
+  unsigned num_threads;
+  unsigned seed;
 };
 
 #endif
\ No newline at end of file
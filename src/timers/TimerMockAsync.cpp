@@ -0,0 +1,35 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include "timers/TimerMockAsync.h"
+
+std::atomic<unsigned long> TimerMockAsync::num_created(0);
+
+template <>
+std::unique_ptr<Apollo::Timer> Apollo::Timer::create<Apollo::Timer::MockAsync>()
+{
+  return std::make_unique<TimerMockAsync>();
+}
+
+TimerMockAsync::TimerMockAsync() : polls(0) { num_created++; }
+
+TimerMockAsync::~TimerMockAsync() {}
+
+void TimerMockAsync::start()
+{
+  time_start = std::chrono::steady_clock::now();
+  polls = 0;
+}
+
+void TimerMockAsync::stop() { time_stop = std::chrono::steady_clock::now(); }
+
+bool TimerMockAsync::isDone(double &metric)
+{
+  // Emulate device latency, the first poll after stop() is never ready.
+  if (polls++ == 0) return false;
+
+  metric = std::chrono::duration<double>(time_stop - time_start).count();
+  return true;
+}
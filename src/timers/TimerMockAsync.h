@@ -0,0 +1,35 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_TIMER_MOCK_ASYNC_H
+#define APOLLO_TIMER_MOCK_ASYNC_H
+
+#include <atomic>
+#include <chrono>
+
+#include "apollo/Timer.h"
+
+// Host-side mock of an asynchronous device timer. It mimics event-based
+// timers: the measurement becomes ready only on the second poll of isDone()
+// after stop(), and every constructed timer counts as a created event pair.
+class TimerMockAsync : public Apollo::Timer
+{
+public:
+  TimerMockAsync();
+  ~TimerMockAsync();
+  void start();
+  void stop();
+  bool isDone(double &metric);
+
+  // Number of mock timers (event pairs) created so far.
+  static std::atomic<unsigned long> num_created;
+
+private:
+  std::chrono::steady_clock::time_point time_start;
+  std::chrono::steady_clock::time_point time_stop;
+  unsigned polls;
+};
+
+#endif
@@ -0,0 +1,267 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include "timers/TimerPerfEvent.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+
+#include "helpers/ErrorHandling.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static const char *metric_names[TimerPerfEvent::NUM_METRICS] = {
+    "cycles",
+    "instructions",
+    "llc_misses",
+    "energy",
+    "task_clock",
+    "cpi",
+    "llc_mpki"};
+
+bool TimerPerfEvent::parseMetric(const std::string &name, Metric &metric)
+{
+  for (int i = 0; i < NUM_METRICS; ++i)
+    if (name == metric_names[i]) {
+      metric = static_cast<Metric>(i);
+      return true;
+    }
+  return false;
+}
+
+const char *TimerPerfEvent::metricName(Metric metric)
+{
+  return metric_names[metric];
+}
+
+bool TimerPerfEvent::isAvailable(Metric metric, std::string &error)
+{
+  TimerPerfEvent timer(metric);
+  return timer.open(error);
+}
+
+TimerPerfEvent::TimerPerfEvent(Metric metric)
+    : metric(metric), num_events(0), tid(-1), scale(1.0)
+{
+  for (int i = 0; i < MAX_EVENTS; ++i)
+    fds[i] = -1;
+}
+
+TimerPerfEvent::~TimerPerfEvent() { close(); }
+
+#ifdef __linux__
+
+static pid_t currentTid()
+{
+  static thread_local pid_t tid = syscall(SYS_gettid);
+  return tid;
+}
+
+static bool readFile(const std::string &path, std::string &contents)
+{
+  std::ifstream file(path);
+  return static_cast<bool>(std::getline(file, contents));
+}
+
+// Resolves the RAPL package energy event of the power PMU, which counts
+// system-wide on the cpu of its cpumask.
+static bool raplEnergyEvent(perf_event_attr &attr,
+                            double &scale,
+                            int &cpu,
+                            std::string &error)
+{
+  const std::string pmu = "/sys/bus/event_source/devices/power/";
+  std::string type, event;
+  if (!readFile(pmu + "type", type)) {
+    error = "no RAPL power PMU";
+    return false;
+  }
+  std::string name = "energy-pkg";
+  if (!readFile(pmu + "events/" + name, event)) {
+    name = "energy-psys";
+    if (!readFile(pmu + "events/" + name, event)) {
+      error = "no RAPL energy-pkg or energy-psys event";
+      return false;
+    }
+  }
+
+  std::string scale_str, cpumask;
+  size_t pos = event.find("event=");
+  if (pos == std::string::npos || !readFile(pmu + "events/" + name + ".scale",
+                                            scale_str) ||
+      !readFile(pmu + "cpumask", cpumask)) {
+    error = "cannot parse RAPL event " + name;
+    return false;
+  }
+  attr.type = std::stoul(type);
+  attr.config = std::stoull(event.substr(pos + 6), nullptr, 0);
+  scale = std::stod(scale_str);
+  cpu = std::stoi(cpumask);
+  return true;
+}
+
+bool TimerPerfEvent::open(std::string &error)
+{
+  perf_event_attr attrs[MAX_EVENTS];
+  std::memset(attrs, 0, sizeof(attrs));
+  for (auto &attr : attrs)
+    attr.type = PERF_TYPE_HARDWARE;
+
+  // Events counting the calling thread, or a cpu system-wide.
+  pid_t pid = 0;
+  int cpu = -1;
+  scale = 1.0;
+  switch (metric) {
+    case CYCLES:
+      num_events = 1;
+      attrs[0].config = PERF_COUNT_HW_CPU_CYCLES;
+      break;
+    case INSTRUCTIONS:
+      num_events = 1;
+      attrs[0].config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case LLC_MISSES:
+      num_events = 1;
+      attrs[0].config = PERF_COUNT_HW_CACHE_MISSES;
+      break;
+    case ENERGY:
+      num_events = 1;
+      if (!raplEnergyEvent(attrs[0], scale, cpu, error)) return false;
+      pid = -1;
+      break;
+    case TASK_CLOCK:
+      num_events = 1;
+      attrs[0].type = PERF_TYPE_SOFTWARE;
+      attrs[0].config = PERF_COUNT_SW_TASK_CLOCK;
+      scale = 1e-9;
+      break;
+    case CPI:
+      num_events = 2;
+      attrs[0].config = PERF_COUNT_HW_CPU_CYCLES;
+      attrs[1].config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    case LLC_MPKI:
+      num_events = 2;
+      attrs[0].config = PERF_COUNT_HW_CACHE_MISSES;
+      attrs[1].config = PERF_COUNT_HW_INSTRUCTIONS;
+      break;
+    default:
+      error = "unknown metric";
+      return false;
+  }
+
+  for (int i = 0; i < num_events; ++i) {
+    perf_event_attr &attr = attrs[i];
+    attr.size = sizeof(attr);
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // Thread counters exclude the kernel, as permitted by the default
+    // perf_event_paranoid level. The power PMU rejects exclusions.
+    if (pid == 0) {
+      attr.exclude_kernel = 1;
+      attr.exclude_hv = 1;
+    }
+    fds[i] = syscall(SYS_perf_event_open,
+                     &attr,
+                     pid,
+                     cpu,
+                     (i == 0 ? -1 : fds[0]),
+                     PERF_FLAG_FD_CLOEXEC);
+    if (fds[i] < 0) {
+      error = std::string("perf_event_open failed: ") + strerror(errno);
+      close();
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void TimerPerfEvent::close()
+{
+  // Members first, then the group leader.
+  for (int i = MAX_EVENTS - 1; i >= 0; --i)
+    if (fds[i] >= 0) {
+      ::close(fds[i]);
+      fds[i] = -1;
+    }
+}
+
+void TimerPerfEvent::read(GroupValues &group_values)
+{
+  size_t size = (3 + num_events) * sizeof(uint64_t);
+  if (::read(fds[0], &group_values, size) != (ssize_t)size)
+    fatal_error(std::string("Cannot read perf_event counters of metric ") +
+                metricName(metric));
+}
+
+void TimerPerfEvent::start()
+{
+  // Thread counters count the thread that opened them, reopen if another
+  // thread executes.
+  if (fds[0] < 0 || tid != currentTid()) {
+    close();
+    std::string error;
+    if (!open(error))
+      fatal_error(std::string("Cannot open perf_event counters of metric ") +
+                  metricName(metric) + ", " + error);
+    tid = currentTid();
+  }
+  read(values_begin);
+}
+
+void TimerPerfEvent::stop() { read(values_end); }
+
+#else
+
+bool TimerPerfEvent::open(std::string &error)
+{
+  error = "perf_event_open requires Linux";
+  return false;
+}
+
+void TimerPerfEvent::close() {}
+
+void TimerPerfEvent::read(GroupValues &group_values) {}
+
+void TimerPerfEvent::start()
+{
+  fatal_error("perf_event metrics require Linux");
+}
+
+void TimerPerfEvent::stop() {}
+
+#endif  // __linux__
+
+bool TimerPerfEvent::isDone(double &metric_value)
+{
+  // Scale counts up if the counters were multiplexed, i.e., scheduled for
+  // part of the interval only.
+  uint64_t enabled = values_end.time_enabled - values_begin.time_enabled;
+  uint64_t running = values_end.time_running - values_begin.time_running;
+  double counts[MAX_EVENTS];
+  for (int i = 0; i < num_events; ++i) {
+    counts[i] = values_end.values[i] - values_begin.values[i];
+    if (running > 0 && running < enabled)
+      counts[i] *= static_cast<double>(enabled) / running;
+  }
+
+  switch (metric) {
+    case CPI:
+      metric_value = (counts[1] > 0 ? counts[0] / counts[1] : 0.0);
+      break;
+    case LLC_MPKI:
+      metric_value = (counts[1] > 0 ? 1000.0 * counts[0] / counts[1] : 0.0);
+      break;
+    default:
+      metric_value = counts[0] * scale;
+  }
+  return true;
+}
@@ -0,0 +1,78 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_TIMER_PERF_EVENT_H
+#define APOLLO_TIMER_PERF_EVENT_H
+
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+
+#include "apollo/Timer.h"
+
+// Synchronous "timer" measuring Linux perf_event counters instead of time,
+// selected by the region model_info param metric=<name>. Hardware and
+// software counters count the calling thread in user space only, RAPL energy
+// counts the whole package. Counters are opened on the first start() of a
+// thread and read by start() and stop(), which costs a read system call each.
+class TimerPerfEvent : public Apollo::Timer
+{
+public:
+  enum Metric {
+    CYCLES,
+    INSTRUCTIONS,
+    // Generic cache-misses event, last-level cache misses on most processors.
+    LLC_MISSES,
+    // RAPL energy-pkg, or energy-psys if there is none, in Joules.
+    ENERGY,
+    // CPU time of the thread in seconds, excludes time blocked or descheduled.
+    TASK_CLOCK,
+    // Cycles per instruction.
+    CPI,
+    // LLC misses per 1000 instructions.
+    LLC_MPKI,
+    NUM_METRICS
+  };
+
+  // Returns false if name is not a metric.
+  static bool parseMetric(const std::string &name, Metric &metric);
+  static const char *metricName(Metric metric);
+  // Opens the counters of metric once, returns false with the reason in error
+  // if they are not supported or not permitted.
+  static bool isAvailable(Metric metric, std::string &error);
+
+  explicit TimerPerfEvent(Metric metric);
+  ~TimerPerfEvent();
+  void start();
+  void stop();
+  bool isDone(double &metric);
+
+private:
+  static constexpr int MAX_EVENTS = 2;
+  // Group read format: nr, time_enabled, time_running, values.
+  struct GroupValues {
+    uint64_t nr;
+    uint64_t time_enabled;
+    uint64_t time_running;
+    uint64_t values[MAX_EVENTS];
+  };
+
+  Metric metric;
+  int num_events;
+  // Group leader first, -1 if not open.
+  int fds[MAX_EVENTS];
+  // Thread the counters were opened by.
+  pid_t tid;
+  // Units per count of the first event, e.g., Joules of RAPL energy.
+  double scale;
+  GroupValues values_begin, values_end;
+
+  bool open(std::string &error);
+  void close();
+  void read(GroupValues &group_values);
+};
+
+#endif
@@ -9,22 +9,13 @@ std::unique_ptr<Apollo::Timer> Apollo::Timer::create<Apollo::Timer::Sync>()
   return std::make_unique<TimerSync>();
 }
 
-void TimerSync::start()
-{
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  exec_time_begin = ts.tv_sec + ts.tv_nsec / 1e9;
-}
+void TimerSync::start() { clock_gettime(CLOCK_MONOTONIC, &exec_time_begin); }
 
-void TimerSync::stop()
-{
-  struct timespec ts;
-  clock_gettime(CLOCK_MONOTONIC, &ts);
-  exec_time_end = ts.tv_sec + ts.tv_nsec / 1e9;
-}
+void TimerSync::stop() { clock_gettime(CLOCK_MONOTONIC, &exec_time_end); }
 
 bool TimerSync::isDone(double &metric)
 {
-  metric = exec_time_end - exec_time_begin;
+  metric = (exec_time_end.tv_sec - exec_time_begin.tv_sec) +
+           (exec_time_end.tv_nsec - exec_time_begin.tv_nsec) / 1e9;
   return true;
 }
@@ -6,6 +6,8 @@
 #ifndef APOLLO_TIMER_SYNC_H
 #define APOLLO_TIMER_SYNC_H
 
+#include <time.h>
+
 #include "apollo/Timer.h"
 
 class TimerSync : public Apollo::Timer
@@ -18,7 +20,8 @@ public:
   bool isDone(double &metric);
 
 private:
-  double exec_time_begin, exec_time_end;
+  // Converted to seconds only by isDone().
+  struct timespec exec_time_begin, exec_time_end;
 };
 
 #endif
\ No newline at end of file
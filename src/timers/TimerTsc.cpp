@@ -0,0 +1,24 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include "timers/TimerTsc.h"
+
+#include "helpers/TscClock.h"
+
+template <>
+std::unique_ptr<Apollo::Timer> Apollo::Timer::create<Apollo::Timer::Tsc>()
+{
+  return std::make_unique<TimerTsc>();
+}
+
+void TimerTsc::start() { ticks_begin = TscClock::begin(); }
+
+void TimerTsc::stop() { ticks_end = TscClock::end(); }
+
+bool TimerTsc::isDone(double &metric)
+{
+  metric = TscClock::toSeconds(ticks_end - ticks_begin);
+  return true;
+}
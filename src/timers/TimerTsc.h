@@ -0,0 +1,28 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#ifndef APOLLO_TIMER_TSC_H
+#define APOLLO_TIMER_TSC_H
+
+#include <cstdint>
+
+#include "apollo/Timer.h"
+
+// Synchronous timer of APOLLO_SYNC_TIMER=tsc. It stores raw TscClock ticks,
+// converted to seconds only by isDone().
+class TimerTsc : public Apollo::Timer
+{
+public:
+  TimerTsc() : ticks_begin(0), ticks_end(0) {}
+  ~TimerTsc() {}
+  void start();
+  void stop();
+  bool isDone(double &metric);
+
+private:
+  uint64_t ticks_begin, ticks_end;
+};
+
+#endif
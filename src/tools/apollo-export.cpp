@@ -0,0 +1,150 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+// Exports a stored DecisionTree or RandomForest model to a C++ header of
+// constant node tables, which registers the model for the Compiled policy
+// model when included in the application.
+
+#include <cctype>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <memory>
+#include <string>
+
+#include "helpers/OutputFormatter.h"
+#include "models/impl/DecisionTreeImpl.h"
+#include "models/impl/RandomForestImpl.h"
+
+static void usage(const char *argv0)
+{
+  std::cerr << "Usage: " << argv0
+            << " <num_policies> <model.yaml> <name> [output.h]\n"
+            << "Exports a stored DecisionTree or RandomForest model for "
+               "APOLLO_POLICY_MODEL=Compiled,name=<name>\n";
+}
+
+static bool isIdentifier(const std::string &name)
+{
+  if (name.empty() || std::isdigit(name[0])) return false;
+  for (char c : name)
+    if (!(std::isalnum(c) || c == '_')) return false;
+  return true;
+}
+
+static void outputTree(OutputFormatter &outfmt,
+                       DecisionTreeImpl &dtree,
+                       unsigned tree_idx)
+{
+  outfmt << "constexpr Compiled::Node tree_" & tree_idx & "[] = ";
+  dtree.output_flat_tree(outfmt);
+  outfmt & ";\n\n";
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 4 || argc > 5) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  int num_policies = std::stoi(argv[1]);
+  std::string model_file = argv[2];
+  std::string name = argv[3];
+  if (!isIdentifier(name)) {
+    std::cerr << "Model name " << name << " must be a C++ identifier\n";
+    return 1;
+  }
+
+  // Stored models start with their top-level key after comment lines.
+  std::string key;
+  {
+    std::ifstream ifs(model_file);
+    if (!ifs) {
+      std::cerr << "Error loading file: " << model_file << "\n";
+      return 1;
+    }
+    while (ifs >> key && key[0] == '#')
+      ifs.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+  }
+
+  std::unique_ptr<DecisionTreeImpl> dtree;
+  std::unique_ptr<RandomForestImpl> forest;
+  if (key == "tree:")
+    dtree = std::make_unique<DecisionTreeImpl>(num_policies, model_file);
+  else if (key == "rfc:")
+    forest = std::make_unique<RandomForestImpl>(num_policies, model_file);
+  else {
+    std::cerr << "Unknown model in " << model_file
+              << ", expected a DecisionTree or RandomForest\n";
+    return 1;
+  }
+
+  std::ofstream ofs;
+  if (argc == 5) {
+    ofs.open(argv[4]);
+    if (!ofs) {
+      std::cerr << "Error opening output file " << argv[4] << "\n";
+      return 1;
+    }
+  }
+  OutputFormatter outfmt(argc == 5 ? ofs : std::cout);
+
+  std::string guard = "APOLLO_COMPILED_";
+  for (char c : name)
+    guard += std::toupper(c);
+  guard += "_H";
+
+  outfmt << "// Generated by apollo-export from " & model_file &
+      ", do not edit.\n\n";
+  outfmt << "#ifndef " & guard & "\n";
+  outfmt << "#define " & guard & "\n\n";
+  outfmt << "#include \"apollo/models/Compiled.h\"\n\n";
+  outfmt << "namespace apollo\n{\nnamespace compiled\n{\nnamespace " & name &
+      "\n{\n\n";
+
+  if (dtree) {
+    outputTree(outfmt, *dtree, 0);
+    outfmt << "inline int evaluate(const float *features)\n{\n";
+    ++outfmt;
+    outfmt << "return Compiled::evaluateTree(tree_0, features);\n";
+    --outfmt;
+    outfmt << "}\n\n";
+  } else {
+    unsigned num_trees = forest->get_num_trees();
+    for (unsigned i = 0; i < num_trees; ++i)
+      outputTree(outfmt, forest->get_tree(i), i);
+
+    // Majority vote, ties resolve to the lowest policy.
+    outfmt << "inline int evaluate(const float *features)\n{\n";
+    ++outfmt;
+    outfmt << "int count_per_class[" & num_policies & "] = {};\n";
+    for (unsigned i = 0; i < num_trees; ++i)
+      outfmt << "++count_per_class[Compiled::evaluateTree(tree_" & i &
+          ", features)];\n";
+    outfmt << "int class_idx = 0;\n";
+    outfmt << "for (int i = 1; i < " & num_policies & "; ++i)\n";
+    ++outfmt;
+    outfmt << "if (count_per_class[i] > count_per_class[class_idx]) "
+              "class_idx = i;\n";
+    --outfmt;
+    outfmt << "return class_idx;\n";
+    --outfmt;
+    outfmt << "}\n\n";
+  }
+
+  outfmt << "static const bool registered =\n";
+  ++outfmt;
+  ++outfmt;
+  outfmt << "Compiled::registerModel(\"" & name & "\", evaluate);\n\n";
+  --outfmt;
+  --outfmt;
+  outfmt << "}  // end namespace " & name & ".\n";
+  outfmt << "}  // end namespace compiled.\n";
+  outfmt << "}  // end namespace apollo.\n\n";
+  outfmt << "#endif\n";
+
+  return 0;
+}
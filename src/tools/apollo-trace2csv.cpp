@@ -0,0 +1,179 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+// Converts a binary trace of APOLLO_TRACE_BINARY to the trace files of
+// APOLLO_TRACE_CSV.
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "helpers/TraceWriter.h"
+
+struct RegionInfo {
+  int num_features;
+  std::string model_name;
+  std::string model_info;
+  std::string name;
+};
+
+struct Execution {
+  TraceWriter::Record record;
+  std::vector<float> features;
+};
+
+static void usage(const char *argv0)
+{
+  std::cerr << "Usage: " << argv0 << " <trace-rank-N.bin> [output_dir]\n"
+            << "Converts a binary trace, with its .dict file next to it, to "
+               "CSV trace files in output_dir (default: the trace directory)\n";
+}
+
+static std::vector<std::string> split(const std::string &line)
+{
+  std::vector<std::string> fields;
+  std::stringstream ss(line);
+  std::string field;
+  while (std::getline(ss, field, '\t'))
+    fields.push_back(field);
+  return fields;
+}
+
+int main(int argc, char *argv[])
+{
+  if (argc < 2 || argc > 3) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string bin_path = argv[1];
+  if (bin_path.size() < 4 || bin_path.substr(bin_path.size() - 4) != ".bin") {
+    std::cerr << "Expected a .bin trace file, got " << bin_path << "\n";
+    return 1;
+  }
+  std::string prefix = bin_path.substr(0, bin_path.size() - 4);
+  std::string output_dir;
+  if (argc == 3)
+    output_dir = argv[2];
+  else {
+    size_t pos = prefix.find_last_of('/');
+    output_dir = (pos == std::string::npos ? "." : prefix.substr(0, pos));
+  }
+
+  std::ifstream dict_file(prefix + ".dict");
+  if (!dict_file) {
+    std::cerr << "Error loading file: " << prefix << ".dict\n";
+    return 1;
+  }
+  unsigned long long start_us = 0;
+  int rank = 0;
+  std::map<uint32_t, RegionInfo> regions;
+  std::map<uint32_t, std::string> models;
+  std::string line;
+  while (std::getline(dict_file, line)) {
+    std::vector<std::string> fields = split(line);
+    if (fields.empty()) continue;
+    if (fields[0] == "start" && fields.size() == 2)
+      start_us = std::stoull(fields[1]);
+    else if (fields[0] == "rank" && fields.size() == 2)
+      rank = std::stoi(fields[1]);
+    else if (fields[0] == "region" && fields.size() == 6)
+      regions[std::stoul(fields[1])] = {
+          std::stoi(fields[2]), fields[3], fields[4], fields[5]};
+    else if (fields[0] == "model" && fields.size() == 3)
+      models[std::stoul(fields[1])] = fields[2];
+    else {
+      std::cerr << "Malformed dictionary line: " << line << "\n";
+      return 1;
+    }
+  }
+
+  std::ifstream bin_file(bin_path, std::ios::binary);
+  if (!bin_file) {
+    std::cerr << "Error loading file: " << bin_path << "\n";
+    return 1;
+  }
+  TraceWriter::FileHeader header;
+  if (!bin_file.read(reinterpret_cast<char *>(&header), sizeof(header)) ||
+      std::memcmp(header.magic, TraceWriter::MAGIC, sizeof(header.magic)) !=
+          0 ||
+      header.version != TraceWriter::VERSION) {
+    std::cerr << "Unrecognized binary trace " << bin_path << "\n";
+    return 1;
+  }
+
+  std::vector<Execution> executions;
+  TraceWriter::Record record;
+  while (bin_file.read(reinterpret_cast<char *>(&record), sizeof(record))) {
+    if (!regions.count(record.region_id) || !models.count(record.model_id) ||
+        record.num_features < 0) {
+      std::cerr << "Malformed record in " << bin_path << "\n";
+      return 1;
+    }
+    Execution execution;
+    execution.record = record;
+    execution.features.resize(record.num_features);
+    bin_file.read(reinterpret_cast<char *>(execution.features.data()),
+                  record.num_features * sizeof(float));
+    if (!bin_file) {
+      std::cerr << "Truncated record in " << bin_path << "\n";
+      return 1;
+    }
+    executions.push_back(std::move(execution));
+  }
+
+  // Threads flush their records in blocks, restore the execution order.
+  std::stable_sort(executions.begin(),
+                   executions.end(),
+                   [](const Execution &a, const Execution &b) {
+                     return a.record.timestamp < b.record.timestamp;
+                   });
+
+  std::string rank_str = std::to_string(rank);
+  std::ofstream gtrace_file(output_dir + "/trace-rank-" + rank_str + ".csv");
+  if (!gtrace_file) {
+    std::cerr << "Error opening output files in " << output_dir << "\n";
+    return 1;
+  }
+  gtrace_file << "# timestamp (us), region, idx, model, "
+                 "policy\n";
+
+  std::map<uint32_t, std::ofstream> trace_files;
+  for (auto &it : regions) {
+    const RegionInfo &info = it.second;
+    std::ofstream &trace_file = trace_files[it.first];
+    trace_file.open(output_dir + "/trace-" + info.model_info + "-region-" +
+                    info.name + "-rank-" + rank_str + ".csv");
+    trace_file << "rankid training region idx";
+    for (int i = 0; i < info.num_features; i++)
+      trace_file << " f" << i;
+    trace_file << " policy xtime\n";
+  }
+
+  for (const Execution &execution : executions) {
+    const TraceWriter::Record &r = execution.record;
+    const RegionInfo &info = regions[r.region_id];
+    gtrace_file << start_us + r.timestamp / 1000 << " " << info.name << " "
+                << r.idx << " " << info.model_name << " "
+                << " " << r.policy << "\n";
+
+    std::ofstream &trace_file = trace_files[r.region_id];
+    trace_file << rank << " ";
+    trace_file << models[r.model_id] << " ";
+    trace_file << info.name << " ";
+    trace_file << r.idx << " ";
+    for (auto &f : execution.features)
+      trace_file << f << " ";
+    trace_file << r.policy << " ";
+    trace_file << r.metric << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,422 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+// Micro-benchmarks of the Apollo runtime, see "Benchmarks" in HOWTO.md.
+// Results are emitted in JSON with --benchmark_format=json or
+// --benchmark_out=<file> --benchmark_out_format=json.
+
+#include <benchmark/benchmark.h>
+#include <sys/stat.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Config.h"
+#include "apollo/Dataset.h"
+#include "apollo/ModelFactory.h"
+#include "apollo/Region.h"
+#include "helpers/TraceWriter.h"
+
+#define NUM_POLICIES 4
+// Distinct values of each feature in the synthetic measurements.
+#define NUM_VALUES 8
+// Distinct feature rows cycled through by executions.
+#define NUM_ROWS 1024
+
+static const std::vector<std::string> MODELS = {"Static",
+                                                "RoundRobin",
+                                                "Random",
+                                                "DatasetMap",
+                                                "DecisionTree",
+                                                "RandomForest",
+                                                "PolicyNet"};
+static const std::vector<std::string> TRAINED_MODELS = {"DecisionTree",
+                                                        "RandomForest",
+                                                        "PolicyNet"};
+
+// Synthetic measurements of n executions, stored row-major. The best policy
+// of a row is the sum of its features modulo num_policies.
+struct Rows {
+  std::vector<float> features;
+  std::vector<int> policies;
+  std::vector<double> metrics;
+};
+
+static Rows makeRows(size_t n, int num_features, int num_policies)
+{
+  std::mt19937 gen(n * num_features * num_policies);
+  std::uniform_int_distribution<int> value(0, NUM_VALUES - 1);
+  std::uniform_int_distribution<int> policy(0, num_policies - 1);
+
+  Rows rows;
+  rows.features.resize(n * num_features);
+  rows.policies.resize(n);
+  rows.metrics.resize(n);
+  for (size_t i = 0; i < n; ++i) {
+    int sum = 0;
+    for (int j = 0; j < num_features; ++j) {
+      rows.features[i * num_features + j] = value(gen);
+      sum += rows.features[i * num_features + j];
+    }
+    rows.policies[i] = policy(gen);
+    rows.metrics[i] = (rows.policies[i] == sum % num_policies ? 1.0 : 2.0);
+  }
+  return rows;
+}
+
+static std::unique_ptr<Apollo::Dataset> makeDataset(const Rows &rows,
+                                                    int num_features)
+{
+  auto dataset = std::make_unique<Apollo::Dataset>();
+  dataset->insertRows(num_features,
+                      rows.features.data(),
+                      rows.policies.data(),
+                      rows.metrics.data(),
+                      rows.policies.size());
+  return dataset;
+}
+
+static std::unique_ptr<apollo::PolicyModel> createModel(
+    const std::string &model_name,
+    int num_features,
+    int num_policies)
+{
+  std::unordered_map<std::string, std::string> model_params;
+  if (model_name == "DecisionTree" || model_name == "RandomForest")
+    model_params["max_depth"] = "4";
+  return apollo::ModelFactory::createPolicyModel(model_name,
+                                                 num_features,
+                                                 num_policies,
+                                                 model_params);
+}
+
+static size_t fileSize(const std::string &path)
+{
+  std::ifstream ifs(path, std::ios::binary | std::ios::ate);
+  return ifs.tellg();
+}
+
+// Regions and files of a benchmark run are named uniquely.
+static std::string regionName(const std::string &prefix)
+{
+  static int counter = 0;
+  return "bench-" + prefix + "-" + std::to_string(counter++);
+}
+
+// Region with its model trained on NUM_ROWS synthetic measurements. Regions
+// are owned and deleted by Apollo.
+static Apollo::Region *createTrainedRegion(
+    const std::string &model_name,
+    int num_features,
+    const Rows &rows)
+{
+  std::string name = regionName(model_name);
+  auto dataset = makeDataset(rows, num_features);
+
+  // DatasetMap regions load their dataset on creation.
+  std::string dataset_file;
+  if (model_name == "DatasetMap") {
+    std::string dir = Config::APOLLO_OUTPUT_DIR + "/" +
+                      Config::APOLLO_DATASETS_DIR;
+    mkdir(Config::APOLLO_OUTPUT_DIR.c_str(), 0755);
+    mkdir(dir.c_str(), 0755);
+    dataset_file = dir + "/Dataset-" + name + ".bin";
+    dataset->storeBinary(dataset_file);
+  }
+
+  Apollo::Region *r = new Apollo::Region(num_features,
+                                         name.c_str(),
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         model_name);
+  if (dataset_file.empty())
+    r->model->train(*dataset);
+  else
+    std::remove(dataset_file.c_str());
+  return r;
+}
+
+// Latency of an execution: begin(), setFeature() per feature,
+// getPolicyIndex() and end().
+static void BM_Execution(benchmark::State &state, const std::string &model_name)
+{
+  int num_features = state.range(0);
+  Rows rows = makeRows(NUM_ROWS, num_features, NUM_POLICIES);
+  Apollo::Region *r = createTrainedRegion(model_name, num_features, rows);
+
+  size_t row = 0;
+  for (auto _ : state) {
+    Apollo::RegionContext *context = r->begin();
+    const float *features = &rows.features[row * num_features];
+    for (int j = 0; j < num_features; ++j)
+      r->setFeature(context, features[j]);
+    benchmark::DoNotOptimize(r->getPolicyIndex(context));
+    r->end(context);
+    row = (row + 1) % NUM_ROWS;
+  }
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Batched policy queries of NUM_ROWS instances.
+static void BM_PolicyIndices(benchmark::State &state,
+                             const std::string &model_name)
+{
+  int num_features = state.range(0);
+  Rows rows = makeRows(NUM_ROWS, num_features, NUM_POLICIES);
+  Apollo::Region *r = createTrainedRegion(model_name, num_features, rows);
+
+  std::vector<int> policies(NUM_ROWS);
+  for (auto _ : state) {
+    r->getPolicyIndices(rows.features.data(), NUM_ROWS, policies.data());
+    benchmark::DoNotOptimize(policies.data());
+  }
+  state.SetItemsProcessed(state.iterations() * NUM_ROWS);
+}
+
+// Row by row inserts into an empty dataset, as measurements are collected.
+static void BM_DatasetInsert(benchmark::State &state)
+{
+  size_t n = state.range(0);
+  int num_features = state.range(1);
+  Rows rows = makeRows(n, num_features, NUM_POLICIES);
+  std::vector<std::vector<float>> features(n);
+  for (size_t i = 0; i < n; ++i)
+    features[i].assign(&rows.features[i * num_features],
+                       &rows.features[(i + 1) * num_features]);
+
+  for (auto _ : state) {
+    Apollo::Dataset dataset;
+    for (size_t i = 0; i < n; ++i)
+      dataset.insert(features[i], rows.policies[i], rows.metrics[i]);
+    benchmark::DoNotOptimize(dataset.size());
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Storing and loading a dataset of rows measurements in the YAML text format
+// or the binary format.
+static void BM_DatasetStore(benchmark::State &state, bool binary)
+{
+  size_t n = state.range(0);
+  int num_features = 4;
+  Rows rows = makeRows(n, num_features, NUM_POLICIES);
+  auto dataset = makeDataset(rows, num_features);
+
+  std::string path = regionName("dataset") + (binary ? ".bin" : ".yaml");
+  for (auto _ : state) {
+    if (binary)
+      dataset->storeBinary(path);
+    else {
+      std::ofstream ofs(path);
+      dataset->store(ofs);
+    }
+  }
+  state.SetItemsProcessed(state.iterations() * dataset->size());
+  state.SetBytesProcessed(state.iterations() * fileSize(path));
+  std::remove(path.c_str());
+}
+
+static void BM_DatasetLoad(benchmark::State &state, bool binary)
+{
+  size_t n = state.range(0);
+  int num_features = 4;
+  Rows rows = makeRows(n, num_features, NUM_POLICIES);
+  auto dataset = makeDataset(rows, num_features);
+
+  std::string path = regionName("dataset") + (binary ? ".bin" : ".yaml");
+  if (binary)
+    dataset->storeBinary(path);
+  else {
+    std::ofstream ofs(path);
+    dataset->store(ofs);
+  }
+  for (auto _ : state) {
+    Apollo::Dataset loaded;
+    if (binary)
+      loaded.loadBinary(path);
+    else {
+      std::ifstream ifs(path);
+      loaded.load(ifs);
+    }
+    benchmark::DoNotOptimize(loaded.size());
+  }
+  state.SetItemsProcessed(state.iterations() * dataset->size());
+  state.SetBytesProcessed(state.iterations() * fileSize(path));
+  std::remove(path.c_str());
+}
+
+// Training a new model on a dataset of rows x features x policies.
+static void BM_Train(benchmark::State &state, const std::string &model_name)
+{
+  size_t n = state.range(0);
+  int num_features = state.range(1);
+  int num_policies = state.range(2);
+  Rows rows = makeRows(n, num_features, num_policies);
+  auto dataset = makeDataset(rows, num_features);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto model = createModel(model_name, num_features, num_policies);
+    state.ResumeTiming();
+    model->train(*dataset);
+  }
+  state.SetItemsProcessed(state.iterations() * n);
+  state.counters["dataset_size"] = dataset->size();
+}
+
+// Storing and loading a model trained on rows measurements, in the YAML
+// format of the trees or the binary format of PolicyNet.
+static void BM_ModelStore(benchmark::State &state,
+                          const std::string &model_name)
+{
+  size_t n = state.range(0);
+  int num_features = 4;
+  Rows rows = makeRows(n, num_features, NUM_POLICIES);
+  auto dataset = makeDataset(rows, num_features);
+  auto model = createModel(model_name, num_features, NUM_POLICIES);
+  model->train(*dataset);
+
+  std::string path = regionName(model_name) + ".model";
+  for (auto _ : state)
+    model->store(path);
+  state.SetBytesProcessed(state.iterations() * fileSize(path));
+  std::remove(path.c_str());
+}
+
+static void BM_ModelLoad(benchmark::State &state, const std::string &model_name)
+{
+  size_t n = state.range(0);
+  int num_features = 4;
+  Rows rows = makeRows(n, num_features, NUM_POLICIES);
+  auto dataset = makeDataset(rows, num_features);
+  auto model = createModel(model_name, num_features, NUM_POLICIES);
+  model->train(*dataset);
+
+  std::string path = regionName(model_name) + ".model";
+  model->store(path);
+  for (auto _ : state) {
+    state.PauseTiming();
+    auto loaded = createModel(model_name, num_features, NUM_POLICIES);
+    state.ResumeTiming();
+    loaded->load(path);
+  }
+  state.SetBytesProcessed(state.iterations() * fileSize(path));
+  std::remove(path.c_str());
+}
+
+// Appending a record to a binary trace, the per-execution cost of
+// APOLLO_TRACE_BINARY.
+static void BM_TraceWrite(benchmark::State &state)
+{
+  int num_features = state.range(0);
+  Rows rows = makeRows(NUM_ROWS, num_features, NUM_POLICIES);
+  std::string prefix = regionName("trace");
+  uint64_t idx = 0;
+  {
+    TraceWriter writer(prefix, 0);
+    uint32_t region_id = writer.addRegion(prefix,
+                                          "Static",
+                                          "Static,policy=0",
+                                          num_features);
+    uint32_t model_id = writer.getModelId("Static");
+    for (auto _ : state) {
+      size_t row = idx % NUM_ROWS;
+      writer.write(region_id,
+                   model_id,
+                   idx++,
+                   &rows.features[row * num_features],
+                   num_features,
+                   rows.policies[row],
+                   rows.metrics[row]);
+    }
+  }
+  state.SetItemsProcessed(state.iterations());
+  std::remove((prefix + ".bin").c_str());
+  std::remove((prefix + ".dict").c_str());
+}
+
+int main(int argc, char *argv[])
+{
+  benchmark::Initialize(&argc, argv);
+  if (benchmark::ReportUnrecognizedArguments(argc, argv)) return 1;
+
+  // Apollo reads its configuration once, so execution overheads with tracing
+  // are measured by runs with APOLLO_TRACE_CSV or APOLLO_TRACE_BINARY set.
+  Apollo::instance();
+  std::string trace = "none";
+  if (Config::APOLLO_TRACE_BINARY)
+    trace = "binary";
+  else if (Config::APOLLO_TRACE_CSV)
+    trace = "csv";
+  benchmark::AddCustomContext("apollo_trace", trace);
+
+  for (auto &model_name : MODELS) {
+    benchmark::RegisterBenchmark(
+        ("BM_Execution/" + model_name).c_str(), BM_Execution, model_name)
+        ->ArgName("features")
+        ->Arg(1)
+        ->Arg(4)
+        ->Arg(16);
+    benchmark::RegisterBenchmark(
+        ("BM_PolicyIndices/" + model_name).c_str(),
+        BM_PolicyIndices,
+        model_name)
+        ->ArgName("features")
+        ->Arg(4);
+  }
+
+  benchmark::RegisterBenchmark("BM_DatasetInsert", BM_DatasetInsert)
+      ->ArgNames({"rows", "features"})
+      ->ArgsProduct({{1 << 10, 1 << 14, 1 << 18}, {1, 4, 16}});
+
+  for (bool binary : {false, true}) {
+    std::string format = (binary ? "binary" : "yaml");
+    benchmark::RegisterBenchmark(
+        ("BM_DatasetStore/" + format).c_str(), BM_DatasetStore, binary)
+        ->ArgName("rows")
+        ->Arg(1 << 14)
+        ->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark(
+        ("BM_DatasetLoad/" + format).c_str(), BM_DatasetLoad, binary)
+        ->ArgName("rows")
+        ->Arg(1 << 14)
+        ->Unit(benchmark::kMicrosecond);
+  }
+
+  for (auto &model_name : TRAINED_MODELS) {
+    benchmark::RegisterBenchmark(
+        ("BM_Train/" + model_name).c_str(), BM_Train, model_name)
+        ->ArgNames({"rows", "features", "policies"})
+        ->ArgsProduct({{1 << 10, 1 << 14}, {4, 16}, {4, 16}})
+        ->Unit(benchmark::kMillisecond);
+    benchmark::RegisterBenchmark(
+        ("BM_ModelStore/" + model_name).c_str(), BM_ModelStore, model_name)
+        ->ArgName("rows")
+        ->Arg(1 << 14)
+        ->Unit(benchmark::kMicrosecond);
+    benchmark::RegisterBenchmark(
+        ("BM_ModelLoad/" + model_name).c_str(), BM_ModelLoad, model_name)
+        ->ArgName("rows")
+        ->Arg(1 << 14)
+        ->Unit(benchmark::kMicrosecond);
+  }
+
+  benchmark::RegisterBenchmark("BM_TraceWrite", BM_TraceWrite)
+      ->ArgName("features")
+      ->Arg(4)
+      ->Arg(16);
+
+  benchmark::RunSpecifiedBenchmarks();
+  benchmark::Shutdown();
+
+  return 0;
+}
@@ -7,6 +7,7 @@
 
 #include <chrono>
 #include <iostream>
+#include <string>
 
 #include "apollo/Apollo.h"
 #include "apollo/Region.h"
@@ -16,7 +17,7 @@ int main(int argc, char *argv[])
   if (argc < 5) {
     std::cerr << "Usage: ./apollo-overhead <num features> <num policies> <num "
                  "training "
-                 "data> <reps>\n";
+                 "data> <reps> [model info]\n";
     return 1;
   }
 
@@ -28,6 +29,7 @@ int main(int argc, char *argv[])
   unsigned NUM_POLICIES = atoi(argv[2]);
   unsigned NUM_TRAINING_DATA = atoi(argv[3]);
   unsigned REPS = atoi(argv[4]);
+  std::string MODEL_INFO = (argc > 5 ? argv[5] : "DecisionTree,max_depth=2");
 
   if (NUM_TRAINING_DATA > REPS) {
     std::cerr << "NUM_TRAINING_DATA " << NUM_TRAINING_DATA
@@ -43,7 +45,7 @@ int main(int argc, char *argv[])
                                          "test-overhead",
                                          NUM_POLICIES,
                                          /* min_training_data */ 0,
-                                         "DecisionTree,max_depth=2");
+                                         MODEL_INFO);
 
   auto start = std::chrono::steady_clock::now();
 
@@ -0,0 +1,97 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <thread>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 1
+#define NUM_POLICIES 4
+#define NUM_VALUES 4
+#define MIN_TRAINING_DATA (NUM_VALUES * NUM_POLICIES)
+#define MAX_WAIT_MS 10000
+
+// Executes the region once with feature value, the best policy of a value
+// is value % NUM_POLICIES. Returns the duration of end() in ms.
+static double execute(Apollo::Region *r, int value)
+{
+  Apollo::RegionContext *context = r->begin();
+  r->setFeature(context, float(value));
+  int policy = r->getPolicyIndex(context);
+  double metric = (policy == value % NUM_POLICIES ? 1.0 : 2.0);
+
+  auto start = std::chrono::steady_clock::now();
+  r->end(context, metric);
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count() * 1e3;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo asynchronous training\n";
+
+  setenv("APOLLO_ASYNC_TRAINING", "1", 1);
+  Apollo::instance();
+
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-async-training",
+                                         NUM_POLICIES,
+                                         MIN_TRAINING_DATA,
+                                         "DecisionTree,max_depth=3,explore=RoundRobin");
+
+  bool passed = true;
+
+  // Round-robin exploration covers every (value, policy) pair, the last
+  // execution triggers training.
+  double max_end = 0;
+  for (int i = 0; i < MIN_TRAINING_DATA; ++i)
+    max_end = std::max(max_end, execute(r, (i / NUM_POLICIES) % NUM_VALUES));
+
+  // Execution continues with the exploring model until the trained model is
+  // installed.
+  int executions = 0;
+  auto start = std::chrono::steady_clock::now();
+  while (r->model->isTrainable()) {
+    execute(r, executions++ % NUM_VALUES);
+    if (std::chrono::steady_clock::now() - start >
+        std::chrono::milliseconds(MAX_WAIT_MS))
+      break;
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  std::cout << "Max end() " << max_end << " ms, installed after " << executions
+            << " executions\n";
+
+  if (r->model->isTrainable()) {
+    std::cout << "Trained model was not installed\n";
+    passed = false;
+  }
+
+  for (int value = 0; value < NUM_VALUES; ++value) {
+    Apollo::RegionContext *context = r->begin();
+    r->setFeature(context, float(value));
+    int policy = r->getPolicyIndex(context);
+    r->end(context, 1.0);
+    if (policy != value % NUM_POLICIES) {
+      std::cout << "Value " << value << " policy " << policy << " expected "
+                << value % NUM_POLICIES << "\n";
+      passed = false;
+    }
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
@@ -0,0 +1,118 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 1
+#define NUM_POLICIES 4
+#define NUM_VALUES 4
+#define TRAIN_PERIOD 100
+#define BATCH_SIZE 60
+
+// Records a batch of BATCH_SIZE executions covering every (value, policy)
+// pair, the best policy of a value is value % NUM_POLICIES.
+static void recordBatch(Apollo::Region *r)
+{
+  std::vector<float> features(BATCH_SIZE);
+  std::vector<int> policies(BATCH_SIZE);
+  std::vector<double> metrics(BATCH_SIZE);
+  for (int i = 0; i < BATCH_SIZE; ++i) {
+    int value = (i / NUM_POLICIES) % NUM_VALUES;
+    features[i] = float(value);
+    policies[i] = i % NUM_POLICIES;
+    metrics[i] = (policies[i] == value % NUM_POLICIES ? 1.0 : 2.0);
+  }
+  r->recordBatch(features.data(), policies.data(), metrics.data(), BATCH_SIZE);
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo batched measurements\n";
+
+  setenv("APOLLO_PER_REGION_TRAIN_PERIOD",
+         std::to_string(TRAIN_PERIOD).c_str(),
+         1);
+  setenv("APOLLO_PROFILE", "1", 1);
+  Apollo *apollo = Apollo::instance();
+
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-batch",
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         "DecisionTree,max_depth=3,explore=RoundRobin");
+
+  bool passed = true;
+
+  // The first batch stays below the training period.
+  recordBatch(r);
+  std::cout << "Executions " << r->idx << " dataset size " << r->dataset.size()
+            << "\n";
+  if (r->idx != BATCH_SIZE || r->dataset.size() != NUM_VALUES * NUM_POLICIES ||
+      !r->model->isTrainable()) {
+    std::cout << "First batch did not record without training\n";
+    passed = false;
+  }
+
+  // The second batch crosses the training period without ending on it.
+  recordBatch(r);
+  if (r->idx != 2 * BATCH_SIZE || r->model->isTrainable()) {
+    std::cout << "Second batch did not trigger training\n";
+    passed = false;
+  }
+
+  std::vector<float> features;
+  for (int value = 0; value < NUM_VALUES; ++value)
+    features.push_back(float(value));
+  std::vector<int> policies(NUM_VALUES);
+  r->getPolicyIndices(features.data(), NUM_VALUES, policies.data());
+  for (int value = 0; value < NUM_VALUES; ++value)
+    if (policies[value] != value % NUM_POLICIES) {
+      std::cout << "Value " << value << " policy " << policies[value]
+                << " expected " << value % NUM_POLICIES << "\n";
+      passed = false;
+    }
+
+  // The profile counts the batches as executions and the training.
+  std::stringstream profile;
+  apollo->writeProfile(profile);
+  std::string line;
+  std::getline(profile, line);
+  std::getline(profile, line);
+  std::cout << "Profile " << line << "\n";
+  std::vector<std::string> columns;
+  std::stringstream ss(line);
+  std::string column;
+  while (std::getline(ss, column, ','))
+    columns.push_back(column);
+  // region, executions, collect_ns, policies, policy_ns, trainings, ...
+  if (columns.size() < 6 || columns[0] != "test-batch" ||
+      columns[1] != std::to_string(2 * BATCH_SIZE) || columns[5] != "1") {
+    std::cout << "Profile did not count the batches and training\n";
+    passed = false;
+  }
+  // The model size is that of the model serialized, without training data.
+  std::stringstream model;
+  size_t model_bytes = (r->model->serialize(model) ? model.str().size() : 0);
+  if (columns.size() < 11 || columns[10] != std::to_string(model_bytes)) {
+    std::cout << "Profile model size differs from the serialized model\n";
+    passed = false;
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
@@ -0,0 +1,100 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+// Generated by apollo-export from the stored models in test/models.
+#include "compiled-test_dtree.h"
+#include "compiled-test_forest.h"
+
+#define NUM_FEATURES 2
+#define NUM_POLICIES 4
+
+static int getPolicy(Apollo::Region *r, float x, float y)
+{
+  Apollo::RegionContext *context = r->begin();
+  r->setFeature(context, x);
+  r->setFeature(context, y);
+  int policy = r->getPolicyIndex(context);
+  r->end(context);
+  return policy;
+}
+
+// Compiled models must select the same policies as the stored models they
+// were exported from.
+static bool compare(const std::string &model_name,
+                    const std::string &compiled_name)
+{
+  std::string model_file =
+      std::string(APOLLO_TEST_MODELS_DIR) + "/" + model_name + "-compiled.yaml";
+  Apollo::Region *stored =
+      new Apollo::Region(NUM_FEATURES,
+                         ("stored-" + model_name).c_str(),
+                         NUM_POLICIES,
+                         /* min_training_data */ 0,
+                         model_name + ",load=" + model_file);
+  Apollo::Region *compiled =
+      new Apollo::Region(NUM_FEATURES,
+                         ("compiled-" + model_name).c_str(),
+                         NUM_POLICIES,
+                         /* min_training_data */ 0,
+                         "Compiled,name=" + compiled_name);
+
+  int mismatches = 0;
+  std::vector<float> features;
+  std::vector<int> policies;
+  for (float x = -1; x <= 9; x += 0.25)
+    for (float y = -1; y <= 9; y += 0.25) {
+      int policy = getPolicy(stored, x, y);
+      if (policy != getPolicy(compiled, x, y)) ++mismatches;
+      features.push_back(x);
+      features.push_back(y);
+      policies.push_back(policy);
+    }
+
+  // Batched queries must select the same policies.
+  int batch_mismatches = 0;
+  std::vector<int> batch_policies(policies.size());
+  stored->getPolicyIndices(
+      features.data(), policies.size(), batch_policies.data());
+  for (size_t i = 0; i < policies.size(); ++i)
+    if (batch_policies[i] != policies[i]) ++batch_mismatches;
+
+  std::cout << model_name << " mismatches " << mismatches
+            << " batch mismatches " << batch_mismatches << "\n";
+
+  return mismatches == 0 && batch_mismatches == 0;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo compiled models\n";
+
+  Apollo::instance();
+
+  bool passed = true;
+  passed &= compare("DecisionTree", "test_dtree");
+  passed &= compare("RandomForest", "test_forest");
+
+  std::vector<float> features = {2, 6};
+  if (apollo::compiled::test_dtree::evaluate(features.data()) != 2) {
+    std::cout << "Expected policy 2 for features [2, 6]\n";
+    passed = false;
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
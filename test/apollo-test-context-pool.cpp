@@ -0,0 +1,83 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <new>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+#include "timers/TimerMockAsync.h"
+
+#define NUM_FEATURES 2
+#define NUM_POLICIES 4
+#define WARMUP 100
+#define REPS 10000
+
+// Count heap allocations to verify the steady-state begin/end path.
+static std::atomic<unsigned long> num_allocations(0);
+
+void *operator new(std::size_t size)
+{
+  num_allocations++;
+  void *ptr = std::malloc(size);
+  if (!ptr) throw std::bad_alloc();
+  return ptr;
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, std::size_t) noexcept { std::free(ptr); }
+
+static void run(Apollo::Region *r, int reps)
+{
+  for (int i = 0; i < reps; ++i) {
+    Apollo::RegionContext *context =
+        r->begin(Apollo::Region::TIMING_MOCK_ASYNC);
+    r->setFeature(context, float(i % NUM_POLICIES));
+    r->setFeature(context, float(i % 3));
+    r->getPolicyIndex(context);
+    r->end(context);
+  }
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo context pool\n";
+
+  Apollo::instance();
+
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-context-pool",
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         "DecisionTree,max_depth=2");
+  r->reserveContexts(Apollo::Region::TIMING_MOCK_ASYNC, 4);
+
+  // Warm up to populate the dataset keys and the context pool.
+  run(r, WARMUP);
+
+  unsigned long allocations = num_allocations;
+  unsigned long timers = TimerMockAsync::num_created;
+
+  run(r, REPS);
+
+  allocations = num_allocations - allocations;
+  timers = TimerMockAsync::num_created - timers;
+
+  std::cout << "Steady-state allocations " << allocations
+            << " timer creations " << timers << " over " << REPS
+            << " iterations\n";
+
+  if (allocations == 0 && timers == 0)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
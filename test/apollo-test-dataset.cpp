@@ -0,0 +1,249 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Dataset.h"
+#include "apollo/FeatureMap.h"
+
+#define NUM_FEATURES 4
+#define NUM_POLICIES 4
+#define NUM_ROWS 100000
+#define NUM_METRICS 3
+#define NUM_MULTI_ROWS 1000
+
+template <typename F>
+static double timeIt(F f)
+{
+  auto start = std::chrono::steady_clock::now();
+  f();
+  auto end = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(end - start).count() * 1e3;
+}
+
+static bool sameMetrics(const Apollo::Dataset &a, const Apollo::Dataset &b)
+{
+  if (a.size() != b.size() || a.getNumMetrics() != b.getNumMetrics())
+    return false;
+  for (size_t row = 0; row < a.size(); ++row)
+    for (int i = 0; i < a.getNumMetrics(); ++i)
+      if (a.getMetric(row, i) != b.getMetric(row, i)) return false;
+  return a.toVectorOfTuples() == b.toVectorOfTuples();
+}
+
+// Returns the policy selected for the single features of dataset.
+static int selectPolicy(const Apollo::Dataset &dataset)
+{
+  std::vector<std::vector<float>> features;
+  std::vector<int> policies;
+  std::map<std::vector<float>, std::pair<int, double>> min_metric_policies;
+  dataset.findMinMetricPolicyByFeatures(features,
+                                        policies,
+                                        min_metric_policies);
+  return (policies.size() == 1 ? policies[0] : -1);
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo dataset formats\n";
+
+  bool passed = true;
+
+  // Values are exactly representable in the YAML text output.
+  Apollo::Dataset dataset;
+  std::vector<float> features(NUM_FEATURES);
+  for (int i = 0; i < NUM_ROWS; ++i) {
+    for (int j = 0; j < NUM_FEATURES; ++j)
+      features[j] = float((i >> (4 * j)) % 16);
+    dataset.insert(features, i % NUM_POLICIES, double(i % 1000));
+  }
+
+  const char *binary_file = "apollo-test-dataset.bin";
+  const char *yaml_file = "apollo-test-dataset.yaml";
+
+  double binary_store = timeIt([&]() { dataset.storeBinary(binary_file); });
+  double yaml_store = timeIt([&]() {
+    std::ofstream ofs(yaml_file);
+    dataset.store(ofs);
+  });
+
+  Apollo::Dataset binary_dataset;
+  double binary_load =
+      timeIt([&]() { binary_dataset.loadBinary(binary_file); });
+
+  Apollo::Dataset yaml_dataset;
+  double yaml_load = timeIt([&]() {
+    std::ifstream ifs(yaml_file);
+    yaml_dataset.load(ifs);
+  });
+
+  std::cout << "Rows " << dataset.size() << " binary store " << binary_store
+            << " ms load " << binary_load << " ms, yaml store " << yaml_store
+            << " ms load " << yaml_load << " ms\n";
+
+  auto expected = dataset.toVectorOfTuples();
+  if (binary_dataset.toVectorOfTuples() != expected) {
+    std::cout << "Binary dataset differs\n";
+    passed = false;
+  }
+  if (yaml_dataset.toVectorOfTuples() != expected) {
+    std::cout << "YAML dataset differs\n";
+    passed = false;
+  }
+
+  // Loading into a dataset of a different width must fail.
+  Apollo::Dataset other;
+  other.insert(std::vector<float>(NUM_FEATURES + 1), 0, 1.0);
+  try {
+    other.loadBinary(binary_file);
+    std::cout << "Expected a feature width mismatch error\n";
+    passed = false;
+  } catch (std::runtime_error &e) {
+  }
+
+  // Truncated files must fail.
+  {
+    std::ofstream ofs(binary_file, std::ios::binary | std::ios::trunc);
+    ofs << "APOLLODS";
+  }
+  try {
+    Apollo::Dataset truncated;
+    truncated.loadBinary(binary_file);
+    std::cout << "Expected a truncated file error\n";
+    passed = false;
+  } catch (std::runtime_error &e) {
+  }
+
+  // Rows of multiple metrics round-trip both formats.
+  Apollo::Dataset multi;
+  for (int i = 0; i < NUM_MULTI_ROWS; ++i) {
+    for (int j = 0; j < NUM_FEATURES; ++j)
+      features[j] = float((i >> (4 * j)) % 16);
+    multi.insert(features,
+                 i % NUM_POLICIES,
+                 std::vector<double>{double(i), double(i % 7), 0.5});
+  }
+  multi.storeBinary(binary_file);
+  {
+    std::ofstream ofs(yaml_file);
+    multi.store(ofs);
+  }
+  Apollo::Dataset multi_binary, multi_yaml;
+  multi_binary.loadBinary(binary_file);
+  std::ifstream multi_ifs(yaml_file);
+  multi_yaml.load(multi_ifs);
+  if (multi.getNumMetrics() != NUM_METRICS ||
+      !sameMetrics(multi, multi_binary) || !sameMetrics(multi, multi_yaml)) {
+    std::cout << "Dataset of multiple metrics differs\n";
+    passed = false;
+  }
+
+  // Regions without features have rows of policy and metrics only.
+  Apollo::Dataset no_features;
+  for (int policy = 0; policy < NUM_POLICIES; ++policy)
+    no_features.insert(std::vector<float>(), policy, double(policy));
+  {
+    std::ofstream ofs(yaml_file);
+    no_features.store(ofs);
+  }
+  Apollo::Dataset no_features_yaml;
+  std::ifstream no_features_ifs(yaml_file);
+  no_features_yaml.load(no_features_ifs);
+  if (no_features.size() != NUM_POLICIES ||
+      no_features_yaml.toVectorOfTuples() != no_features.toVectorOfTuples()) {
+    std::cout << "Dataset without features differs\n";
+    passed = false;
+  }
+
+  // Rows must have the same number of metrics.
+  try {
+    multi.insert(features, 0, 1.0);
+    std::cout << "Expected a metrics width mismatch error\n";
+    passed = false;
+  } catch (std::runtime_error &e) {
+  }
+
+  std::remove(binary_file);
+  std::remove(yaml_file);
+
+  // Objectives select different policies of the same (time, energy) rows.
+  // Policy 3 is dominated by policy 1.
+  Apollo::Dataset objective_dataset;
+  std::vector<float> objective_features(NUM_FEATURES, 0.0f);
+  const double time_energy[NUM_POLICIES][2] = {
+      {1, 10}, {2, 2}, {10, 1}, {3, 3}};
+  for (int policy = 0; policy < NUM_POLICIES; ++policy)
+    objective_dataset.insert(objective_features,
+                             policy,
+                             std::vector<double>(time_energy[policy],
+                                                 time_energy[policy] + 2));
+  const std::vector<std::pair<Apollo::Dataset::Objective, int>> objectives = {
+      {Apollo::Dataset::Objective(), 0},
+      {Apollo::Dataset::Objective::parse("weighted", "0:1"), 2},
+      {Apollo::Dataset::Objective::parse("weighted", "1:1"), 1},
+      {Apollo::Dataset::Objective::parse("pareto", ""), 1},
+      {Apollo::Dataset::Objective::parse("pareto", "1:0"), 0}};
+  for (auto &objective : objectives) {
+    objective_dataset.setObjective(objective.first);
+    int policy = selectPolicy(objective_dataset);
+    if (policy != objective.second) {
+      std::cout << "Objective selected policy " << policy << " expected "
+                << objective.second << "\n";
+      passed = false;
+    }
+  }
+  try {
+    Apollo::Dataset::Objective::parse("weighted", "1:x");
+    std::cout << "Expected an objective weights error\n";
+    passed = false;
+  } catch (std::runtime_error &e) {
+  }
+
+  // FeatureMap lookups match the rows inserted, -0.0 and 0.0 are one key.
+  apollo::FeatureMap<int> feature_map;
+  for (int i = 0; i < NUM_ROWS; ++i) {
+    for (int j = 0; j < NUM_FEATURES; ++j)
+      features[j] = float((i >> (4 * j)) % 16);
+    feature_map.insert(apollo::FeatureKey(features), i);
+  }
+  for (int i = 0; i < NUM_ROWS; ++i) {
+    for (int j = 0; j < NUM_FEATURES; ++j)
+      features[j] = float((i >> (4 * j)) % 16);
+    const int *value = feature_map.find(apollo::FeatureKey(features));
+    // Rows repeat every 16^NUM_FEATURES, the last insertion wins.
+    if (!value || *value % (1 << (4 * NUM_FEATURES)) !=
+                      i % (1 << (4 * NUM_FEATURES))) {
+      std::cout << "FeatureMap lookup mismatch at row " << i << "\n";
+      passed = false;
+      break;
+    }
+  }
+  std::vector<float> zero(NUM_FEATURES, 0.0f);
+  std::vector<float> negative_zero(NUM_FEATURES, -0.0f);
+  std::vector<float> missing(NUM_FEATURES, 16.0f);
+  if (feature_map.find(apollo::FeatureKey(zero)) !=
+          feature_map.find(apollo::FeatureKey(negative_zero)) ||
+      feature_map.find(apollo::FeatureKey(missing)) != nullptr) {
+    std::cout << "FeatureMap key equality differs\n";
+    passed = false;
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
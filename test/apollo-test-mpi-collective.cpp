@@ -0,0 +1,212 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <mpi.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Dataset.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 1
+#define NUM_POLICIES 4
+#define REPS 4
+// Regions of measurements inserted directly, region k has k + 2 features and
+// 2 metrics.
+#define NUM_DATA_REGIONS 3
+#define NUM_METRICS 2
+// Seconds to wait for a non-blocking exchange to install the model.
+#define INSTALL_TIMEOUT 60
+
+// Features of the row inserted by rank before the first train call, and of
+// the row inserted after the last one.
+static const float rank_feature = 100;
+static const float finalize_feature = 1000;
+
+static void execute(Apollo::Region *r, int feature)
+{
+  r->begin();
+  r->setFeature(float(feature));
+  r->getPolicyIndex();
+  r->end();
+}
+
+// Row j of rank in data region k, ranks insert (rank + k) % 3 rows so some
+// regions are empty on some ranks. Rows are distinct across ranks.
+static std::vector<double> getRow(int k, int rank, int j)
+{
+  std::vector<double> row;
+  for (int i = 0; i < k + 2; ++i)
+    row.push_back(rank * 100 + j * 10 + i);
+  row.push_back((rank + j) % NUM_POLICIES);
+  row.push_back(rank + j * 0.25);
+  row.push_back(-(rank * 10 + j));
+  return row;
+}
+
+static int getNumRows(int k, int rank) { return (rank + k) % 3; }
+
+// Returns the rows of dataset as features, policy, metrics, sorted.
+static std::vector<std::vector<double>> getRows(const Apollo::Dataset &dataset)
+{
+  std::vector<std::vector<double>> rows;
+  for (size_t i = 0; i < dataset.size(); ++i) {
+    const float *features = dataset.getFeatures(i);
+    std::vector<double> row(features, features + dataset.getNumFeatures());
+    row.push_back(dataset.getPolicy(i));
+    for (int m = 0; m < dataset.getNumMetrics(); ++m)
+      row.push_back(dataset.getMetric(i, m));
+    rows.push_back(row);
+  }
+  std::sort(rows.begin(), rows.end());
+  return rows;
+}
+
+// Returns the number of rows of dataset with the given first feature.
+static int countRows(const Apollo::Dataset &dataset, float feature)
+{
+  int count = 0;
+  for (size_t i = 0; i < dataset.size(); ++i)
+    if (dataset.getFeatures(i)[0] == feature) ++count;
+  return count;
+}
+
+// Collective training of a region, with the strategy of
+// APOLLO_COLLECTIVE_STRATEGY (iallgather by default). Non-blocking exchanges
+// install the model on a later begin() call, and an exchange still pending
+// completes at MPI_Finalize. Hierarchical training reduces the rows of every
+// rank to rank 0, run with APOLLO_RANKS_PER_NODE=1 to reduce across leaders
+// on a single node. The datasets of every region hold the rows of all ranks
+// after the exchange.
+int main()
+{
+  setenv("APOLLO_COLLECTIVE_TRAINING", "1", 1);
+  setenv("APOLLO_LOCAL_TRAINING", "0", 1);
+  setenv("APOLLO_COLLECTIVE_STRATEGY", "iallgather", 0);
+  std::string strategy = getenv("APOLLO_COLLECTIVE_STRATEGY");
+  bool non_blocking = (strategy == "iallgather");
+  bool hierarchical = (strategy == "hierarchical");
+
+  MPI_Init(NULL, NULL);
+
+  int rank, size;
+  MPI_Comm_rank(MPI_COMM_WORLD, &rank);
+  MPI_Comm_size(MPI_COMM_WORLD, &size);
+
+  // Failures of this rank.
+  std::stringstream out;
+  bool passed = true;
+
+  Apollo *apollo = Apollo::instance();
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-collective",
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         "DecisionTree,max_depth=3");
+
+  for (int n = 0; n < REPS; n++)
+    for (int feature = 0; feature < NUM_POLICIES; feature++)
+      execute(r, feature);
+  r->dataset.insert({rank_feature + rank}, 0, 1.0);
+
+  std::vector<Apollo::Region *> data_regions;
+  for (int k = 0; k < NUM_DATA_REGIONS; ++k) {
+    std::string name = "test-collective-data-" + std::to_string(k);
+    Apollo::Region *data_region =
+        new Apollo::Region(k + 2,
+                           name.c_str(),
+                           NUM_POLICIES,
+                           /* min_training_data */ 0,
+                           "DecisionTree,max_depth=3");
+    for (int j = 0; j < getNumRows(k, rank); ++j) {
+      std::vector<double> row = getRow(k, rank, j);
+      std::vector<float> features(row.begin(), row.begin() + k + 2);
+      std::vector<double> metrics(row.end() - NUM_METRICS, row.end());
+      data_region->dataset.insert(features, int(row[k + 2]), metrics);
+    }
+    data_regions.push_back(data_region);
+  }
+
+  apollo->train(0);
+  if (non_blocking == !r->model->isTrainable()) {
+    out << "rank " << rank << " model installed "
+        << (non_blocking ? "within" : "after") << " the train call\n";
+    passed = false;
+  }
+
+  // Executions progress the exchange until the model is installed.
+  auto start = std::chrono::steady_clock::now();
+  int executions = 0;
+  while (r->model->isTrainable() &&
+         std::chrono::steady_clock::now() - start <
+             std::chrono::seconds(INSTALL_TIMEOUT)) {
+    execute(r, executions % NUM_POLICIES);
+    executions++;
+  }
+  if (r->model->isTrainable()) {
+    out << "rank " << rank << " model not installed after " << executions
+        << " executions\n";
+    passed = false;
+  }
+
+  // Only rank 0 holds the combined dataset of hierarchical training.
+  if (!hierarchical || rank == 0)
+    for (int i = 0; i < size; ++i)
+      if (countRows(r->dataset, rank_feature + i) != 1) {
+        out << "rank " << rank << " missing the row of rank " << i << "\n";
+        passed = false;
+      }
+
+  if (!hierarchical || rank == 0)
+    for (int k = 0; k < NUM_DATA_REGIONS; ++k) {
+      std::vector<std::vector<double>> expected;
+      for (int i = 0; i < size; ++i)
+        for (int j = 0; j < getNumRows(k, i); ++j)
+          expected.push_back(getRow(k, i, j));
+      std::sort(expected.begin(), expected.end());
+      std::vector<std::vector<double>> rows =
+          getRows(data_regions[k]->dataset);
+      if (rows != expected) {
+        out << "rank " << rank << " data region " << k << " has "
+            << rows.size() << " rows, expected " << expected.size() << "\n";
+        passed = false;
+      }
+    }
+
+  // The exchange of the last train call is left pending, no execution
+  // progresses it before MPI_Finalize.
+  if (non_blocking) {
+    r->dataset.insert({finalize_feature + rank}, 0, 1.0);
+    apollo->train(1);
+    for (int i = 0; i < size; ++i)
+      if (i != rank && countRows(r->dataset, finalize_feature + i) != 0) {
+        out << "rank " << rank << " exchange completed before MPI_Finalize\n";
+        passed = false;
+        break;
+      }
+  }
+
+  MPI_Finalize();
+
+  if (non_blocking)
+    for (int i = 0; i < size; ++i)
+      if (countRows(r->dataset, finalize_feature + i) != 1) {
+        out << "rank " << rank << " exchange incomplete after MPI_Finalize\n";
+        passed = false;
+        break;
+      }
+
+  out << (passed ? "PASSED\n" : "FAILED\n");
+  std::cout << out.str();
+
+  return 0;
+}
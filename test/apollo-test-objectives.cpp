@@ -0,0 +1,124 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 1
+#define NUM_POLICIES 3
+#define NUM_VALUES 2
+#define NUM_METRICS 2
+
+// Time and energy of policies, the same for every value. Policy 0 is the
+// fastest, policy 2 the most energy efficient and policy 1 the compromise.
+static const double time_energy[NUM_POLICIES][NUM_METRICS] = {{1, 10},
+                                                              {2, 2},
+                                                              {10, 1}};
+
+// Records the same measurements of every (value, policy) pair.
+static void recordBatch(Apollo::Region *r)
+{
+  std::vector<float> features;
+  std::vector<int> policies;
+  std::vector<double> metrics;
+  for (int value = 0; value < NUM_VALUES; ++value)
+    for (int policy = 0; policy < NUM_POLICIES; ++policy) {
+      features.push_back(float(value));
+      policies.push_back(policy);
+      metrics.insert(metrics.end(),
+                     time_energy[policy],
+                     time_energy[policy] + NUM_METRICS);
+    }
+  r->recordBatch(features.data(),
+                 policies.data(),
+                 metrics.data(),
+                 policies.size(),
+                 NUM_METRICS);
+}
+
+// Trains region_name with the objective params of model_info on the
+// measurements and checks the policy selected for every value.
+static bool checkObjective(const char *region_name,
+                           const std::string &model_info,
+                           int expected)
+{
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         region_name,
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         model_info);
+  recordBatch(r);
+  r->train(0);
+
+  std::vector<float> features;
+  for (int value = 0; value < NUM_VALUES; ++value)
+    features.push_back(float(value));
+  std::vector<int> policies(NUM_VALUES);
+  r->getPolicyIndices(features.data(), NUM_VALUES, policies.data());
+
+  bool passed = true;
+  for (int value = 0; value < NUM_VALUES; ++value)
+    if (policies[value] != expected) {
+      std::cout << "Region " << region_name << " value " << value
+                << " policy " << policies[value] << " expected " << expected
+                << "\n";
+      passed = false;
+    }
+  return passed;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo multi-objective policy selection\n";
+
+  Apollo::instance();
+
+  bool passed = true;
+
+  passed &= checkObjective("test-objective-time", "DecisionTree", 0);
+  passed &= checkObjective("test-objective-energy",
+                           "DecisionTree,max_depth=2,weights=0:1",
+                           2);
+  passed &= checkObjective("test-objective-weighted",
+                           "DecisionTree,objective=weighted,weights=1:1",
+                           1);
+  passed &= checkObjective("test-objective-pareto",
+                           "RandomForest,num_trees=4,objective=pareto",
+                           1);
+
+  // Executions record metric vectors.
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-objective-end",
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         "DecisionTree,explore=RoundRobin,objective=pareto");
+  for (int i = 0; i < NUM_POLICIES; ++i) {
+    Apollo::RegionContext *context = r->begin();
+    r->setFeature(context, 0);
+    int policy = r->getPolicyIndex(context);
+    r->end(context,
+           std::vector<double>(time_energy[policy],
+                               time_energy[policy] + NUM_METRICS));
+  }
+  if (r->dataset.size() != NUM_POLICIES ||
+      r->dataset.getNumMetrics() != NUM_METRICS ||
+      r->dataset.getMetric(1, 1) != time_energy[1][1]) {
+    std::cout << "Executions did not record the metrics\n";
+    passed = false;
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
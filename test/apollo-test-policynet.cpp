@@ -0,0 +1,182 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <cmath>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "apollo/Dataset.h"
+#include "apollo/FeatureMap.h"
+#include "apollo/ModelFactory.h"
+#include "apollo/models/PolicyNet.h"
+
+#define NUM_FEATURES 2
+#define NUM_POLICIES 4
+// Features are (v, 2 * v) for v < NUM_VALUES, 4 bits fit the maximum of 14.
+#define NUM_VALUES 8
+#define NUM_TRAININGS 4
+
+struct EncodingTest {
+  std::unordered_map<std::string, std::string> model_params;
+  // Inputs before and after fitting the encoder on the first training.
+  int input_size;
+  int fitted_input_size;
+};
+
+static std::vector<float> getFeatures(int value)
+{
+  return {float(value), float(2 * value)};
+}
+
+// Every policy of every value is measured, the best policy of value v is
+// v % NUM_POLICIES.
+static Apollo::Dataset createDataset()
+{
+  Apollo::Dataset dataset;
+  for (int value = 0; value < NUM_VALUES; ++value)
+    for (int policy = 0; policy < NUM_POLICIES; ++policy)
+      dataset.insert(getFeatures(value),
+                     policy,
+                     (policy == value % NUM_POLICIES ? 1.0 : 2.0));
+  return dataset;
+}
+
+static std::unique_ptr<apollo::PolicyNet> createModel(
+    std::unordered_map<std::string, std::string> model_params)
+{
+  std::unique_ptr<apollo::PolicyModel> model =
+      apollo::ModelFactory::createPolicyModel("PolicyNet",
+                                              NUM_FEATURES,
+                                              NUM_POLICIES,
+                                              model_params);
+  return std::unique_ptr<apollo::PolicyNet>(
+      dynamic_cast<apollo::PolicyNet *>(model.release()));
+}
+
+// Returns the action probabilities the model evaluates for features.
+static std::vector<double> getProbabilities(apollo::PolicyNet &model,
+                                            std::vector<float> features)
+{
+  model.getIndex(features);
+  const std::vector<double> *probs =
+      model.actionProbabilityMap.find(apollo::FeatureKey(features));
+  return (probs ? *probs : std::vector<double>());
+}
+
+// Returns true if both models evaluate the same action probabilities for
+// every value, up to float rounding since BLAS kernels may sum in a different
+// order for differently aligned buffers.
+static bool sameProbabilities(apollo::PolicyNet &a, apollo::PolicyNet &b)
+{
+  for (int value = 0; value < NUM_VALUES; ++value) {
+    std::vector<float> features = getFeatures(value);
+    a.getIndex(features);
+    b.getIndex(features);
+    apollo::FeatureKey key(features);
+    const std::vector<double> *a_probs = a.actionProbabilityMap.find(key);
+    const std::vector<double> *b_probs = b.actionProbabilityMap.find(key);
+    if (!a_probs || !b_probs) return false;
+    for (int i = 0; i < NUM_POLICIES; ++i)
+      if (std::fabs((*a_probs)[i] - (*b_probs)[i]) > 1e-6) return false;
+  }
+  return true;
+}
+
+static bool testEncoding(const EncodingTest &test)
+{
+  std::string name = test.model_params.at("encoding");
+  auto it = test.model_params.find("bits");
+  if (it != test.model_params.end()) name += ",bits=" + it->second;
+
+  auto model = createModel(test.model_params);
+  if (model->getInputSize() != test.input_size) {
+    std::cout << name << " input size " << model->getInputSize()
+              << " expected " << test.input_size << "\n";
+    return false;
+  }
+
+  Apollo::Dataset dataset = createDataset();
+  for (int i = 0; i < NUM_TRAININGS; ++i)
+    model->train(dataset);
+  if (model->getInputSize() != test.fitted_input_size) {
+    std::cout << name << " fitted input size " << model->getInputSize()
+              << " expected " << test.fitted_input_size << "\n";
+    return false;
+  }
+
+  std::vector<float> features;
+  for (int value = 0; value < NUM_VALUES; ++value) {
+    std::vector<float> row = getFeatures(value);
+    features.insert(features.end(), row.begin(), row.end());
+  }
+  std::vector<int> policies(NUM_VALUES);
+  model->getIndices(features.data(), NUM_FEATURES, NUM_VALUES, policies.data());
+  for (int policy : policies)
+    if (policy < 0 || policy >= NUM_POLICIES) {
+      std::cout << name << " selected policy " << policy << "\n";
+      return false;
+    }
+
+  // Features beyond the fitted range encode as the nearest bucket.
+  if (test.model_params.at("encoding") == "onehot") {
+    const float huge = 1e30f;
+    if (getProbabilities(*model, {huge, huge}) !=
+            getProbabilities(*model, getFeatures(NUM_VALUES - 1)) ||
+        getProbabilities(*model, {-huge, -huge}) !=
+            getProbabilities(*model, getFeatures(0))) {
+      std::cout << name << " features beyond the range differ\n";
+      return false;
+    }
+  }
+
+  // The loaded model has the fitted encoder and the weights of the stored one.
+  const char *model_file = "apollo-test-policynet.bin";
+  model->store(model_file);
+  auto loaded = createModel(test.model_params);
+  loaded->load(model_file);
+  std::remove(model_file);
+  if (loaded->getInputSize() != test.fitted_input_size ||
+      !sameProbabilities(*model, *loaded)) {
+    std::cout << name << " loaded model differs\n";
+    return false;
+  }
+
+  std::cout << name << " inputs " << test.input_size << " fitted "
+            << model->getInputSize() << "\n";
+  return true;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo PolicyNet feature encodings\n";
+
+  const std::vector<EncodingTest> tests = {
+      {{{"encoding", "binary"}}, NUM_FEATURES * 64, NUM_FEATURES * 64},
+      {{{"encoding", "binary"}, {"bits", "auto"}},
+       NUM_FEATURES * 64,
+       NUM_FEATURES * 4},
+      {{{"encoding", "scalar"}}, NUM_FEATURES, NUM_FEATURES},
+      {{{"encoding", "log"}}, NUM_FEATURES, NUM_FEATURES},
+      {{{"encoding", "onehot"}, {"buckets", "4"}},
+       NUM_FEATURES * 4,
+       NUM_FEATURES * 4}};
+
+  bool passed = true;
+  for (auto &test : tests)
+    passed &= testEncoding(test);
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
@@ -0,0 +1,104 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "apollo/Dataset.h"
+#include "apollo/ModelFactory.h"
+
+#define NUM_FEATURES 2
+#define NUM_POLICIES 4
+#define NUM_CHECKS 100
+#define NUM_ROWS 1000
+#define NUM_ROWS_SCALE 10
+
+// Rows of distinct features, the best policy of row i is i % NUM_POLICIES.
+static Apollo::Dataset createDataset(int num_rows)
+{
+  Apollo::Dataset dataset;
+  std::vector<float> features(NUM_FEATURES);
+  for (int i = 0; i < num_rows; ++i) {
+    features[0] = float(i);
+    features[1] = float(i % NUM_POLICIES);
+    dataset.insert(features, i % NUM_POLICIES, 1.0);
+  }
+  return dataset;
+}
+
+static std::unique_ptr<apollo::PolicyModel> createModel(
+    const std::string &model_name)
+{
+  std::unordered_map<std::string, std::string> model_params;
+  model_params["max_depth"] = "4";
+  return apollo::ModelFactory::createPolicyModel(model_name,
+                                                 NUM_FEATURES,
+                                                 NUM_POLICIES,
+                                                 model_params);
+}
+
+// Returns the size of the model trained on num_rows serialized, 0 if the
+// model does not serialize or its deserialized copy predicts differently.
+static size_t serializedSize(const std::string &model_name, int num_rows)
+{
+  Apollo::Dataset dataset = createDataset(num_rows);
+  auto model = createModel(model_name);
+  model->train(dataset);
+
+  std::stringstream ss;
+  if (!model->serialize(ss)) return 0;
+  size_t size = ss.str().size();
+
+  auto copy = createModel(model_name);
+  if (!copy->deserialize(ss) || copy->isTrainable()) return 0;
+
+  std::vector<float> features(NUM_FEATURES);
+  for (int i = 0; i < num_rows; i += num_rows / NUM_CHECKS) {
+    features[0] = float(i);
+    features[1] = float(i % NUM_POLICIES);
+    if (copy->getIndex(features) != model->getIndex(features)) {
+      std::cout << model_name << " deserialized predicts differently\n";
+      return 0;
+    }
+  }
+  return size;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo model serialization\n";
+
+  bool passed = true;
+
+  // Serialized models carry the tree only, not the training data, which
+  // stays on the rank that trained them.
+  for (const std::string model_name : {"DecisionTree", "RandomForest"}) {
+    size_t size = serializedSize(model_name, NUM_ROWS);
+    size_t scaled_size = serializedSize(model_name, NUM_ROWS * NUM_ROWS_SCALE);
+    std::cout << model_name << " serialized " << NUM_ROWS << " rows " << size
+              << " bytes, " << NUM_ROWS * NUM_ROWS_SCALE << " rows "
+              << scaled_size << " bytes\n";
+#ifndef ENABLE_OPENCV
+    // Trees are bounded by max_depth, only their sample counts grow.
+    if (size == 0 || scaled_size > size + size / 10) {
+      std::cout << model_name << " serialized size grows with the rows\n";
+      passed = false;
+    }
+#endif
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
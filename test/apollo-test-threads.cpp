@@ -0,0 +1,134 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 1
+#define NUM_POLICIES 4
+#define NUM_THREADS 8
+#define REPS 10000
+#define MAX_THREADS 16
+// Threads created and joined over the iterations exceed MAX_THREADS.
+#define CHURN_ITERATIONS 40
+#define CHURN_REPS 100
+
+int main()
+{
+  std::cout << "=== Testing Apollo per-thread execution\n";
+
+  setenv("APOLLO_PER_THREAD_CONTEXTS", "1", 1);
+  setenv("APOLLO_MAX_THREADS", std::to_string(MAX_THREADS).c_str(), 1);
+  Apollo *apollo = Apollo::instance();
+
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         "test-threads",
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         "DecisionTree,max_depth=2");
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < NUM_THREADS; ++t)
+    threads.emplace_back([r, t]() {
+      for (int i = 0; i < REPS; ++i) {
+        Apollo::RegionContext *context = r->begin();
+        r->setFeature(context, float(t));
+        r->getPolicyIndex(context);
+        r->end(context);
+      }
+    });
+
+  for (auto &thread : threads)
+    thread.join();
+
+  auto end = std::chrono::steady_clock::now();
+  double duration = std::chrono::duration<double>(end - start).count();
+
+  // Merges per-thread measurements and trains the model.
+  apollo->train(0);
+
+  std::cout << "Threads " << NUM_THREADS << " executions " << r->idx
+            << " dataset size " << r->dataset.size() << " time "
+            << duration * 1e3 << " ms\n";
+
+  // Each thread executes with its own feature for every policy.
+  bool passed = (r->idx == NUM_THREADS * REPS &&
+                 r->dataset.size() == NUM_THREADS * NUM_POLICIES);
+
+  // Exited threads release their ids, so only threads alive at once count
+  // towards APOLLO_MAX_THREADS.
+  Apollo::Region *churn = new Apollo::Region(NUM_FEATURES,
+                                             "test-threads-churn",
+                                             NUM_POLICIES,
+                                             /* min_training_data */ 0,
+                                             "DecisionTree,max_depth=2");
+  for (int iteration = 0; iteration < CHURN_ITERATIONS; ++iteration) {
+    threads.clear();
+    for (int t = 0; t < NUM_THREADS; ++t)
+      threads.emplace_back([churn, t]() {
+        for (int i = 0; i < CHURN_REPS; ++i) {
+          Apollo::RegionContext *context = churn->begin();
+          churn->setFeature(context, float(t));
+          churn->getPolicyIndex(context);
+          churn->end(context);
+        }
+      });
+    for (auto &thread : threads)
+      thread.join();
+  }
+  churn->collectPendingContexts();
+
+  std::cout << "Threads created " << CHURN_ITERATIONS * NUM_THREADS
+            << " executions " << churn->idx << " dataset size "
+            << churn->dataset.size() << "\n";
+  passed &= (churn->idx == CHURN_ITERATIONS * NUM_THREADS * CHURN_REPS &&
+             churn->dataset.size() == NUM_THREADS * NUM_POLICIES);
+
+  // RoundRobin cycles through the policies under concurrent evaluation.
+  Apollo::Region *round_robin = new Apollo::Region(NUM_FEATURES,
+                                                   "test-threads-round-robin",
+                                                   NUM_POLICIES,
+                                                   /* min_training_data */ 0,
+                                                   "RoundRobin");
+  std::atomic<int> policy_counts[NUM_POLICIES];
+  for (auto &count : policy_counts)
+    count = 0;
+  threads.clear();
+  for (int t = 0; t < NUM_THREADS; ++t)
+    threads.emplace_back([round_robin, &policy_counts, t]() {
+      for (int i = 0; i < REPS; ++i) {
+        Apollo::RegionContext *context = round_robin->begin();
+        round_robin->setFeature(context, float(t));
+        policy_counts[round_robin->getPolicyIndex(context)]++;
+        round_robin->end(context);
+      }
+    });
+  for (auto &thread : threads)
+    thread.join();
+  for (auto &count : policy_counts)
+    if (count != NUM_THREADS * REPS / NUM_POLICIES) {
+      std::cout << "RoundRobin selected a policy " << count << " times\n";
+      passed = false;
+    }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
@@ -0,0 +1,163 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+#include "helpers/TscClock.h"
+#include "timers/TimerPerfEvent.h"
+#include "timers/TimerSync.h"
+#include "timers/TimerTsc.h"
+
+#define SLEEP_MS 20
+// Sleeps overshoot, measurements must be within [SLEEP_MS, MAX_MS].
+#define MAX_MS 100
+// Maximum relative difference of the timers measuring the same interval.
+#define MAX_DIFF 0.05
+
+// Measures the task clock, i.e., CPU time, of a sleep and a busy wait.
+static void measureTaskClock(double &sleep_ms, double &busy_ms)
+{
+  TimerPerfEvent timer(TimerPerfEvent::TASK_CLOCK);
+  double metric;
+  timer.start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(SLEEP_MS));
+  timer.stop();
+  timer.isDone(metric);
+  sleep_ms = metric * 1e3;
+
+  auto start = std::chrono::steady_clock::now();
+  timer.start();
+  while (std::chrono::steady_clock::now() - start <
+         std::chrono::milliseconds(SLEEP_MS))
+    ;
+  timer.stop();
+  timer.isDone(metric);
+  busy_ms = metric * 1e3;
+}
+
+// Checks the metric of synchronous executions of a region created with
+// model_info, a perf_event metric falls back to time if not available.
+static bool checkMetric(const char *region_name,
+                        const std::string &model_info,
+                        TimerPerfEvent::Metric perf_metric)
+{
+  std::string error;
+  bool available = TimerPerfEvent::isAvailable(perf_metric, error);
+  Apollo::Region *r = new Apollo::Region(/* num_features */ 1,
+                                         region_name,
+                                         /* num_policies */ 2,
+                                         /* min_training_data */ 0,
+                                         model_info);
+  std::string expected =
+      (available ? TimerPerfEvent::metricName(perf_metric) : "time");
+  std::cout << "Region " << region_name << " metric " << r->metric
+            << (available ? "" : " (" + error + ")") << "\n";
+
+  Apollo::RegionContext *context = r->begin();
+  bool perf_timer = dynamic_cast<TimerPerfEvent *>(context->timer.get());
+  r->setFeature(context, 0);
+  r->getPolicyIndex(context);
+  r->end(context);
+
+  if (r->metric != expected || perf_timer != available) {
+    std::cout << "Expected metric " << expected << "\n";
+    return false;
+  }
+  return true;
+}
+
+// Measures a sleep with both timers at once.
+static void measureSleep(double &sync_ms, double &tsc_ms)
+{
+  std::unique_ptr<Apollo::Timer> sync =
+      Apollo::Timer::create<Apollo::Timer::Sync>();
+  std::unique_ptr<Apollo::Timer> tsc =
+      Apollo::Timer::create<Apollo::Timer::Tsc>();
+  sync->start();
+  tsc->start();
+  std::this_thread::sleep_for(std::chrono::milliseconds(SLEEP_MS));
+  tsc->stop();
+  sync->stop();
+
+  double metric;
+  sync->isDone(metric);
+  sync_ms = metric * 1e3;
+  tsc->isDone(metric);
+  tsc_ms = metric * 1e3;
+}
+
+int main()
+{
+  std::cout << "=== Testing Apollo timers\n";
+
+  setenv("APOLLO_SYNC_TIMER", "tsc", 1);
+  Apollo::instance();
+
+  bool passed = true;
+
+  double sync_ms, tsc_ms;
+  measureSleep(sync_ms, tsc_ms);
+  std::cout << "Sleep " << SLEEP_MS << " ms, sync " << sync_ms << " ms, tsc "
+            << tsc_ms << " ms (" << (TscClock::useTsc() ? "TSC" : "fallback")
+            << ", " << TscClock::nsPerTick() << " ns per tick)\n";
+  if (sync_ms < SLEEP_MS || sync_ms > MAX_MS || tsc_ms < SLEEP_MS ||
+      tsc_ms > MAX_MS || std::fabs(tsc_ms - sync_ms) > MAX_DIFF * sync_ms) {
+    std::cout << "Timers disagree\n";
+    passed = false;
+  }
+
+  // APOLLO_SYNC_TIMER selects the timer of synchronous executions.
+  Apollo::Region *r = new Apollo::Region(/* num_features */ 1,
+                                         "test-timers",
+                                         /* num_policies */ 2);
+  Apollo::RegionContext *context = r->begin();
+  if (!dynamic_cast<TimerTsc *>(context->timer.get())) {
+    std::cout << "Synchronous execution does not use the TSC timer\n";
+    passed = false;
+  }
+  r->setFeature(context, 0);
+  r->getPolicyIndex(context);
+  r->end(context);
+
+  // The software task clock is available wherever perf_event_open is.
+  std::string error;
+  if (TimerPerfEvent::isAvailable(TimerPerfEvent::TASK_CLOCK, error)) {
+    double sleep_ms, busy_ms;
+    measureTaskClock(sleep_ms, busy_ms);
+    std::cout << "Task clock of sleep " << sleep_ms << " ms, busy wait "
+              << busy_ms << " ms\n";
+    if (sleep_ms > SLEEP_MS / 2 || busy_ms < SLEEP_MS / 2 || busy_ms > MAX_MS) {
+      std::cout << "Task clock does not measure CPU time\n";
+      passed = false;
+    }
+  } else
+    std::cout << "Task clock not available: " << error << "\n";
+
+  passed &= checkMetric("test-metric-task-clock",
+                        "RoundRobin,metric=task_clock",
+                        TimerPerfEvent::TASK_CLOCK);
+  passed &= checkMetric("test-metric-cpi",
+                        "DecisionTree,max_depth=2,metric=cpi",
+                        TimerPerfEvent::CPI);
+  passed &= checkMetric("test-metric-energy",
+                        "Static,policy=1,metric=energy",
+                        TimerPerfEvent::ENERGY);
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}
@@ -0,0 +1,135 @@
+// Copyright (c) 2015-2024, Lawrence Livermore National Security, LLC and other
+// Apollo project developers. Produced at the Lawrence Livermore National
+// Laboratory. See the top-level LICENSE file for details.
+// SPDX-License-Identifier: MIT
+
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "apollo/Apollo.h"
+#include "apollo/Region.h"
+
+#define NUM_FEATURES 2
+#define NUM_POLICIES 4
+#define NUM_THREADS 4
+// Threads exit after every round, their trace buffers are retired.
+#define NUM_ROUNDS 20
+#define REPS 100
+
+static const char *output_dir = "apollo-test-trace-output";
+static const char *region_name = "test-trace";
+static const char *model_info = "DecisionTree,max_depth=2";
+
+// Executes the region from short-lived threads, with per-thread contexts, and
+// both traces enabled.
+static void writeTraces()
+{
+  setenv("APOLLO_TRACE_CSV", "1", 1);
+  setenv("APOLLO_TRACE_BINARY", "1", 1);
+  setenv("APOLLO_OUTPUT_DIR", output_dir, 1);
+  setenv("APOLLO_PER_THREAD_CONTEXTS", "1", 1);
+  Apollo::instance();
+
+  Apollo::Region *r = new Apollo::Region(NUM_FEATURES,
+                                         region_name,
+                                         NUM_POLICIES,
+                                         /* min_training_data */ 0,
+                                         model_info);
+  for (int round = 0; round < NUM_ROUNDS; ++round) {
+    std::vector<std::thread> threads;
+    for (int t = 0; t < NUM_THREADS; ++t)
+      threads.emplace_back([r, round, t]() {
+        for (int i = 0; i < REPS; ++i) {
+          Apollo::RegionContext *context = r->begin();
+          r->setFeature(context, float(t));
+          r->setFeature(context, float(i) / 8);
+          r->getPolicyIndex(context);
+          r->end(context, double(round * REPS + i) / 16);
+        }
+      });
+    for (auto &thread : threads)
+      thread.join();
+  }
+}
+
+// Returns the lines of path after the header, sorted since threads trace
+// concurrently. Drops the first field of every line if skip_first.
+static std::vector<std::string> readTrace(const std::string &path,
+                                          bool skip_first)
+{
+  std::vector<std::string> lines;
+  std::ifstream ifs(path);
+  std::string line;
+  if (!std::getline(ifs, line)) return lines;
+  while (std::getline(ifs, line)) {
+    if (skip_first) line = line.substr(line.find(' ') + 1);
+    lines.push_back(line);
+  }
+  std::sort(lines.begin(), lines.end());
+  return lines;
+}
+
+int main(int argc, char *argv[])
+{
+  // The traces are complete when Apollo is destroyed, they are written by a
+  // child process.
+  if (argc > 1 && std::string(argv[1]) == "write") {
+    writeTraces();
+    return 0;
+  }
+
+  std::cout << "=== Testing Apollo binary trace conversion\n";
+
+  bool passed = true;
+
+  std::string traces_dir = std::string(output_dir) + "/traces";
+  std::string converted_dir = std::string(output_dir) + "/converted";
+  std::system((std::string("rm -rf ") + output_dir).c_str());
+  if (std::system((std::string(argv[0]) + " write").c_str()) != 0) {
+    std::cout << "Writing the traces failed\n";
+    passed = false;
+  }
+  mkdir(converted_dir.c_str(), 0755);
+  if (std::system((std::string(APOLLO_TRACE2CSV) + " " + traces_dir +
+                   "/trace-rank-0.bin " + converted_dir)
+                      .c_str()) != 0) {
+    std::cout << "apollo-trace2csv failed\n";
+    passed = false;
+  }
+
+  // Region traces match, the global traces match but for timestamps, which
+  // are read from different clocks.
+  std::string region_trace = std::string("/trace-") + model_info + "-region-" +
+                             region_name + "-rank-0.csv";
+  auto csv = readTrace(traces_dir + region_trace, false);
+  auto converted = readTrace(converted_dir + region_trace, false);
+  std::cout << "Region trace " << csv.size() << " executions, converted "
+            << converted.size() << "\n";
+  if (csv.size() != NUM_ROUNDS * NUM_THREADS * REPS || converted != csv) {
+    std::cout << "Converted region trace differs\n";
+    passed = false;
+  }
+  std::string global_trace = "/trace-rank-0.csv";
+  auto global_csv = readTrace(traces_dir + global_trace, true);
+  if (global_csv.size() != csv.size() ||
+      readTrace(converted_dir + global_trace, true) != global_csv) {
+    std::cout << "Converted global trace differs\n";
+    passed = false;
+  }
+
+  if (passed)
+    std::cout << "PASSED\n";
+  else
+    std::cout << "FAILED\n";
+
+  std::cout << "=== Testing complete\n";
+
+  return 0;
+}